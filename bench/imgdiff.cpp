@@ -0,0 +1,48 @@
+/*
+ * imgdiff.cpp
+ *
+ * Computes the RMSE between two images of identical dimensions, with channel values scaled to [0, 1]. Used by the benchmark
+ * harness to check that optimisations do not change rendered output beyond sampling noise.
+ */
+
+#include "../src/core/Image.hpp"
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+int
+main(int argc, char ** argv)
+{
+  if (argc < 3)
+  {
+    std::cout << "Usage: " << argv[0] << " image.png reference.png [max_rmse]" << std::endl;
+    return 2;
+  }
+
+  Image a, b;
+  if (!a.load(argv[1], 3) || !b.load(argv[2], 3))
+    return 2;
+
+  if (!a.hasSameDimsAs(b))
+  {
+    std::cerr << "Image dimensions differ: " << a.width() << "x" << a.height() << " vs " << b.width() << "x" << b.height()
+              << std::endl;
+    return 2;
+  }
+
+  double sum = 0;
+  long n = (long)a.width() * a.height() * a.numChannels();
+  for (long i = 0; i < n; ++i)
+  {
+    double d = (a.data()[i] - b.data()[i]) / 255.0;
+    sum += d * d;
+  }
+
+  double rmse = std::sqrt(sum / n);
+  std::cout << rmse << std::endl;
+
+  if (argc >= 4 && rmse > std::atof(argv[3]))
+    return 1;
+
+  return 0;
+}
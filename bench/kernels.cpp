@@ -0,0 +1,309 @@
+/*
+ * kernels.cpp
+ *
+ * Microbenchmarks for the ray-primitive kernels in isolation: generates randomised ray/primitive sets and reports the time per
+ * test, the hit rate and the throughput of each intersection and normal kernel. Intersections are timed through both the
+ * single-precision Rayf/Hitf path the renderer uses and the double-precision Ray path. Run through 'make bench-kernels'.
+ */
+
+#include "../src/Primitives.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+// Small deterministic generator so every run tests the same rays and primitives.
+struct Rng
+{
+  unsigned long long state;
+
+  explicit Rng(unsigned long long seed) : state(seed * 6364136223846793005ULL + 1442695040888963407ULL) {}
+
+  double uniform(double lo, double hi)
+  {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return lo + (hi - lo) * ((state >> 11) * (1.0 / 9007199254740992.0));
+  }
+
+  Vec3 inBox(double extent) { return Vec3(uniform(-extent, extent), uniform(-extent, extent), uniform(-extent, extent)); }
+};
+
+struct Result
+{
+  double ns_per_test;
+  double hit_rate;
+  double checksum;
+};
+
+double
+secondsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void
+report(char const * kernel, char const * variant, Result const & r)
+{
+  std::printf("%-20s %-28s %10.2f %9.1f%% %12.2f   (checksum %g)\n", kernel, variant, r.ns_per_test, 100.0 * r.hit_rate,
+              1.0e3 / r.ns_per_test, r.checksum);
+}
+
+// Rays start well outside the primitives and aim at jittered points around a randomly chosen primitive centre, so a useful
+// fraction of the tests hit.
+std::vector<Ray>
+makeRays(Rng & rng, int count, double extent, std::vector<Vec3> const & centres, double aim_jitter)
+{
+  std::vector<Ray> rays;
+  rays.reserve(count);
+
+  for (int i = 0; i < count; ++i)
+  {
+    Vec3 origin = rng.inBox(extent) + Vec3(0, 0, 4 * extent);
+    int k = std::min((int)rng.uniform(0, (double)centres.size()), (int)centres.size() - 1);
+    Vec3 target = centres[k] + rng.inBox(aim_jitter);
+    rays.push_back(Ray::fromOriginAndEnd(origin, target));
+  }
+
+  return rays;
+}
+
+// One intersection test through the double-precision path, Primitive::intersect(Ray &), on a copy of the ray. The virtual
+// overloads dispatch as an accelerator's leaves do; the template ones call a concrete class directly.
+bool
+intersectOnce(Primitive * prim, Ray const & r, double & t)
+{
+  Ray ray(r);
+  if (!prim->intersect(ray))
+    return false;
+
+  t = ray.minT();
+  return true;
+}
+
+template <typename P>
+bool
+intersectOnce(P const & prim, Ray const & r, double & t)
+{
+  Ray ray(r);
+  if (!prim.P::intersect(ray))
+    return false;
+
+  t = ray.minT();
+  return true;
+}
+
+// One intersection test through the single-precision path, Primitive::intersect(Rayf const &, Hitf &), which is the one the
+// renderer traces through; the rays are converted to Rayf once, up front, as World does.
+bool
+intersectOnce(Primitive * prim, Rayf const & ray, double & t)
+{
+  Hitf hit(ray);
+  if (!prim->intersect(ray, hit))
+    return false;
+
+  t = hit.t;
+  return true;
+}
+
+template <typename P>
+bool
+intersectOnce(P const & prim, Rayf const & ray, double & t)
+{
+  Hitf hit(ray);
+  if (!prim.P::intersect(ray, hit))
+    return false;
+
+  t = hit.t;
+  return true;
+}
+
+// Times every ray against every primitive, for either kind of ray and either a pointer array or a contiguous array of concrete
+// primitives.
+template <typename P, typename R>
+Result
+timeIntersect(std::vector<P> const & prims, std::vector<R> const & rays, int repeats)
+{
+  long tests = 0, hits = 0;
+  double checksum = 0, t = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int r = 0; r < repeats; ++r)
+  {
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+      for (size_t j = 0; j < prims.size(); ++j)
+      {
+        if (intersectOnce(prims[j], rays[i], t))
+        {
+          ++hits;
+          checksum += t;
+        }
+        ++tests;
+      }
+    }
+  }
+  double seconds = secondsSince(start);
+
+  Result res = { 1.0e9 * seconds / tests, hits / (double)tests, checksum };
+  return res;
+}
+
+// Scales a result over primitives holding several elements each to the time per element. The hit rate stays per primitive.
+Result
+perElement(Result r, double elements_per_primitive)
+{
+  r.ns_per_test /= elements_per_primitive;
+  return r;
+}
+
+// Times calculateNormal at the hit points of the given rays, so the positions actually lie on the primitives.
+Result
+timeNormal(std::vector<Primitive *> const & prims, std::vector<Ray> const & rays, int repeats)
+{
+  std::vector<Primitive *> hit_prims;
+  std::vector<Vec3> hit_points;
+
+  for (size_t i = 0; i < rays.size(); ++i)
+  {
+    for (size_t j = 0; j < prims.size(); ++j)
+    {
+      Ray ray(rays[i]);
+      Ray world_ray(rays[i]);
+      if (prims[j]->intersect(ray))
+      {
+        hit_prims.push_back(prims[j]);
+        hit_points.push_back(world_ray.getPos(ray.minT()));
+      }
+    }
+  }
+
+  if (hit_points.empty())
+  {
+    Result res = { 0, 0, 0 };
+    return res;
+  }
+
+  double checksum = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int r = 0; r < repeats; ++r)
+  {
+    for (size_t i = 0; i < hit_points.size(); ++i)
+    {
+      Vec3 n = hit_prims[i]->calculateNormal(hit_points[i]);
+      checksum += n[0] + n[1] + n[2];
+    }
+  }
+  double seconds = secondsSince(start);
+
+  Result res = { 1.0e9 * seconds / ((double)repeats * hit_points.size()), 1, checksum };
+  return res;
+}
+
+} // namespace
+
+int
+main(int argc, char ** argv)
+{
+  int num_rays = 4096;
+  int num_prims = 16;
+  int repeats = 8;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (std::strcmp(argv[i], "-rays") == 0 && i + 1 < argc)
+      num_rays = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "-prims") == 0 && i + 1 < argc)
+      num_prims = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "-repeats") == 0 && i + 1 < argc)
+      repeats = std::atoi(argv[++i]);
+    else
+    {
+      std::printf("Usage: %s [-rays n] [-prims n] [-repeats n]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  Rng rng(1);
+  double const extent = 4;
+  Material mat(0.1f, 0.5f, 0.5f, 50.0f, 1.0f, 0.0f, 0.0f, 1.0f);
+  RGB color(1, 1, 1);
+
+  // Primitive sets: spheres and triangles placed through an identity transform, and through a translate + uniform scale, which
+  // is how the bundled scenes place almost everything. Spheres are also placed through a rotation and non-uniform scale, which
+  // needs the general matrix path, and packed eight at a time into SphereSets as the world does for translated and scaled ones.
+  std::vector<Primitive *> spheres_identity, spheres_similarity, spheres_general, sphere_sets, tris_identity, tris_similarity;
+  std::vector<Sphere> spheres_flat;
+  std::vector<Triangle> tris_flat;
+  std::vector<Vec3> centres;
+  MaterialTable materials;
+  uint32_t material = materials.add(color, mat);
+
+  for (int i = 0; i < num_prims; ++i)
+  {
+    Vec3 centre = rng.inBox(extent);
+    centres.push_back(centre);
+    double radius = rng.uniform(0.1, 0.5);
+    Mat4 xf = translation3D(centre) * scaling3D(Vec3(radius, radius, radius));
+
+    spheres_identity.push_back(new Sphere(radius, material, translation3D(centre)));
+    spheres_similarity.push_back(new Sphere(1.0, material, xf));
+    spheres_general.push_back(new Sphere(radius, material, translation3D(centre) * rotation3D(Vec3(1, 1, 0), 30)
+                                                           * scaling3D(Vec3(1, 0.8, 1.2))));
+    spheres_flat.push_back(Sphere(radius, material, translation3D(centre)));
+
+    if (sphere_sets.empty() || !static_cast<SphereSet *>(sphere_sets.back())->add(centre, radius, material))
+    {
+      sphere_sets.push_back(new SphereSet());
+      static_cast<SphereSet *>(sphere_sets.back())->add(centre, radius, material);
+    }
+
+    Vec3 v0 = centre + rng.inBox(1), v1 = centre + rng.inBox(1), v2 = centre + rng.inBox(1);
+    tris_identity.push_back(new Triangle(v0, v1, v2, material, identity3D()));
+    tris_flat.push_back(Triangle(v0, v1, v2, material, identity3D()));
+    tris_similarity.push_back(new Triangle(v0 - centre, v1 - centre, v2 - centre, material, translation3D(centre)));
+  }
+
+  std::vector<Ray> rays = makeRays(rng, num_rays, extent, centres, 0.5);
+  std::vector<Rayf> rays_f;
+  for (size_t i = 0; i < rays.size(); ++i)
+    rays_f.push_back(Rayf(rays[i]));
+
+  std::printf("%d rays x %d primitives x %d repeats\n", num_rays, num_prims, repeats);
+
+  std::printf("\nRayf/Hitf path: intersect(Rayf const &, Hitf &), which World and the accelerators trace through\n");
+  std::printf("(rotate+stretch spheres convert to Ray inside)\n\n");
+  std::printf("%-20s %-28s %10s %10s %12s\n", "kernel", "variant", "ns/test", "hit rate", "Mtests/s");
+  report("Sphere::intersect", "translate, pointer array", timeIntersect(spheres_identity, rays_f, repeats));
+  report("Sphere::intersect", "translate+scale, ptr array", timeIntersect(spheres_similarity, rays_f, repeats));
+  report("Sphere::intersect", "rotate+stretch, ptr array", timeIntersect(spheres_general, rays_f, repeats));
+  report("Sphere::intersect", "translate, contiguous", timeIntersect(spheres_flat, rays_f, repeats));
+  report("SphereSet::intersect", "per sphere, hit rate per set",
+         perElement(timeIntersect(sphere_sets, rays_f, repeats), num_prims / (double)sphere_sets.size()));
+  report("Triangle::intersect", "identity, pointer array", timeIntersect(tris_identity, rays_f, repeats));
+  report("Triangle::intersect", "translate, pointer array", timeIntersect(tris_similarity, rays_f, repeats));
+  report("Triangle::intersect", "identity, contiguous", timeIntersect(tris_flat, rays_f, repeats));
+
+  std::printf("\nRay path: intersect(Ray &) in double precision, which rendering no longer uses\n");
+  std::printf("(Triangle converts each ray to Rayf inside)\n\n");
+  std::printf("%-20s %-28s %10s %10s %12s\n", "kernel", "variant", "ns/test", "hit rate", "Mtests/s");
+  report("Sphere::intersect", "translate, pointer array", timeIntersect(spheres_identity, rays, repeats));
+  report("Sphere::intersect", "translate+scale, ptr array", timeIntersect(spheres_similarity, rays, repeats));
+  report("Sphere::intersect", "rotate+stretch, ptr array", timeIntersect(spheres_general, rays, repeats));
+  report("Sphere::intersect", "translate, contiguous", timeIntersect(spheres_flat, rays, repeats));
+  report("SphereSet::intersect", "per sphere, hit rate per set",
+         perElement(timeIntersect(sphere_sets, rays, repeats), num_prims / (double)sphere_sets.size()));
+  report("Triangle::intersect", "identity, pointer array", timeIntersect(tris_identity, rays, repeats));
+  report("Triangle::intersect", "translate, pointer array", timeIntersect(tris_similarity, rays, repeats));
+  report("Triangle::intersect", "identity, contiguous", timeIntersect(tris_flat, rays, repeats));
+
+  std::printf("\nNormals, at the hit points of the Ray path\n\n");
+  std::printf("%-20s %-28s %10s %10s %12s\n", "kernel", "variant", "ns/test", "hit rate", "Mtests/s");
+  report("Sphere::normal", "translate", timeNormal(spheres_identity, rays, repeats));
+  report("Sphere::normal", "translate+scale", timeNormal(spheres_similarity, rays, repeats));
+  report("Sphere::normal", "rotate+stretch", timeNormal(spheres_general, rays, repeats));
+  report("Triangle::normal", "identity", timeNormal(tris_identity, rays, repeats));
+  report("Triangle::normal", "translate", timeNormal(tris_similarity, rays, repeats));
+
+  return 0;
+}
@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Renders the bundled scenes at fixed settings with a fixed seed, reporting wall time and ray throughput, and checks each image
+# against the reference render in bench/reference. Run through 'make bench' from the repository root.
+#
+# 'bench/run_bench.sh -update' re-renders the reference images instead of comparing against them.
+#
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$BENCH_DIR")
+TRACE="$ROOT/trace"
+IMGDIFF="$BENCH_DIR/imgdiff"
+OUT_DIR="$BENCH_DIR/out"
+REF_DIR="$BENCH_DIR/reference"
+
+SIZE="128 128"
+RPP=2
+SEED=1
+MAX_RMSE=${MAX_RMSE:-0.02}
+
+# scene name and max trace depth, matching the settings in README
+SCENES="scene4_refraction:5 scene5_refraction:5 scene5_arealight:2 teapot:2 dunkit:2"
+
+UPDATE=0
+if [ "$1" = "-update" ]; then
+  UPDATE=1
+fi
+
+mkdir -p "$OUT_DIR" "$REF_DIR"
+cd "$ROOT/data" || exit 1
+
+printf "%-20s %6s %10s %10s %12s %10s %10s\n" "scene" "depth" "wall(s)" "render(s)" "rays" "Mrays/s" "rmse"
+
+status=0
+for entry in $SCENES; do
+  name=${entry%%:*}
+  depth=${entry##*:}
+  if [ $UPDATE -eq 1 ]; then
+    out="$REF_DIR/$name.png"
+  else
+    out="$OUT_DIR/$name.png"
+  fi
+
+  start=$(date +%s%N)
+  log=$("$TRACE" "$name.scd" "$out" "$depth" -size $SIZE -rpp $RPP -seed $SEED)
+  if [ $? -ne 0 ]; then
+    echo "$name: render failed"
+    status=1
+    continue
+  fi
+  end=$(date +%s%N)
+  wall=$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.2f", (e - s) / 1e9 }')
+
+  render=$(echo "$log" | awk '/^Render time:/ { printf "%.2f", $3 }')
+  rays=$(echo "$log" | awk '/^Rays traced:/ { print $3 }')
+  mrays=$(echo "$log" | awk '/^Rays traced:/ { gsub(/\(/, "", $4); printf "%.3f", $4 }')
+
+  if [ $UPDATE -eq 1 ]; then
+    rmse="-"
+  else
+    rmse=$("$IMGDIFF" "$out" "$REF_DIR/$name.png" "$MAX_RMSE")
+    if [ $? -ne 0 ]; then
+      rmse="$rmse FAIL"
+      status=1
+    fi
+  fi
+
+  printf "%-20s %6s %10s %10s %12s %10s %10s\n" "$name" "$depth" "$wall" "$render" "$rays" "$mrays" "$rmse"
+done
+
+exit $status
@@ -0,0 +1,1510 @@
+/*
+ * BVH.cpp
+ *
+ * Spatial indices over the primitives of the world, for finding the primitives a ray hits without testing every one.
+ */
+
+#include "BVH.hpp"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE__) && !defined(ALGEBRA3_NO_SIMD)
+#  define BVH_SSE
+#  include <immintrin.h>
+#endif
+
+namespace {
+
+int const NUM_BINS = 16;        // candidate split planes per axis, less one
+int const MAX_SAH_DEPTH = 48;   // below this depth, split at the median instead, which bounds the depth of the tree
+double const MIN_SPATIAL_OVERLAP = 1e-5;  // spatial splits are tried where the halves overlap by this much of the root's area
+
+// Far hit times of child boxes are scaled up by this much, so that rounding in the slab test never culls a box the ray touches:
+// 1 + 2 gamma(3) from Ize, "Robust BVH Ray Traversal" (2013).
+float const ROBUST_SCALE = 1.0000004f;
+
+struct CentreLess
+{
+  int axis;
+
+  template <typename R> bool operator()(R const & a, R const & b) const
+  {
+    return a.lo[axis] + a.hi[axis] < b.lo[axis] + b.hi[axis];
+  }
+};
+
+double
+surfaceArea(Vec3 const & lo, Vec3 const & hi)
+{
+  Vec3 d = hi - lo;
+  return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+double
+overlapArea(Vec3 const & lo0, Vec3 const & hi0, Vec3 const & lo1, Vec3 const & hi1)
+{
+  Vec3 lo = max(lo0, lo1), hi = min(hi0, hi1);
+  if (lo[0] > hi[0] || lo[1] > hi[1] || lo[2] > hi[2])
+    return 0;
+
+  return surfaceArea(lo, hi);
+}
+
+template <typename R>
+bool
+isEmpty(R const & ref)
+{
+  return ref.lo[0] > ref.hi[0] || ref.lo[1] > ref.hi[1] || ref.lo[2] > ref.hi[2];
+}
+
+template <typename R>
+void
+boundsOf(std::vector<R> const & refs, Vec3 & lo, Vec3 & hi)
+{
+  lo = refs[0].lo;
+  hi = refs[0].hi;
+  for (size_t i = 1; i < refs.size(); ++i)
+  {
+    lo = min(lo, refs[i].lo);
+    hi = max(hi, refs[i].hi);
+  }
+}
+
+// Convert bounds to single precision, rounding outwards and padding by a small fraction of their size, so that the hits found
+// by the primitives' own tests never lie outside the box the traversal tests.
+void
+toFloatBounds(Vec3 const & lo, Vec3 const & hi, float * flo, float * fhi)
+{
+  Vec3 d = hi - lo;
+  double size = std::max(d[0], std::max(d[1], d[2]));
+  for (int a = 0; a < 3; ++a)
+  {
+    double pad = 1e-6 * (size + std::max(std::fabs(lo[a]), std::fabs(hi[a])));
+    flo[a] = (float)(lo[a] - pad);
+    if (flo[a] > lo[a] - pad)
+      flo[a] = std::nextafter(flo[a], -std::numeric_limits<float>::infinity());
+    fhi[a] = (float)(hi[a] + pad);
+    if (fhi[a] < hi[a] + pad)
+      fhi[a] = std::nextafter(fhi[a], std::numeric_limits<float>::infinity());
+  }
+}
+
+// A ray set up for slab tests: for each axis, which row of a node's bounds holds the plane the ray enters by and which the plane
+// it leaves by.
+struct NodeRay
+{
+  float org[3];
+  float inv[3];
+  int near[3];
+  int far[3];
+
+  NodeRay() {}
+
+  explicit NodeRay(Rayf const & ray)
+  {
+    Vec3f inv_dir = ray.inverseDirection();
+    for (int a = 0; a < 3; ++a)
+    {
+      org[a] = ray.org[a];
+      inv[a] = inv_dir[a];
+      near[a] = inv[a] < 0 ? 3 + a : a;
+      far[a] = inv[a] < 0 ? a : 3 + a;
+    }
+  }
+};
+
+// Test a ray against the N child boxes of a node, up to hit time t_max. Returns a bit mask of the children hit, and sets the
+// entry time into each of them.
+template <int N>
+int
+intersectChildren(float const (&b)[6][N], NodeRay const & r, float t_max, float * t_near)
+{
+  int mask = 0;
+  for (int i = 0; i < N; ++i)
+  {
+    float t0 = std::max(std::max((b[r.near[0]][i] - r.org[0]) * r.inv[0], (b[r.near[1]][i] - r.org[1]) * r.inv[1]),
+                        std::max((b[r.near[2]][i] - r.org[2]) * r.inv[2], 0.0f));
+    float t1 = std::min(std::min((b[r.far[0]][i] - r.org[0]) * r.inv[0], (b[r.far[1]][i] - r.org[1]) * r.inv[1]),
+                        (b[r.far[2]][i] - r.org[2]) * r.inv[2]);
+    t1 = std::min(t1 * ROBUST_SCALE, t_max);
+    t_near[i] = t0;
+    if (t0 <= t1)
+      mask |= 1 << i;
+  }
+
+  return mask;
+}
+
+// Test a ray against child \a i of a node alone, as intersectChildren() does against all of them.
+template <int N>
+bool
+intersectChild(float const (&b)[6][N], int i, NodeRay const & r, float t_max)
+{
+  float t0 = std::max(std::max((b[r.near[0]][i] - r.org[0]) * r.inv[0], (b[r.near[1]][i] - r.org[1]) * r.inv[1]),
+                      std::max((b[r.near[2]][i] - r.org[2]) * r.inv[2], 0.0f));
+  float t1 = std::min(std::min((b[r.far[0]][i] - r.org[0]) * r.inv[0], (b[r.far[1]][i] - r.org[1]) * r.inv[1]),
+                      (b[r.far[2]][i] - r.org[2]) * r.inv[2]);
+  return t0 <= std::min(t1 * ROBUST_SCALE, t_max);
+}
+
+#ifdef BVH_SSE
+
+template <>
+int
+intersectChildren<4>(float const (&b)[6][4], NodeRay const & r, float t_max, float * t_near)
+{
+  __m128 tn[3], tf[3];
+  for (int a = 0; a < 3; ++a)
+  {
+    __m128 o = _mm_set1_ps(r.org[a]), inv = _mm_set1_ps(r.inv[a]);
+    tn[a] = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b[r.near[a]]), o), inv);
+    tf[a] = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b[r.far[a]]), o), inv);
+  }
+
+  __m128 t0 = _mm_max_ps(_mm_max_ps(tn[0], tn[1]), _mm_max_ps(tn[2], _mm_setzero_ps()));
+  __m128 t1 = _mm_min_ps(_mm_min_ps(tf[0], tf[1]), tf[2]);
+  t1 = _mm_min_ps(_mm_mul_ps(t1, _mm_set1_ps(ROBUST_SCALE)), _mm_set1_ps(t_max));
+  _mm_storeu_ps(t_near, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+#endif
+
+#ifdef ALGEBRA3_AVX
+
+template <>
+int
+intersectChildren<8>(float const (&b)[6][8], NodeRay const & r, float t_max, float * t_near)
+{
+  __m256 tn[3], tf[3];
+  for (int a = 0; a < 3; ++a)
+  {
+    __m256 o = _mm256_set1_ps(r.org[a]), inv = _mm256_set1_ps(r.inv[a]);
+    tn[a] = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(b[r.near[a]]), o), inv);
+    tf[a] = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(b[r.far[a]]), o), inv);
+  }
+
+  __m256 t0 = _mm256_max_ps(_mm256_max_ps(tn[0], tn[1]), _mm256_max_ps(tn[2], _mm256_setzero_ps()));
+  __m256 t1 = _mm256_min_ps(_mm256_min_ps(tf[0], tf[1]), tf[2]);
+  t1 = _mm256_min_ps(_mm256_mul_ps(t1, _mm256_set1_ps(ROBUST_SCALE)), _mm256_set1_ps(t_max));
+  _mm256_storeu_ps(t_near, t0);
+  return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+
+#endif
+
+// Get the octant a ray heads into, as the sign bits of its direction, which are also those of its reciprocal direction.
+int
+octantOf(Rayf const & ray)
+{
+  return (std::signbit(ray.dir.x) ? 1 : 0) | (std::signbit(ray.dir.y) ? 2 : 0) | (std::signbit(ray.dir.z) ? 4 : 0);
+}
+
+// The range of the origins and reciprocal directions of a packet of rays heading into the same octant, so sharing the rows of
+// a node's bounds they enter and leave by.
+struct PacketBounds
+{
+  float org_lo[3], org_hi[3];
+  float inv_lo[3], inv_hi[3];
+  int near[3];
+  int far[3];
+  bool finite;  // false if a ray runs parallel to an axis, when the range says nothing useful
+
+  PacketBounds(NodeRay const * rays, int first, int end)
+  {
+    finite = true;
+    for (int a = 0; a < 3; ++a)
+    {
+      near[a] = rays[first].near[a];
+      far[a] = rays[first].far[a];
+      org_lo[a] = org_hi[a] = rays[first].org[a];
+      inv_lo[a] = inv_hi[a] = rays[first].inv[a];
+      for (int r = first + 1; r < end; ++r)
+      {
+        org_lo[a] = std::min(org_lo[a], rays[r].org[a]);
+        org_hi[a] = std::max(org_hi[a], rays[r].org[a]);
+        inv_lo[a] = std::min(inv_lo[a], rays[r].inv[a]);
+        inv_hi[a] = std::max(inv_hi[a], rays[r].inv[a]);
+      }
+      finite = finite && std::isfinite(inv_lo[a]) && std::isfinite(inv_hi[a]);
+    }
+  }
+};
+
+// Test a packet of rays against the N child boxes of a node, up to hit time t_max, by interval arithmetic over the packet's
+// bounds. Returns a bit mask of the children some ray may enter: each bound on a slab time is the extreme of the times at the
+// corners of the range, and rounding is monotonic, so any child intersectChildren() finds for a ray of the packet is in it.
+template <int N>
+int
+intersectChildrenPacket(float const (&b)[6][N], PacketBounds const & p, float t_max)
+{
+  int mask = 0;
+  for (int i = 0; i < N; ++i)
+  {
+    float t0 = 0, t1 = std::numeric_limits<float>::infinity();
+    for (int a = 0; a < 3; ++a)
+    {
+      float n0 = b[p.near[a]][i] - p.org_hi[a], n1 = b[p.near[a]][i] - p.org_lo[a];
+      float f0 = b[p.far[a]][i] - p.org_hi[a], f1 = b[p.far[a]][i] - p.org_lo[a];
+      t0 = std::max(t0, std::min(std::min(n0 * p.inv_lo[a], n0 * p.inv_hi[a]), std::min(n1 * p.inv_lo[a], n1 * p.inv_hi[a])));
+      t1 = std::min(t1, std::max(std::max(f0 * p.inv_lo[a], f0 * p.inv_hi[a]), std::max(f1 * p.inv_lo[a], f1 * p.inv_hi[a])));
+    }
+    t1 = std::min(t1 * ROBUST_SCALE, t_max);
+    if (t0 <= t1)
+      mask |= 1 << i;
+  }
+
+  return mask;
+}
+
+// Get 2^exponent, for exponents within the range of normal floats, by building its bits.
+inline float
+powerOfTwo(int exponent)
+{
+  uint32_t bits = (uint32_t)(exponent + 127) << 23;
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+#ifdef BVH_SSE
+
+// Decode four bytes of quantised bounds to floats.
+inline __m128
+decodeQuantised4(uint8_t const * q)
+{
+  int packed;
+  std::memcpy(&packed, q, sizeof(packed));
+  __m128i zero = _mm_setzero_si128();
+  __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+}
+
+#endif
+
+// Test a ray against the children of a compressed node, as intersectChildren() does for a node stored in full. Each bound is
+// decoded as origin + q * 2^exponent, where the product is exact, so the decoded value is the one the node was built to.
+template <typename CompressedNode>
+int
+intersectQuantised(CompressedNode const & node, NodeRay const & r, float t_max, float * t_near)
+{
+  float scale[3];
+  for (int a = 0; a < 3; ++a)
+    scale[a] = powerOfTwo(node.exponent[a]);
+
+#if defined(__AVX2__) && !defined(ALGEBRA3_NO_SIMD)
+  __m256 tn[3], tf[3];
+  for (int a = 0; a < 3; ++a)
+  {
+    __m256 origin = _mm256_set1_ps(node.origin[a]), s = _mm256_set1_ps(scale[a]);
+    __m256 o = _mm256_set1_ps(r.org[a]), inv = _mm256_set1_ps(r.inv[a]);
+    __m256 qn = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *)node.q[r.near[a]])));
+    __m256 qf = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *)node.q[r.far[a]])));
+    tn[a] = _mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(origin, _mm256_mul_ps(qn, s)), o), inv);
+    tf[a] = _mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(origin, _mm256_mul_ps(qf, s)), o), inv);
+  }
+
+  __m256 t0 = _mm256_max_ps(_mm256_max_ps(tn[0], tn[1]), _mm256_max_ps(tn[2], _mm256_setzero_ps()));
+  __m256 t1 = _mm256_min_ps(_mm256_min_ps(tf[0], tf[1]), tf[2]);
+  t1 = _mm256_min_ps(_mm256_mul_ps(t1, _mm256_set1_ps(ROBUST_SCALE)), _mm256_set1_ps(t_max));
+  _mm256_storeu_ps(t_near, t0);
+  return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#elif defined(BVH_SSE)
+  // two halves of four children
+  int mask = 0;
+  for (int h = 0; h < 8; h += 4)
+  {
+    __m128 tn[3], tf[3];
+    for (int a = 0; a < 3; ++a)
+    {
+      __m128 origin = _mm_set1_ps(node.origin[a]), s = _mm_set1_ps(scale[a]);
+      __m128 o = _mm_set1_ps(r.org[a]), inv = _mm_set1_ps(r.inv[a]);
+      __m128 qn = decodeQuantised4(node.q[r.near[a]] + h), qf = decodeQuantised4(node.q[r.far[a]] + h);
+      tn[a] = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(qn, s)), o), inv);
+      tf[a] = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(qf, s)), o), inv);
+    }
+
+    __m128 t0 = _mm_max_ps(_mm_max_ps(tn[0], tn[1]), _mm_max_ps(tn[2], _mm_setzero_ps()));
+    __m128 t1 = _mm_min_ps(_mm_min_ps(tf[0], tf[1]), tf[2]);
+    t1 = _mm_min_ps(_mm_mul_ps(t1, _mm_set1_ps(ROBUST_SCALE)), _mm_set1_ps(t_max));
+    _mm_storeu_ps(t_near + h, t0);
+    mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << h;
+  }
+
+  return mask;
+#else
+  float b[6][8];
+  for (int row = 0; row < 6; ++row)
+  {
+    for (int c = 0; c < 8; ++c)
+      b[row][c] = node.origin[row % 3] + node.q[row][c] * scale[row % 3];
+  }
+
+  return intersectChildren<8>(b, r, t_max, t_near);
+#endif
+}
+
+} // namespace
+
+Accelerator::~Accelerator()
+{
+}
+
+void
+Accelerator::intersectBatch(Rayf const * rays, Hitf * hits, int n) const
+{
+  for (int i = 0; i < n; ++i)
+    intersect(rays[i], hits[i]);
+}
+
+void
+Accelerator::occludedBatch(Rayf const * rays, Hitf * hits, int n) const
+{
+  for (int i = 0; i < n; ++i)
+  {
+    uint32_t prim, element;
+    if (occluded(rays[i], prim, element))
+    {
+      hits[i].prim = prim;
+      hits[i].element = element;
+    }
+  }
+}
+
+Accelerator *
+Accelerator::create(std::string const & name, double split_budget)
+{
+  if (name == "bvh4")
+    return new WideBVH<4>(split_budget);
+  else if (name == "bvh8")
+    return new WideBVH<8>(split_budget);
+  else if (name == "cbvh")
+    return new CompressedBVH(split_budget);
+
+  return NULL;
+}
+
+//=============================================================================================================================
+// Construction
+//=============================================================================================================================
+
+BVHBuilder::BVHBuilder(int width, int max_leaf_size, double split_budget)
+: width_(std::max(2, std::min(width, BVHBuildNode::MAX_WIDTH))), max_leaf_size_(std::max(1, max_leaf_size)),
+  split_budget_(std::max(0.0, split_budget)), spare_references_(0), root_area_(0)
+{
+}
+
+void
+BVHBuilder::build(std::vector<Primitive *> const & prims)
+{
+  nodes_.clear();
+  leaf_prims_.clear();
+  if (prims.empty())
+    return;
+
+  std::vector<Reference> refs(prims.size());
+  for (size_t i = 0; i < prims.size(); ++i)
+  {
+    prims[i]->getBounds(refs[i].lo, refs[i].hi);
+    refs[i].prim = (uint32_t)i;
+  }
+
+  // spatial splits clip triangles exactly, and other primitives by their bounds
+  spare_references_ = (size_t)(split_budget_ * prims.size());
+  triangles_.clear();
+  is_triangle_.assign(prims.size(), 0);
+  if (spare_references_ > 0)
+  {
+    triangles_.resize(3 * prims.size());
+    for (size_t i = 0; i < prims.size(); ++i)
+      is_triangle_[i] = prims[i]->getWorldTriangle(triangles_[3 * i], triangles_[3 * i + 1], triangles_[3 * i + 2]);
+  }
+
+  Vec3 lo, hi;
+  boundsOf(refs, lo, hi);
+  root_area_ = surfaceArea(lo, hi);
+
+  leaf_prims_.reserve(prims.size() + spare_references_);
+  buildNode(refs, 0);
+}
+
+int
+BVHBuilder::buildNode(std::vector<Reference> & refs, int depth)
+{
+  int index = (int)nodes_.size();
+  nodes_.push_back(BVHBuildNode());
+
+  // Split the largest group until the node is full or every group fits in a leaf
+  std::vector< std::vector<Reference> > groups(1);
+  groups[0].swap(refs);
+  while ((int)groups.size() < width_)
+  {
+    int largest = -1;
+    double largest_area = -1;
+    for (int g = 0; g < (int)groups.size(); ++g)
+    {
+      if ((int)groups[g].size() <= max_leaf_size_)
+        continue;
+
+      Vec3 lo, hi;
+      boundsOf(groups[g], lo, hi);
+      double area = surfaceArea(lo, hi);
+      if (area > largest_area)
+      {
+        largest = g;
+        largest_area = area;
+      }
+    }
+
+    if (largest < 0)
+      break;
+
+    std::vector<Reference> left, right;
+    split(groups[largest], left, right, depth);
+    groups[largest].swap(left);
+    groups.push_back(std::vector<Reference>());
+    groups.back().swap(right);
+  }
+
+  int num_children = (int)groups.size();
+  for (int c = 0; c < num_children; ++c)
+  {
+    Vec3 lo, hi;
+    boundsOf(groups[c], lo, hi);
+
+    int child = -1;
+    uint32_t first = 0, count = 0;
+    if ((int)groups[c].size() <= max_leaf_size_)
+    {
+      first = (uint32_t)leaf_prims_.size();
+      count = (uint32_t)groups[c].size();
+      for (size_t i = 0; i < groups[c].size(); ++i)
+        leaf_prims_.push_back(groups[c][i].prim);
+    }
+    else
+      child = buildNode(groups[c], depth + 1);
+
+    // nodes_ may have been reallocated by the recursion
+    BVHBuildNode & node = nodes_[index];
+    node.lo[c] = lo;
+    node.hi[c] = hi;
+    node.child[c] = child;
+    node.first[c] = first;
+    node.count[c] = count;
+  }
+
+  nodes_[index].num_children = num_children;
+  return index;
+}
+
+void
+BVHBuilder::split(std::vector<Reference> & refs, std::vector<Reference> & left, std::vector<Reference> & right, int depth)
+{
+  Vec3 clo = 0.5 * (refs[0].lo + refs[0].hi), chi = clo;
+  for (size_t i = 1; i < refs.size(); ++i)
+  {
+    Vec3 centre = 0.5 * (refs[i].lo + refs[i].hi);
+    clo = min(clo, centre);
+    chi = max(chi, centre);
+  }
+
+  // Find the binned plane with the least surface area cost, over all three axes
+  int best_axis = -1, best_bin = 0;
+  double best_cost = std::numeric_limits<double>::infinity();
+  Vec3 best_llo, best_lhi, best_rlo, best_rhi;
+  for (int a = 0; a < 3 && depth < MAX_SAH_DEPTH; ++a)
+  {
+    double extent = chi[a] - clo[a];
+    if (extent <= 0)
+      continue;
+
+    int count[NUM_BINS] = { 0 };
+    Vec3 lo[NUM_BINS], hi[NUM_BINS];
+    for (size_t i = 0; i < refs.size(); ++i)
+    {
+      double centre = 0.5 * (refs[i].lo[a] + refs[i].hi[a]);
+      int b = std::min((int)((centre - clo[a]) / extent * NUM_BINS), NUM_BINS - 1);
+      lo[b] = count[b] ? min(lo[b], refs[i].lo) : refs[i].lo;
+      hi[b] = count[b] ? max(hi[b], refs[i].hi) : refs[i].hi;
+      ++count[b];
+    }
+
+    // bounds and count on the right of each plane, swept from the right, then on the left, swept from the left
+    Vec3 right_lo[NUM_BINS], right_hi[NUM_BINS];
+    int right_count[NUM_BINS];
+    int n = 0;
+    for (int b = NUM_BINS - 1; b > 0; --b)
+    {
+      if (count[b])
+      {
+        right_lo[b] = n ? min(right_lo[b + 1], lo[b]) : lo[b];
+        right_hi[b] = n ? max(right_hi[b + 1], hi[b]) : hi[b];
+        n += count[b];
+      }
+      else if (n)
+      {
+        right_lo[b] = right_lo[b + 1];
+        right_hi[b] = right_hi[b + 1];
+      }
+      right_count[b] = n;
+    }
+
+    Vec3 llo, lhi;
+    n = 0;
+    for (int b = 0; b < NUM_BINS - 1; ++b)
+    {
+      if (count[b])
+      {
+        llo = n ? min(llo, lo[b]) : lo[b];
+        lhi = n ? max(lhi, hi[b]) : hi[b];
+        n += count[b];
+      }
+
+      if (n == 0 || right_count[b + 1] == 0)
+        continue;
+
+      double cost = surfaceArea(llo, lhi) * n + surfaceArea(right_lo[b + 1], right_hi[b + 1]) * right_count[b + 1];
+      if (cost < best_cost)
+      {
+        best_cost = cost;
+        best_axis = a;
+        best_bin = b;
+        best_llo = llo;
+        best_lhi = lhi;
+        best_rlo = right_lo[b + 1];
+        best_rhi = right_hi[b + 1];
+      }
+    }
+  }
+
+  // Where the halves would overlap much, relative to the whole scene, see whether cutting through the primitives does better
+  if (spare_references_ > 0 && depth < MAX_SAH_DEPTH)
+  {
+    double overlap = best_axis >= 0 ? overlapArea(best_llo, best_lhi, best_rlo, best_rhi) : root_area_;
+    if (overlap > MIN_SPATIAL_OVERLAP * root_area_ && spatialSplit(refs, left, right, best_cost))
+      return;
+  }
+
+  if (best_axis >= 0)
+  {
+    double extent = chi[best_axis] - clo[best_axis];
+    for (size_t i = 0; i < refs.size(); ++i)
+    {
+      double centre = 0.5 * (refs[i].lo[best_axis] + refs[i].hi[best_axis]);
+      int b = std::min((int)((centre - clo[best_axis]) / extent * NUM_BINS), NUM_BINS - 1);
+      (b <= best_bin ? left : right).push_back(refs[i]);
+    }
+
+    std::vector<Reference>().swap(refs);
+    return;
+  }
+
+  // No useful plane (all centres coincide, or the tree is too deep): split at the median of the widest axis of the centres
+  Vec3 extent = chi - clo;
+  CentreLess less;
+  less.axis = (extent[0] > extent[1] && extent[0] > extent[2]) ? 0 : (extent[1] > extent[2] ? 1 : 2);
+  size_t mid = refs.size() / 2;
+  std::nth_element(refs.begin(), refs.begin() + mid, refs.end(), less);
+  left.assign(refs.begin(), refs.begin() + mid);
+  right.assign(refs.begin() + mid, refs.end());
+  std::vector<Reference>().swap(refs);
+}
+
+bool
+BVHBuilder::spatialSplit(std::vector<Reference> & refs, std::vector<Reference> & left, std::vector<Reference> & right,
+                         double cost_to_beat)
+{
+  Vec3 node_lo, node_hi;
+  boundsOf(refs, node_lo, node_hi);
+
+  // Bin the references by the part of them in each of a set of equal slabs, counting each in the slabs it enters and leaves
+  int best_axis = -1;
+  double best_plane = 0, best_cost = cost_to_beat;
+  for (int a = 0; a < 3; ++a)
+  {
+    double extent = node_hi[a] - node_lo[a];
+    if (extent <= 0)
+      continue;
+
+    double width = extent / NUM_BINS;
+    int entries[NUM_BINS] = { 0 }, exits[NUM_BINS] = { 0 };
+    bool filled[NUM_BINS] = { false };
+    Vec3 lo[NUM_BINS], hi[NUM_BINS];
+    for (size_t i = 0; i < refs.size(); ++i)
+    {
+      int first = std::max(0, std::min((int)((refs[i].lo[a] - node_lo[a]) / width), NUM_BINS - 1));
+      int last = std::max(first, std::min((int)((refs[i].hi[a] - node_lo[a]) / width), NUM_BINS - 1));
+      Reference rest = refs[i], piece;
+      for (int b = first; b <= last; ++b)
+      {
+        if (b < last)
+          splitReference(Reference(rest), a, node_lo[a] + (b + 1) * width, piece, rest);
+        else
+          piece = rest;
+
+        if (isEmpty(piece))
+          continue;
+
+        lo[b] = filled[b] ? min(lo[b], piece.lo) : piece.lo;
+        hi[b] = filled[b] ? max(hi[b], piece.hi) : piece.hi;
+        filled[b] = true;
+        if (isEmpty(rest))
+          break;
+      }
+
+      ++entries[first];
+      ++exits[last];
+    }
+
+    // as for the object split, sweep from the right then from the left
+    Vec3 right_lo[NUM_BINS], right_hi[NUM_BINS];
+    int right_count[NUM_BINS];
+    int n = 0;
+    bool any = false;
+    for (int b = NUM_BINS - 1; b > 0; --b)
+    {
+      if (filled[b])
+      {
+        right_lo[b] = any ? min(right_lo[b + 1], lo[b]) : lo[b];
+        right_hi[b] = any ? max(right_hi[b + 1], hi[b]) : hi[b];
+        any = true;
+      }
+      else if (any)
+      {
+        right_lo[b] = right_lo[b + 1];
+        right_hi[b] = right_hi[b + 1];
+      }
+      n += exits[b];
+      right_count[b] = any ? n : 0;
+    }
+
+    Vec3 llo(0, 0, 0), lhi(0, 0, 0);
+    n = 0;
+    any = false;
+    for (int b = 0; b < NUM_BINS - 1; ++b)
+    {
+      if (filled[b])
+      {
+        llo = any ? min(llo, lo[b]) : lo[b];
+        lhi = any ? max(lhi, hi[b]) : hi[b];
+        any = true;
+      }
+      n += entries[b];
+
+      if (!any || n == 0 || right_count[b + 1] == 0)
+        continue;
+
+      double cost = surfaceArea(llo, lhi) * n + surfaceArea(right_lo[b + 1], right_hi[b + 1]) * right_count[b + 1];
+      if (cost < best_cost)
+      {
+        best_cost = cost;
+        best_axis = a;
+        best_plane = node_lo[a] + (b + 1) * width;
+      }
+    }
+  }
+
+  if (best_axis < 0)
+    return false;
+
+  // Split the references the plane crosses, as long as both halves shrink and the duplicates fit in the budget
+  std::vector<Reference> l, r;
+  size_t duplicates = 0;
+  for (size_t i = 0; i < refs.size(); ++i)
+  {
+    if (refs[i].hi[best_axis] <= best_plane)
+      l.push_back(refs[i]);
+    else if (refs[i].lo[best_axis] >= best_plane)
+      r.push_back(refs[i]);
+    else
+    {
+      Reference lpart, rpart;
+      splitReference(refs[i], best_axis, best_plane, lpart, rpart);
+      if (!isEmpty(lpart))
+        l.push_back(lpart);
+      if (!isEmpty(rpart))
+        r.push_back(rpart);
+      duplicates += !isEmpty(lpart) && !isEmpty(rpart);
+    }
+  }
+
+  if (l.empty() || r.empty() || duplicates > spare_references_)
+    return false;
+
+  left.swap(l);
+  right.swap(r);
+  spare_references_ -= duplicates;
+  std::vector<Reference>().swap(refs);
+  return true;
+}
+
+void
+BVHBuilder::splitReference(Reference const & ref, int axis, double plane, Reference & left, Reference & right) const
+{
+  left = ref;
+  right = ref;
+  left.hi[axis] = std::min(ref.hi[axis], plane);
+  right.lo[axis] = std::max(ref.lo[axis], plane);
+  if (!is_triangle_[ref.prim])
+    return;
+
+  // Bound the triangle's vertices on each side of the plane, and the points where its edges cross it
+  double const inf = std::numeric_limits<double>::infinity();
+  Vec3 llo(inf, inf, inf), lhi(-inf, -inf, -inf), rlo = llo, rhi = lhi;
+  Vec3 const * v = &triangles_[3 * ref.prim];
+  for (int i = 0; i < 3; ++i)
+  {
+    Vec3 const & v0 = v[i];
+    Vec3 const & v1 = v[(i + 1) % 3];
+    if (v0[axis] <= plane)
+    {
+      llo = min(llo, v0);
+      lhi = max(lhi, v0);
+    }
+    if (v0[axis] >= plane)
+    {
+      rlo = min(rlo, v0);
+      rhi = max(rhi, v0);
+    }
+
+    if ((v0[axis] < plane && v1[axis] > plane) || (v0[axis] > plane && v1[axis] < plane))
+    {
+      Vec3 p = v0 + ((plane - v0[axis]) / (v1[axis] - v0[axis])) * (v1 - v0);
+      p[axis] = plane;
+      llo = min(llo, p);
+      lhi = max(lhi, p);
+      rlo = min(rlo, p);
+      rhi = max(rhi, p);
+    }
+  }
+
+  left.lo = max(left.lo, llo);
+  left.hi = min(left.hi, lhi);
+  right.lo = max(right.lo, rlo);
+  right.hi = min(right.hi, rhi);
+}
+
+//=============================================================================================================================
+// Wide BVH
+//=============================================================================================================================
+
+template <int N>
+float const WideBVH<N>::MAX_ORIGIN_SPREAD = 1e-3f;
+
+template <int N>
+float const WideBVH<N>::MAX_DIRECTION_SPREAD = 0.2f;
+
+template <int N>
+WideBVH<N>::WideBVH(double split_budget)
+: split_budget_(split_budget), extent_(0)
+{
+}
+
+template <int N>
+void
+WideBVH<N>::build(std::vector<Primitive *> const & prims)
+{
+  BVHBuilder builder(N, MAX_LEAF_SIZE, split_budget_);
+  builder.build(prims);
+
+  leaf_index_ = builder.leafPrimitives();
+  extent_ = 0;
+  leaf_prims_.resize(leaf_index_.size());
+  for (size_t i = 0; i < leaf_index_.size(); ++i)
+    leaf_prims_[i] = prims[leaf_index_[i]];
+
+  std::vector<BVHBuildNode> const & build_nodes = builder.nodes();
+  if (!build_nodes.empty())
+  {
+    BVHBuildNode const & root = build_nodes[0];
+    Vec3 lo = root.lo[0], hi = root.hi[0];
+    for (int c = 1; c < root.num_children; ++c)
+    {
+      lo = min(lo, root.lo[c]);
+      hi = max(hi, root.hi[c]);
+    }
+    extent_ = (float)std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2]));
+  }
+
+  nodes_.assign(build_nodes.size(), Node());
+  for (size_t n = 0; n < build_nodes.size(); ++n)
+  {
+    BVHBuildNode const & b = build_nodes[n];
+    Node & node = nodes_[n];
+    node.num_children = (uint32_t)b.num_children;
+    for (int c = 0; c < N; ++c)
+    {
+      float lo[3] = { 0, 0, 0 }, hi[3] = { 0, 0, 0 };
+      if (c < b.num_children)
+        toFloatBounds(b.lo[c], b.hi[c], lo, hi);
+
+      for (int a = 0; a < 3; ++a)
+      {
+        node.bounds[a][c] = lo[a];
+        node.bounds[3 + a][c] = hi[a];
+      }
+
+      node.child[c] = (c >= b.num_children) ? 0 : (b.child[c] < 0 ? (LEAF | b.first[c]) : (uint32_t)b.child[c]);
+      node.count[c] = (c < b.num_children && b.child[c] < 0) ? b.count[c] : 0;
+    }
+  }
+}
+
+template <int N>
+void
+WideBVH<N>::intersect(Rayf const & ray, Hitf & hit) const
+{
+  if (nodes_.empty())
+    return;
+
+  struct Entry
+  {
+    uint32_t ref;    // node index, or LEAF | first entry of a leaf
+    uint32_t count;  // number of primitives in a leaf
+    float t;         // entry time of the ray into the box
+  };
+
+  NodeRay node_ray(ray);
+  Entry stack[STACK_SIZE];
+  int sp = 0;
+  stack[sp].ref = 0;
+  stack[sp].count = 0;
+  stack[sp].t = 0;
+  ++sp;
+
+  while (sp > 0)
+  {
+    Entry e = stack[--sp];
+    if (e.t > hit.t)
+      continue;
+
+    if (e.ref & LEAF)
+    {
+      uint32_t first = e.ref & ~LEAF;
+      for (uint32_t k = first; k < first + e.count; ++k)
+      {
+        if (leaf_prims_[k]->intersect(ray, hit))
+          hit.prim = leaf_index_[k];
+      }
+      continue;
+    }
+
+    Node const & node = nodes_[e.ref];
+    float t_near[N];
+    int mask = intersectChildren<N>(node.bounds, node_ray, hit.t, t_near) & ((1 << node.num_children) - 1);
+
+    // push the children entered in order of decreasing entry time, so the nearest is visited next
+    int base = sp;
+    while (mask)
+    {
+      int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+
+      int j = sp++;
+      while (j > base && stack[j - 1].t < t_near[i])
+      {
+        stack[j] = stack[j - 1];
+        --j;
+      }
+      stack[j].ref = node.child[i];
+      stack[j].count = node.count[i];
+      stack[j].t = t_near[i];
+    }
+  }
+}
+
+template <int N>
+bool
+WideBVH<N>::occluded(Rayf const & ray, uint32_t & prim, uint32_t & element) const
+{
+  if (nodes_.empty())
+    return false;
+
+  NodeRay node_ray(ray);
+  Hitf hit(ray);
+  uint32_t stack[STACK_SIZE], counts[STACK_SIZE];
+  int sp = 0;
+  stack[sp] = 0;
+  counts[sp] = 0;
+  ++sp;
+
+  while (sp > 0)
+  {
+    --sp;
+    uint32_t ref = stack[sp], count = counts[sp];
+    if (ref & LEAF)
+    {
+      uint32_t first = ref & ~LEAF;
+      for (uint32_t k = first; k < first + count; ++k)
+      {
+        if (leaf_prims_[k]->intersect(ray, hit))
+        {
+          prim = leaf_index_[k];
+          element = hit.element;
+          return true;
+        }
+      }
+      continue;
+    }
+
+    Node const & node = nodes_[ref];
+    float t_near[N];
+    int mask = intersectChildren<N>(node.bounds, node_ray, ray.t_max, t_near) & ((1 << node.num_children) - 1);
+    while (mask)
+    {
+      int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+      stack[sp] = node.child[i];
+      counts[sp] = node.count[i];
+      ++sp;
+    }
+  }
+
+  return false;
+}
+
+template <int N>
+void
+WideBVH<N>::intersectBatch(Rayf const * rays, Hitf * hits, int n) const
+{
+  traceBatch(rays, hits, n, false);
+}
+
+template <int N>
+void
+WideBVH<N>::occludedBatch(Rayf const * rays, Hitf * hits, int n) const
+{
+  traceBatch(rays, hits, n, true);
+}
+
+template <int N>
+void
+WideBVH<N>::traceBatch(Rayf const * rays, Hitf * hits, int n, bool any_hit) const
+{
+  if (nodes_.empty())
+    return;
+
+  // Packets only pay for themselves where the interval test over them is tight, so a run of rays forms a packet while they
+  // leave nearly the same point in nearly the same direction; other rays are traced one at a time
+  float const max_origin_spread = MAX_ORIGIN_SPREAD * extent_;
+  int begin = 0;
+  while (begin < n)
+  {
+    Rayf const & lead = rays[begin];
+    int const octant = octantOf(lead);
+    Vec3f dir = lead.dir * (1 / std::sqrt(lead.dir * lead.dir));
+    float lo[3] = { dir.x, dir.y, dir.z }, hi[3] = { dir.x, dir.y, dir.z };
+    int end = begin + 1;
+    for (; end < n && end - begin < PACKET_SIZE; ++end)
+    {
+      Rayf const & ray = rays[end];
+      dir = ray.dir * (1 / std::sqrt(ray.dir * ray.dir));
+      bool coherent = octantOf(ray) == octant;
+      for (int a = 0; a < 3 && coherent; ++a)
+      {
+        coherent = std::fabs(ray.org[a] - lead.org[a]) <= max_origin_spread
+                && std::max(hi[a], dir[a]) - std::min(lo[a], dir[a]) <= MAX_DIRECTION_SPREAD;
+      }
+      if (!coherent)
+        break;
+
+      for (int a = 0; a < 3; ++a)
+      {
+        lo[a] = std::min(lo[a], dir[a]);
+        hi[a] = std::max(hi[a], dir[a]);
+      }
+    }
+
+    if (end - begin == 1)
+    {
+      uint32_t prim, element;
+      if (!any_hit)
+        intersect(rays[begin], hits[begin]);
+      else if (occluded(rays[begin], prim, element))
+      {
+        hits[begin].prim = prim;
+        hits[begin].element = element;
+      }
+    }
+    else
+      tracePacket(rays + begin, hits + begin, end - begin, any_hit);
+
+    begin = end;
+  }
+}
+
+template <int N>
+void
+WideBVH<N>::tracePacket(Rayf const * rays, Hitf * hits, int size, bool any_hit) const
+{
+  struct Entry
+  {
+    uint32_t ref;    // node index, or LEAF | first entry of a leaf
+    uint32_t count;   // number of primitives in a leaf
+    int first;        // first ray of the packet that enters the box; the rays from it on visit the entry
+    float t;          // entry time of that ray into the box
+    uint32_t parent;  // node the entry is a child of, and which child it is
+    int slot;
+  };
+
+  NodeRay node_rays[PACKET_SIZE];
+  for (int r = 0; r < size; ++r)
+    node_rays[r] = NodeRay(rays[r]);
+
+  // for any hit, a ray is done once it is blocked, and a hit time is the ray's own t_max until then
+  int active = size;
+  Entry stack[STACK_SIZE];
+  int sp = 0;
+  stack[sp].ref = 0;
+  stack[sp].count = 0;
+  stack[sp].first = 0;
+  stack[sp].t = 0;
+  stack[sp].parent = 0;
+  stack[sp].slot = 0;
+  ++sp;
+
+  while (sp > 0 && active > 0)
+  {
+    Entry e = stack[--sp];
+    if (e.ref & LEAF)
+    {
+      // the range may hold rays that miss the leaf, which are cheaper to find by its box than by its primitives
+      Node const & parent = nodes_[e.parent];
+      uint32_t first = e.ref & ~LEAF;
+      for (int r = e.first; r < size; ++r)
+      {
+        if ((any_hit && hits[r].prim != Hitf::NONE) || !intersectChild<N>(parent.bounds, e.slot, node_rays[r], hits[r].t))
+          continue;
+
+        for (uint32_t k = first; k < first + e.count; ++k)
+        {
+          if (leaf_prims_[k]->intersect(rays[r], hits[r]))
+          {
+            hits[r].prim = leaf_index_[k];
+            if (any_hit)
+            {
+              --active;
+              break;
+            }
+          }
+        }
+      }
+      continue;
+    }
+
+    Node const & node = nodes_[e.ref];
+    int pending = (1 << node.num_children) - 1;
+    if (size - e.first > 2)
+    {
+      PacketBounds bounds(node_rays, e.first, size);
+      float t_max = 0;
+      for (int r = e.first; r < size; ++r)
+        t_max = std::max(t_max, hits[r].t);
+      if (bounds.finite)
+        pending &= intersectChildrenPacket<N>(node.bounds, bounds, t_max);
+    }
+
+    // find the first ray that enters each child that some ray may enter
+    float t_near[N], t_first[N];
+    int first[N];
+    int found = 0;
+    for (int r = e.first; r < size && pending; ++r)
+    {
+      if (any_hit && hits[r].prim != Hitf::NONE)
+        continue;
+
+      int mask = intersectChildren<N>(node.bounds, node_rays[r], hits[r].t, t_near) & pending;
+      pending &= ~mask;
+      found |= mask;
+      while (mask)
+      {
+        int i = __builtin_ctz(mask);
+        mask &= mask - 1;
+        first[i] = r;
+        t_first[i] = t_near[i];
+      }
+    }
+
+
+    // push the children entered in order of decreasing entry time, so the nearest is visited next
+    int base = sp;
+    while (found)
+    {
+      int i = __builtin_ctz(found);
+      found &= found - 1;
+
+      int j = sp++;
+      while (j > base && stack[j - 1].t < t_first[i])
+      {
+        stack[j] = stack[j - 1];
+        --j;
+      }
+      stack[j].ref = node.child[i];
+      stack[j].count = node.count[i];
+      stack[j].first = first[i];
+      stack[j].t = t_first[i];
+      stack[j].parent = e.ref;
+      stack[j].slot = i;
+    }
+  }
+}
+
+template <int N>
+size_t
+WideBVH<N>::memoryUsage() const
+{
+  return nodes_.size() * sizeof(Node) + leaf_prims_.size() * (sizeof(Primitive const *) + sizeof(uint32_t));
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+
+//=============================================================================================================================
+// Compressed BVH
+//=============================================================================================================================
+
+CompressedBVH::CompressedBVH(double split_budget)
+: split_budget_(split_budget), triangles_(new TriangleSet()), set_index_(Hitf::NONE), num_others_(0)
+{
+}
+
+CompressedBVH::~CompressedBVH()
+{
+  if (set_index_ == Hitf::NONE)
+    delete triangles_;
+}
+
+void
+CompressedBVH::build(std::vector<Primitive *> const & prims)
+{
+  BVHBuilder builder(WIDTH, MAX_LEAF_SIZE, split_budget_);
+  builder.build(prims);
+
+  nodes_.clear();
+  leaves_.clear();
+  if (set_index_ == Hitf::NONE)
+    delete triangles_;
+  triangles_ = new TriangleSet();
+  set_index_ = Hitf::NONE;
+  triangle_prim_.clear();
+  other_prims_.clear();
+  other_index_.clear();
+  other_rank_.clear();
+
+  std::vector<BVHBuildNode> const & build_nodes = builder.nodes();
+  std::vector<uint32_t> const & leaf_prims = builder.leafPrimitives();
+  if (build_nodes.empty())
+    return;
+
+  // index of each non-triangle primitive among the others, which hits report once the triangles are released
+  std::vector<uint32_t> rank(prims.size());
+  num_others_ = 0;
+  for (size_t i = 0; i < prims.size(); ++i)
+  {
+    rank[i] = num_others_;
+    if (dynamic_cast<Triangle const *>(prims[i]) == NULL)
+      ++num_others_;
+  }
+
+  VertexMap vertices;
+  vertices.reserve(prims.size());
+
+  // Lay the nodes out breadth-first, so the child nodes of each node are consecutive, as are its leaf blocks
+  std::vector< std::pair<int, uint32_t> > queue;  // build node, and the index it is stored at
+  queue.push_back(std::make_pair(0, 0u));
+  nodes_.resize(1);
+  for (size_t i = 0; i < queue.size(); ++i)
+  {
+    BVHBuildNode const & b = build_nodes[queue[i].first];
+    float lo[WIDTH][3], hi[WIDTH][3];
+    for (int c = 0; c < b.num_children; ++c)
+      toFloatBounds(b.lo[c], b.hi[c], lo[c], hi[c]);
+
+    Node node;
+    quantise(node, b.num_children, lo, hi);
+    node.child_base = (uint32_t)nodes_.size();
+    node.leaf_base = (uint32_t)leaves_.size();
+
+    int num_nodes = 0, num_leaves = 0;
+    for (int c = 0; c < WIDTH; ++c)
+    {
+      node.meta[c] = 0;
+      if (c >= b.num_children)
+        continue;
+
+      if (b.child[c] >= 0)
+      {
+        node.meta[c] = (uint8_t)num_nodes;
+        queue.push_back(std::make_pair(b.child[c], node.child_base + num_nodes));
+        ++num_nodes;
+      }
+      else
+      {
+        node.meta[c] = (uint8_t)(LEAF_META | num_leaves);
+        addLeafBlock(prims, &leaf_prims[b.first[c]], b.count[c], rank, vertices);
+        ++num_leaves;
+      }
+    }
+
+    nodes_.resize(nodes_.size() + num_nodes);
+    nodes_[queue[i].second] = node;
+  }
+}
+
+void
+CompressedBVH::quantise(Node & node, int num_children, float const (*lo)[3], float const (*hi)[3])
+{
+  node.num_children = (uint8_t)num_children;
+  for (int a = 0; a < 3; ++a)
+  {
+    float plo = lo[0][a], phi = hi[0][a];
+    for (int c = 1; c < num_children; ++c)
+    {
+      plo = std::min(plo, lo[c][a]);
+      phi = std::max(phi, hi[c][a]);
+    }
+
+    // The spacing is the smallest power of two for which 250 steps span the node, but no less than 8 float ulps of its
+    // coordinates. The grid starts one step below the node, and each child is rounded out by a further step, so rounding in
+    // decoding can never move a bound inwards.
+    int exponent = -126, magnitude_exponent;
+    double extent = (double)phi - (double)plo;
+    if (extent > 0)
+      std::frexp(extent / 250, &exponent);
+    std::frexp(std::max(std::fabs(plo), std::fabs(phi)), &magnitude_exponent);
+    exponent = std::min(std::max(exponent, magnitude_exponent - 21), 100);
+    exponent = std::max(exponent, -100);
+
+    float scale = std::ldexp(1.0f, exponent);
+    node.exponent[a] = (int8_t)exponent;
+    node.origin[a] = plo - scale;
+    if ((double)node.origin[a] > (double)plo - scale)
+      node.origin[a] = std::nextafter(node.origin[a], -std::numeric_limits<float>::infinity());
+
+    for (int c = 0; c < WIDTH; ++c)
+    {
+      int ql = 0, qh = 0;
+      if (c < num_children)
+      {
+        ql = (int)std::floor(((double)lo[c][a] - node.origin[a]) / scale) - 1;
+        qh = (int)std::ceil(((double)hi[c][a] - node.origin[a]) / scale) + 1;
+      }
+      node.q[a][c] = (uint8_t)std::min(std::max(ql, 0), 255);
+      node.q[3 + a][c] = (uint8_t)std::min(std::max(qh, 0), 255);
+    }
+  }
+}
+
+uint32_t
+CompressedBVH::addLeafBlock(std::vector<Primitive *> const & prims, uint32_t const * leaf_prims, uint32_t count,
+                            std::vector<uint32_t> const & rank, VertexMap & vertices)
+{
+  LeafBlock leaf;
+  leaf.first_triangle = triangles_->size();
+  leaf.first_other = (uint32_t)other_prims_.size();
+  leaf.num_triangles = 0;
+  leaf.num_others = 0;
+
+  for (uint32_t k = 0; k < count; ++k)
+  {
+    uint32_t index = leaf_prims[k];
+    Triangle const * tri = dynamic_cast<Triangle const *>(prims[index]);
+    if (tri == NULL)
+    {
+      other_prims_.push_back(prims[index]);
+      other_index_.push_back(index);
+      other_rank_.push_back(rank[index]);
+      ++leaf.num_others;
+      continue;
+    }
+
+    // neighbouring triangles of a mesh share vertices, which are stored once, in the order the leaves first use them
+    Vec3 w[3], n[3];
+    tri->getWorldTriangle(w[0], w[1], w[2]);
+    tri->getWorldVertexNormals(n[0], n[1], n[2]);
+    uint32_t corners[3];
+    for (int corner = 0; corner < 3; ++corner)
+    {
+      // adding 0 turns -0 into 0, which compares bytewise equal to it
+      Vec3f v(w[corner]), vn(n[corner]);
+      VertexKey key = { { v.x + 0.0f, v.y + 0.0f, v.z + 0.0f, vn.x + 0.0f, vn.y + 0.0f, vn.z + 0.0f } };
+      VertexMap::const_iterator existing = vertices.find(key);
+      if (existing != vertices.end())
+        corners[corner] = existing->second;
+      else
+      {
+        corners[corner] = triangles_->addVertex(v, vn);
+        vertices[key] = corners[corner];
+      }
+    }
+
+    triangles_->addTriangle(corners[0], corners[1], corners[2], tri->getMaterialIndex());
+    triangle_prim_.push_back(index);
+    ++leaf.num_triangles;
+  }
+
+  leaves_.push_back(leaf);
+  return (uint32_t)leaves_.size() - 1;
+}
+
+bool
+CompressedBVH::intersectLeaf(LeafBlock const & leaf, Rayf const & ray, Hitf & hit, bool any_hit) const
+{
+  bool found = false;
+  for (uint32_t k = leaf.first_triangle; k < leaf.first_triangle + leaf.num_triangles; ++k)
+  {
+    uint32_t const * c = triangles_->getCorners(k);
+    Vec3f const & v0 = triangles_->getVertex(c[0]);
+    if (intersectTriangle(ray, v0, triangles_->getVertex(c[1]) - v0, triangles_->getVertex(c[2]) - v0, hit.t))
+    {
+      if (set_index_ != Hitf::NONE)
+      {
+        hit.prim = set_index_;
+        hit.element = k;
+      }
+      else
+      {
+        hit.prim = triangle_prim_[k];
+        hit.element = 0;
+      }
+      found = true;
+      if (any_hit)
+        return true;
+    }
+  }
+
+  for (int k = 0; k < leaf.num_others; ++k)
+  {
+    if (other_prims_[leaf.first_other + k]->intersect(ray, hit))
+    {
+      hit.prim = other_index_[leaf.first_other + k];
+      found = true;
+      if (any_hit)
+        return true;
+    }
+  }
+
+  return found;
+}
+
+void
+CompressedBVH::intersect(Rayf const & ray, Hitf & hit) const
+{
+  if (nodes_.empty())
+    return;
+
+  struct Entry
+  {
+    uint32_t ref;  // node index, or LEAF | leaf block index
+    float t;       // entry time of the ray into the box
+  };
+
+  NodeRay node_ray(ray);
+  Entry stack[STACK_SIZE];
+  int sp = 0;
+  stack[sp].ref = 0;
+  stack[sp].t = 0;
+  ++sp;
+
+  while (sp > 0)
+  {
+    Entry e = stack[--sp];
+    if (e.t > hit.t)
+      continue;
+
+    if (e.ref & LEAF)
+    {
+      intersectLeaf(leaves_[e.ref & ~LEAF], ray, hit, false);
+      continue;
+    }
+
+    Node const & node = nodes_[e.ref];
+    float t_near[WIDTH];
+    int mask = intersectQuantised(node, node_ray, hit.t, t_near) & ((1 << node.num_children) - 1);
+
+    // push the children entered in order of decreasing entry time, so the nearest is visited next
+    int base = sp;
+    while (mask)
+    {
+      int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+
+      int j = sp++;
+      while (j > base && stack[j - 1].t < t_near[i])
+      {
+        stack[j] = stack[j - 1];
+        --j;
+      }
+      uint8_t meta = node.meta[i];
+      stack[j].ref = (meta & LEAF_META) ? (LEAF | (node.leaf_base + (meta & ~LEAF_META))) : node.child_base + meta;
+      stack[j].t = t_near[i];
+    }
+  }
+}
+
+bool
+CompressedBVH::occluded(Rayf const & ray, uint32_t & prim, uint32_t & element) const
+{
+  if (nodes_.empty())
+    return false;
+
+  NodeRay node_ray(ray);
+  Hitf hit(ray);
+  uint32_t stack[STACK_SIZE];
+  int sp = 0;
+  stack[sp++] = 0;
+
+  while (sp > 0)
+  {
+    uint32_t ref = stack[--sp];
+    if (ref & LEAF)
+    {
+      if (intersectLeaf(leaves_[ref & ~LEAF], ray, hit, true))
+      {
+        prim = hit.prim;
+        element = hit.element;
+        return true;
+      }
+      continue;
+    }
+
+    Node const & node = nodes_[ref];
+    float t_near[WIDTH];
+    int mask = intersectQuantised(node, node_ray, ray.t_max, t_near) & ((1 << node.num_children) - 1);
+    while (mask)
+    {
+      int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+      uint8_t meta = node.meta[i];
+      stack[sp++] = (meta & LEAF_META) ? (LEAF | (node.leaf_base + (meta & ~LEAF_META))) : node.child_base + meta;
+    }
+  }
+
+  return false;
+}
+
+TriangleSet *
+CompressedBVH::releaseTriangles()
+{
+  if (set_index_ != Hitf::NONE || triangles_->size() == 0)
+    return NULL;
+
+  // the others keep their order, and the mesh follows them
+  set_index_ = num_others_;
+  other_index_.swap(other_rank_);
+  std::vector<uint32_t>().swap(other_rank_);
+  std::vector<uint32_t>().swap(triangle_prim_);
+  return triangles_;
+}
+
+size_t
+CompressedBVH::memoryUsage() const
+{
+  size_t bytes = nodes_.size() * sizeof(Node) + leaves_.size() * sizeof(LeafBlock) + triangle_prim_.size() * sizeof(uint32_t)
+               + other_prims_.size() * (sizeof(Primitive const *) + sizeof(uint32_t)) + other_rank_.size() * sizeof(uint32_t);
+  if (set_index_ == Hitf::NONE)
+    bytes += triangles_->memoryUsage();
+
+  return bytes;
+}
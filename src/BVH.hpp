@@ -0,0 +1,303 @@
+/*
+ * BVH.hpp
+ *
+ * Spatial indices over the primitives of the world, for finding the primitives a ray hits without testing every one.
+ */
+
+#ifndef __BVH_hpp__
+#define __BVH_hpp__
+
+#include "Globals.hpp"
+#include "Primitives.hpp"
+
+/**
+ * Interface for a spatial index over a list of primitives. Hits report the index of the primitive in the list the index was
+ * built over, so the caller can map them back to its own primitives.
+ */
+class Accelerator
+{
+  public:
+    /** Destructor. */
+    virtual ~Accelerator();
+
+    /**
+     * Create an accelerator by name: "bvh4", "bvh8" or "cbvh". \a split_budget is passed to the BVHBuilder. Returns NULL for an
+     * unknown name.
+     */
+    static Accelerator * create(std::string const & name, double split_budget = 0);
+
+    /** Build the index over a list of primitives, replacing any previous one. The primitives must outlive the index. */
+    virtual void build(std::vector<Primitive *> const & prims) = 0;
+
+    /** Find the nearest hit along \a ray closer than hit.t, updating \a hit (with hit.prim the index of the primitive hit). */
+    virtual void intersect(Rayf const & ray, Hitf & hit) const = 0;
+
+    /**
+     * Check whether any primitive is hit before ray.t_max. If so, sets \a prim to the index of the first one found and
+     * \a element to the element of it that was hit.
+     */
+    virtual bool occluded(Rayf const & ray, uint32_t & prim, uint32_t & element) const = 0;
+
+    /**
+     * Find the nearest hits along a batch of \a n rays, as intersect() does for each: hits[i] starts out as for intersect() and
+     * is updated for rays[i]. By default the rays are traced one at a time; an index may trace runs of similar rays together.
+     */
+    virtual void intersectBatch(Rayf const * rays, Hitf * hits, int n) const;
+
+    /**
+     * Check a batch of \a n rays for any hit before their t_max, as occluded() does for each. hits[i] starts out as Hitf(rays[i]);
+     * on return hits[i].prim is the index of a primitive blocking rays[i], with hits[i].element the element of it that was hit,
+     * or Hitf::NONE if nothing does.
+     */
+    virtual void occludedBatch(Rayf const * rays, Hitf * hits, int n) const;
+
+    /**
+     * If the index keeps its own copy of the Triangle primitives among those it was built over, as a TriangleSet, hand the
+     * set over to the caller, who then owns it and must keep it alive with the index, and return it. From then on, hits report
+     * indices into the list the index was built over with the Triangles removed and the set appended, with hit.element the
+     * triangle in the set, so the caller can free its Triangles. Returns NULL, changing nothing, if the index keeps no
+     * such copy or has already handed it over.
+     */
+    virtual TriangleSet * releaseTriangles() { return NULL; }
+
+    /** Get the number of nodes. */
+    virtual size_t numNodes() const = 0;
+
+    /** Get the memory used by the index, in bytes, including any triangles it keeps but not the primitives it was built over. */
+    virtual size_t memoryUsage() const = 0;
+};
+
+/**
+ * A node of a wide BVH under construction, with up to MAX_WIDTH children, each of which is either another node or a leaf
+ * holding a range of the builder's leaf primitive list.
+ */
+struct BVHBuildNode
+{
+  static int const MAX_WIDTH = 8;
+
+  int num_children;
+  Vec3 lo[MAX_WIDTH], hi[MAX_WIDTH];  // bounds of each child
+  int child[MAX_WIDTH];               // index of each child node, or -1 for a leaf
+  uint32_t first[MAX_WIDTH];          // start of a leaf's range in the leaf primitive list
+  uint32_t count[MAX_WIDTH];          // number of primitives in a leaf
+};
+
+/**
+ * Builds a BVH of a given width top-down with the surface area heuristic. Each node starts as a single group of primitives, and
+ * the group with the largest bounds is split in two, at the best of a set of binned planes through the primitive centres, until
+ * the node has its full width or no group is larger than a leaf. Node 0 is the root.
+ *
+ * Where the two halves of the best such split would overlap much, a spatial split is also considered, as in the SBVH of Stich et
+ * al., "Spatial Splits in Bounding Volume Hierarchies" (2009): the plane cuts through the primitives, and those it crosses are
+ * referenced from both sides, with their bounds clipped to each. This keeps long thin triangles from inflating every box they
+ * cross. The extra references are limited to a budget, as a fraction of the number of primitives, so a primitive may appear in
+ * more than one leaf.
+ */
+class BVHBuilder
+{
+  public:
+    /**
+     * Constructor. \a width is the number of children per node, up to BVHBuildNode::MAX_WIDTH. Spatial splits may add up to
+     * \a split_budget times as many references as there are primitives; 0 builds an ordinary BVH.
+     */
+    BVHBuilder(int width, int max_leaf_size, double split_budget = 0);
+
+    /** Build the tree over a list of primitives. */
+    void build(std::vector<Primitive *> const & prims);
+
+    /** Get the nodes, with the root first. Empty if there were no primitives. */
+    std::vector<BVHBuildNode> const & nodes() const { return nodes_; }
+
+    /** Get the leaf primitive list: the index of each primitive, grouped by leaf. A primitive may be listed more than once. */
+    std::vector<uint32_t> const & leafPrimitives() const { return leaf_prims_; }
+
+  private:
+    struct Reference
+    {
+      Vec3 lo, hi;
+      uint32_t prim;
+    };
+
+    /** Build the node over a group of references, which is consumed, and return its index. */
+    int buildNode(std::vector<Reference> & refs, int depth);
+
+    /** Split a group of references in two, without considering whether it is worth it. */
+    void split(std::vector<Reference> & refs, std::vector<Reference> & left, std::vector<Reference> & right, int depth);
+
+    /**
+     * Split a group of references with the best binned spatial split, if it costs less than \a cost_to_beat and fits in the
+     * budget. Returns false, leaving the group alone, otherwise.
+     */
+    bool spatialSplit(std::vector<Reference> & refs, std::vector<Reference> & left, std::vector<Reference> & right,
+                      double cost_to_beat);
+
+    /**
+     * Split a reference at a plane across \a axis, into the parts on either side. A part is empty (lo > hi) if the primitive
+     * does not reach that side within the reference's bounds.
+     */
+    void splitReference(Reference const & ref, int axis, double plane, Reference & left, Reference & right) const;
+
+    int width_;
+    int max_leaf_size_;
+    double split_budget_;
+    size_t spare_references_;          // references spatial splits may still add
+    double root_area_;                 // surface area of the bounds of all the primitives
+    std::vector<Vec3> triangles_;      // world-space vertices of each primitive that is a triangle, three per primitive
+    std::vector<char> is_triangle_;
+    std::vector<BVHBuildNode> nodes_;
+    std::vector<uint32_t> leaf_prims_;
+};
+
+/**
+ * BVH with N = 4 or 8 children per node, whose bounds are stored in single precision as structures of arrays so that one SSE
+ * (N = 4) or AVX (N = 8) instruction sequence tests the ray against all of them. Children that the ray enters are visited
+ * nearest first along the ray, so the closest hit is usually found early and the rest of the tree culled against it.
+ *
+ * Batches are traced in packets of consecutive rays leaving nearly the same point in nearly the same direction, which share
+ * one traversal stack. At each node, children that none of the packet's rays can enter are culled with one interval test over
+ * them all, and each other child is visited by the rays from the first that enters it on, so coherent rays test a node a few
+ * times rather than once each. At a leaf, each of those rays is tested against the leaf's box before its primitives.
+ */
+template <int N>
+class WideBVH : public Accelerator
+{
+  public:
+    /** Constructor. Builds an empty index. \a split_budget is passed to the BVHBuilder. */
+    WideBVH(double split_budget = 0);
+
+    void build(std::vector<Primitive *> const & prims);
+    void intersect(Rayf const & ray, Hitf & hit) const;
+    bool occluded(Rayf const & ray, uint32_t & prim, uint32_t & element) const;
+    void intersectBatch(Rayf const * rays, Hitf * hits, int n) const;
+    void occludedBatch(Rayf const * rays, Hitf * hits, int n) const;
+    size_t numNodes() const { return nodes_.size(); }
+    size_t memoryUsage() const;
+
+  private:
+    static uint32_t const LEAF = 0x80000000u;  // flag on a child reference to a leaf
+    static int const MAX_LEAF_SIZE = 4;
+    static int const STACK_SIZE = 1024;
+    static int const PACKET_SIZE = 64;
+    static float const MAX_ORIGIN_SPREAD;     // largest distance between the origins of a packet, as a fraction of extent_
+    static float const MAX_DIRECTION_SPREAD;  // largest spread of a packet's unit directions along any axis
+
+    /** Split a batch into packets and trace each, for the nearest hits or, if \a any_hit is set, for any hit. */
+    void traceBatch(Rayf const * rays, Hitf * hits, int n, bool any_hit) const;
+
+    /** Trace a packet of up to PACKET_SIZE rays heading into the same octant, as for traceBatch(). */
+    void tracePacket(Rayf const * rays, Hitf * hits, int size, bool any_hit) const;
+
+    struct Node
+    {
+      float bounds[6][N];    // lo x, y, z then hi x, y, z of each child
+      uint32_t child[N];     // index of a child node, or LEAF | first entry of a leaf
+      uint32_t count[N];     // number of primitives in a leaf
+      uint32_t num_children;
+    };
+
+    double split_budget_;
+    float extent_;                               // largest side of the bounds of all the primitives
+    std::vector<Node> nodes_;
+    std::vector<Primitive const *> leaf_prims_;  // primitives by leaf, for testing without indirection
+    std::vector<uint32_t> leaf_index_;           // index of each of leaf_prims_ in the list the index was built over
+};
+
+/**
+ * Compressed 8-wide BVH, for meshes too large for WideBVH to fit in memory. Each node stores the bounds of its children as 8-bit
+ * offsets on a grid spanning the node, whose spacing is a power of two per axis, and refers to its children through two base
+ * indices and a byte per child, for 80 bytes per node against 264 for WideBVH<8>. Triangles are copied into a TriangleSet in
+ * the order of the leaves, so each leaf block refers to a range of them, and leaf tests read neither a Triangle nor a pointer to
+ * one; releaseTriangles() hands the set over so the Triangle primitives can go. Other primitives are referenced from the leaves
+ * and tested through their own intersect(). After Ylitie et al., "Efficient Incoherent Ray Traversal on GPUs Through Compressed
+ * Wide BVHs" (2017).
+ */
+class CompressedBVH : public Accelerator
+{
+  public:
+    /** Constructor. Builds an empty index. \a split_budget is passed to the BVHBuilder. */
+    CompressedBVH(double split_budget = 0);
+
+    /** Destructor. */
+    ~CompressedBVH();
+
+    void build(std::vector<Primitive *> const & prims);
+    void intersect(Rayf const & ray, Hitf & hit) const;
+    bool occluded(Rayf const & ray, uint32_t & prim, uint32_t & element) const;
+    TriangleSet * releaseTriangles();
+    size_t numNodes() const { return nodes_.size(); }
+    size_t memoryUsage() const;
+
+  private:
+    static int const WIDTH = 8;
+    static int const MAX_LEAF_SIZE = 4;
+    static int const STACK_SIZE = 1024;
+    static uint32_t const LEAF = 0x80000000u;  // flag on a stack entry for a leaf block
+    static uint8_t const LEAF_META = 0x80;     // flag on a child's meta byte for a leaf block
+
+    struct Node
+    {
+      float origin[3];        // corner of the grid the child bounds lie on
+      int8_t exponent[3];     // grid spacing along each axis, as a power of two
+      uint8_t num_children;
+      uint8_t q[6][WIDTH];    // lo x, y, z then hi x, y, z of each child, in grid steps from the origin
+      uint32_t child_base;    // index of the first child node; the node's child nodes are consecutive
+      uint32_t leaf_base;     // index of the first leaf block; the node's leaf blocks are consecutive
+      uint8_t meta[WIDTH];    // offset of each child from child_base, or LEAF_META | its offset from leaf_base
+    };
+
+    struct LeafBlock
+    {
+      uint32_t first_triangle;  // first of the block's triangles in triangles_
+      uint32_t first_other;     // first entry of the block's other primitives in other_prims_
+      uint8_t num_triangles;
+      uint8_t num_others;
+    };
+
+    /** The position then normal of a vertex, by which distinct vertices are found. */
+    struct VertexKey
+    {
+      float values[6];
+
+      bool operator==(VertexKey const & other) const { return std::memcmp(values, other.values, sizeof(values)) == 0; }
+    };
+
+    /** Hash of the bytes of a VertexKey (FNV-1a). */
+    struct VertexKeyHash
+    {
+      size_t operator()(VertexKey const & key) const
+      {
+        unsigned char const * bytes = reinterpret_cast<unsigned char const *>(key.values);
+        size_t h = 2166136261u;
+        for (size_t i = 0; i < sizeof(key.values); ++i)
+          h = (h ^ bytes[i]) * 16777619u;
+
+        return h;
+      }
+    };
+
+    /** Distinct vertices added to triangles_ so far. */
+    typedef std::unordered_map<VertexKey, uint32_t, VertexKeyHash> VertexMap;
+
+    /** Set the grid of a node and the quantised bounds of its children, from the children's single-precision bounds. */
+    static void quantise(Node & node, int num_children, float const (*lo)[3], float const (*hi)[3]);
+
+    /** Add a leaf block for the given primitives, which are indices into \a prims, and return its index. */
+    uint32_t addLeafBlock(std::vector<Primitive *> const & prims, uint32_t const * leaf_prims, uint32_t count,
+                          std::vector<uint32_t> const & rank, VertexMap & vertices);
+
+    /** Test a ray against the primitives of a leaf block, as for intersect(), or for any hit when \a any_hit is set. */
+    bool intersectLeaf(LeafBlock const & leaf, Rayf const & ray, Hitf & hit, bool any_hit) const;
+
+    double split_budget_;
+    std::vector<Node> nodes_;
+    std::vector<LeafBlock> leaves_;
+    TriangleSet * triangles_;                     // the triangles, by leaf block; owned until releaseTriangles()
+    uint32_t set_index_;                          // index hits on triangles_ report once it is released, else Hitf::NONE
+    std::vector<uint32_t> triangle_prim_;         // index of each triangle of triangles_ in the list the index was built over
+    std::vector<Primitive const *> other_prims_;  // non-triangle primitives, grouped by leaf block
+    std::vector<uint32_t> other_index_;           // index of each of other_prims_ in the list hits report
+    std::vector<uint32_t> other_rank_;            // index of each of other_prims_ among the non-triangle primitives
+    uint32_t num_others_;                         // number of non-triangle primitives the index was built over
+};
+
+#endif  // __BVH_hpp__
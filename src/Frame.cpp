@@ -18,14 +18,12 @@ Frame::~Frame()
 }
 
 void
-Frame::setColor(Sample const & s, RGB c)
+Frame::setColor(int x, int y, RGB c)
 {
   c.clip(0, 1);
 
-  int xi = (int)std::floor(s.x() * image.width());
-  int yi = (int)std::floor((1 - s.y()) * image.height());
-
-  unsigned char * pixel = image.pixel(yi, xi);
+  // the image stores rows from the top
+  unsigned char * pixel = image.pixel(image.height() - 1 - y, x);
   pixel[0] = c.getBMPR(0, 1);
   pixel[1] = c.getBMPG(0, 1);
   pixel[2] = c.getBMPB(0, 1);
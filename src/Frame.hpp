@@ -22,8 +22,11 @@ class Frame
     /** Destructor. */
     virtual ~Frame();
 
-    /** Set the color at a sample point. */
-    void setColor(Sample const & s, RGB c);
+    /**
+     * Set the color of the pixel in column \a x and row \a y of the view, with rows counted from the bottom as in
+     * View::getSample().
+     */
+    void setColor(int x, int y, RGB c);
     void save(std::string const & path);
 
   private:
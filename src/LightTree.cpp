@@ -0,0 +1,156 @@
+/*
+ * LightTree.cpp
+ *
+ * Bounding hierarchy over the lights of the world, for choosing lights in proportion to their estimated contribution.
+ */
+
+#include "LightTree.hpp"
+#include <algorithm>
+
+namespace {
+
+struct CentreLess
+{
+  int axis;
+
+  template <typename E> bool operator()(E const & a, E const & b) const
+  {
+    return a.lo[axis] + a.hi[axis] < b.lo[axis] + b.hi[axis];
+  }
+};
+
+double
+brightness(RGB const & c)
+{
+  return (c[RED] + c[GREEN] + c[BLUE]) / 3.0;
+}
+
+} // namespace
+
+LightTree::LightTree()
+: num_lights_(0)
+{
+}
+
+void
+LightTree::build(std::vector<Light *>::const_iterator begin, std::vector<Light *>::const_iterator end)
+{
+  std::vector<Entry> entries;
+  for (std::vector<Light *>::const_iterator i = begin; i != end; ++i)
+  {
+    Entry e;
+    e.light = *i;
+    if ((*i)->getBounds(e.lo, e.hi))
+      entries.push_back(e);
+  }
+
+  nodes_.clear();
+  num_lights_ = (int)entries.size();
+  if (!entries.empty())
+  {
+    nodes_.reserve(2 * entries.size() - 1);
+    buildRecursive(entries, 0, (int)entries.size());
+  }
+}
+
+int
+LightTree::buildRecursive(std::vector<Entry> & entries, int first, int last)
+{
+  int index = (int)nodes_.size();
+
+  if (last - first == 1)
+  {
+    Light const * light = entries[first].light;
+    Node leaf;
+    leaf.lo = entries[first].lo;
+    leaf.hi = entries[first].hi;
+    leaf.power = brightness(light->getColor());
+    leaf.falloff = light->getFalloff();
+    leaf.dead_distance = light->getDeadDistance();
+    leaf.child[0] = leaf.child[1] = -1;
+    leaf.light = light;
+    nodes_.push_back(leaf);
+    return index;
+  }
+
+  // Split at the median of the longest axis of the light centres
+  Vec3 lo = entries[first].lo, hi = entries[first].hi;
+  for (int i = first + 1; i < last; ++i)
+  {
+    lo = min(lo, entries[i].lo);
+    hi = max(hi, entries[i].hi);
+  }
+
+  Vec3 extent = hi - lo;
+  CentreLess less;
+  less.axis = (extent[0] > extent[1] && extent[0] > extent[2]) ? 0 : (extent[1] > extent[2] ? 1 : 2);
+  int mid = (first + last) / 2;
+  std::nth_element(entries.begin() + first, entries.begin() + mid, entries.begin() + last, less);
+
+  // the children are appended after this node, which is filled in once they are built
+  Node node;
+  node.lo = lo;
+  node.hi = hi;
+  node.power = node.falloff = node.dead_distance = 0;
+  node.child[0] = node.child[1] = -1;
+  node.light = NULL;
+  nodes_.push_back(node);
+
+  int left = buildRecursive(entries, first, mid);
+  int right = buildRecursive(entries, mid, last);
+
+  // nodes_ may have been reallocated by the recursion
+  Node & n = nodes_[index];
+  Node const & l = nodes_[left];
+  Node const & r = nodes_[right];
+  n.power = l.power + r.power;
+  n.falloff = std::min(l.falloff, r.falloff);
+  n.dead_distance = std::min(l.dead_distance, r.dead_distance);
+  n.child[0] = left;
+  n.child[1] = right;
+  return index;
+}
+
+double
+LightTree::importance(Node const & node, Vec3 const & position) const
+{
+  // Distance to the centre of the node, but no closer than its half-diagonal, so that a point inside a large cluster does not
+  // treat it as being right on top of it
+  Vec3 centre = 0.5 * (node.lo + node.hi);
+  double radius = 0.5 * (node.hi - node.lo).length();
+  double distance = std::max((centre - position).length(), radius);
+  return node.power * std::pow(1.0 / (distance + node.dead_distance), node.falloff);
+}
+
+Light const *
+LightTree::sample(Vec3 const & position, double u, double & pmf) const
+{
+  pmf = 1;
+  if (nodes_.empty())
+    return NULL;
+
+  int index = 0;
+  while (nodes_[index].light == NULL)
+  {
+    Node const & node = nodes_[index];
+    double w0 = importance(nodes_[node.child[0]], position);
+    double w1 = importance(nodes_[node.child[1]], position);
+    double p0 = (w0 + w1 > 0) ? w0 / (w0 + w1) : 0.5;
+
+    // Reuse the remainder of u for the next level
+    if (u < p0)
+    {
+      u = std::min(u / p0, 0.99999999999999989);
+      pmf *= p0;
+      index = node.child[0];
+    }
+    else
+    {
+      u = std::min((u - p0) / (1 - p0), 0.99999999999999989);
+      pmf *= 1 - p0;
+      index = node.child[1];
+    }
+  }
+
+  return nodes_[index].light;
+}
@@ -0,0 +1,64 @@
+/*
+ * LightTree.hpp
+ *
+ * Bounding hierarchy over the lights of the world, for choosing lights in proportion to their estimated contribution.
+ */
+
+#ifndef __LightTree_hpp__
+#define __LightTree_hpp__
+
+#include "Globals.hpp"
+#include "Lights.hpp"
+
+/**
+ * Binary tree over the lights that have a position. Each node bounds its lights and keeps their total power, so a shading point
+ * can walk from the root to a single light, choosing each child in proportion to an estimate of the light it contributes
+ * (power attenuated by falloff over the distance to the node). The walk costs O(log n) in the number of lights, and returns the
+ * probability with which the light was chosen so the caller can weight its contribution without bias.
+ */
+class LightTree
+{
+  public:
+    /** Constructor. Builds an empty tree. */
+    LightTree();
+
+    /** Build the tree over the lights in [begin, end) that have bounds. Lights without bounds are skipped. */
+    void build(std::vector<Light *>::const_iterator begin, std::vector<Light *>::const_iterator end);
+
+    /** Get the number of lights in the tree. */
+    int numLights() const { return num_lights_; }
+
+    /**
+     * Choose a light as seen from \a position, using \a u in [0, 1) to make the random choices. \a pmf is set to the probability
+     * of choosing the returned light. Returns NULL if the tree is empty.
+     */
+    Light const * sample(Vec3 const & position, double u, double & pmf) const;
+
+  private:
+    struct Node
+    {
+      Vec3 lo, hi;           // bounds of the light positions below this node
+      double power;          // total brightness of the lights below this node
+      double falloff;        // smallest falloff exponent below this node
+      double dead_distance;  // smallest dead distance below this node
+      int child[2];          // children, or -1 for a leaf
+      Light const * light;   // the light at a leaf
+    };
+
+    struct Entry
+    {
+      Light const * light;
+      Vec3 lo, hi;
+    };
+
+    /** Build the subtree over entries [first, last) and return its node index. */
+    int buildRecursive(std::vector<Entry> & entries, int first, int last);
+
+    /** Estimate the light reaching \a position from the lights below a node. */
+    double importance(Node const & node, Vec3 const & position) const;
+
+    std::vector<Node> nodes_;
+    int num_lights_;
+};
+
+#endif  // __LightTree_hpp__
@@ -20,6 +20,9 @@ Light::Light()
 Light::Light(RGB const & illumination)
 {
   illumination_ = illumination;
+  falloff_ = 0;
+  angular_falloff_ = 0;
+  dead_distance_ = 1;
 }
 
 Light::Light(RGB const & illumination, double falloff, double dead_distance)
@@ -48,23 +51,30 @@ Light::setColor(RGB const & c)
   illumination_ = c;
 }
 
-AmbientLight::AmbientLight()
+bool
+Light::getBounds(Vec3 & lo, Vec3 & hi) const
 {
-  // intentionally empty
+  return false;
 }
 
-AmbientLight::AmbientLight(RGB const & illumination) : Light(illumination)
+double
+Light::getSampleWeight(int num_samples) const
+{
+  return 1.0 / std::pow(num_samples, 0.90);
+}
+
+AmbientLight::AmbientLight()
 {
   // intentionally empty
 }
 
-std::vector<Vec3>
-AmbientLight::getIncidenceVector(Vec3 const & position) const
+AmbientLight::AmbientLight(RGB const & illumination) : Light(illumination)
 {
-  throw "AMBIENT LIGHTS DO NOT HAVE A SENSE OF DIRECTION OR POSITION`";
+  // intentionally empty
 }
 
-std::vector<Ray> AmbientLight::getShadowRay(Vec3 const & position, bool & use_dist) const
+int
+AmbientLight::sample(Vec3 const & position, Sampler & sampler, LightSample * out) const
 {
   throw "AMBIENT LIGHTS DO NOT HAVE A SENSE OF DIRECTION OR POSITION";
 }
@@ -98,23 +108,23 @@ PointLight::setPosition(Vec3 const & pos)
   pos_ = pos;
 }
 
-std::vector<Vec3>
-PointLight::getIncidenceVector(Vec3 const & position) const
+bool
+PointLight::getBounds(Vec3 & lo, Vec3 & hi) const
 {
-  // generate a single incident ray
-  std::vector<Vec3> incidentVectors;
-  incidentVectors.push_back((pos_ - position));
-  return incidentVectors;
+  lo = hi = pos_;
+  return true;
 }
 
-std::vector<Ray>
-PointLight::getShadowRay(Vec3 const & position, bool & use_dist) const
+int
+PointLight::sample(Vec3 const & position, Sampler & sampler, LightSample * out) const
 {
-  // generate a single shadow ray
-  use_dist = true;
-  std::vector<Ray> shadowRays;
-  shadowRays.push_back(Ray::fromOriginAndEnd(position,pos_,1));
-  return shadowRays;
+  // a single sample at the light's position
+  Vec3 toLight = pos_ - position;
+  out[0].position = pos_;
+  out[0].distance = toLight.length();
+  out[0].direction = toLight / out[0].distance;
+  out[0].radiance = PointLight::getColor(toLight);
+  return 1;
 }
 
 DirectionalLight::DirectionalLight(RGB const & illumination) : Light(illumination)
@@ -129,32 +139,25 @@ DirectionalLight::setDirection(Vec3 const & dir)
   dir_.normalize();
 }
 
-std::vector<Vec3>
-DirectionalLight::getIncidenceVector(Vec3 const & position) const
+int
+DirectionalLight::sample(Vec3 const & position, Sampler & sampler, LightSample * out) const
 {
-  // generate a single incident ray
-  std::vector<Vec3> incidentVectors;
-  incidentVectors.push_back((-1*dir_));
-  return incidentVectors;
+  // a single sample infinitely far away
+  out[0].direction = -dir_;
+  out[0].distance = std::numeric_limits<double>::infinity();
+  out[0].radiance = illumination_;
+  return 1;
 }
 
-std::vector<Ray>
-DirectionalLight::getShadowRay(Vec3 const & position, bool & use_dist) const
-{
-  // generate a single shadow ray
-  use_dist = false;
-  std::vector<Ray> shadowRays;
-  shadowRays.push_back(Ray::fromOriginAndDirection(position,-dir_));
-  return shadowRays;
-}
-
-AreaLightSquare::AreaLightSquare(RGB const & illumination) : Light(illumination)
+AreaLightSquare::AreaLightSquare(RGB const & illumination) : Light(illumination), side_(0)
 {
+  setSamples(0);
 }
 
 AreaLightSquare::AreaLightSquare(RGB const & illumination, double falloff, double dead_distance)
-: Light(illumination, falloff, dead_distance)
+: Light(illumination, falloff, dead_distance), side_(0)
 {
+  setSamples(0);
 }
 
 RGB
@@ -181,51 +184,67 @@ AreaLightSquare::setSide(double const & side)
   side_ = side;
 }
 
-std::vector<Vec3>
-AreaLightSquare::getIncidenceVector(Vec3 const & position) const
-{
-  double xStep = 0.25;
-  double yStep = 0.25;
-  double startY = pos_.y() - side_/2;
-  std::vector<Vec3> incidentVectors;
-
-  // for every 0.25 x 0.25 square on area light, generate an incident ray
-  // with random jittering
-  srand(seed);
-  for(; startY < pos_.y() + side_/2; startY += yStep){
-    double startX = pos_.x() - side_/2;
-    for(; startX < pos_.x() + side_/2; startX += xStep){
-      double jitter_x = 0.15 * (std::rand() / (double)RAND_MAX);
-      double jitter_y = 0.15 * (std::rand() / (double)RAND_MAX);
-      Vec3 areaPos_ = Vec3(std::min(startX + jitter_x, pos_.x() + side_/2), std::min(startY + jitter_y, pos_.y() + side_/2), pos_.z());
-      incidentVectors.push_back((areaPos_ - position));
-    }
+bool
+AreaLightSquare::getBounds(Vec3 & lo, Vec3 & hi) const
+{
+  lo = Vec3(pos_.x() - side_/2, pos_.y() - side_/2, pos_.z());
+  hi = Vec3(pos_.x() + side_/2, pos_.y() + side_/2, pos_.z());
+  return true;
+}
+
+void
+AreaLightSquare::setSamples(int samples)
+{
+  samples_ = std::min(samples > 0 ? samples : DEFAULT_SAMPLES, (int)MAX_SAMPLES);
+  grid_ = (int)std::floor(std::sqrt((double)samples_) + 0.5);
+  if (grid_ * grid_ != samples_)
+    grid_ = 0;
+}
+
+Vec3
+AreaLightSquare::getSamplePosition(int i, double u, double v) const
+{
+  // A square count gets a jittered grid, any other count a Kronecker lattice along the golden ratio. Both are shifted as a
+  // whole by (u, v), which keeps every point uniformly distributed over the square.
+  double x, y;
+  if (grid_ > 0)
+  {
+    x = (i % grid_ + u) / grid_;
+    y = (i / grid_ + v) / grid_;
   }
+  else
+  {
+    x = (i + u) / samples_;
+    y = i * 0.6180339887498949 + v;
+    y -= std::floor(y);
+  }
+
+  return Vec3(pos_.x() + (x - 0.5) * side_, pos_.y() + (y - 0.5) * side_, pos_.z());
+}
+
+int
+AreaLightSquare::sample(Vec3 const & position, Sampler & sampler, LightSample * out) const
+{
+  double u, v;
+  sampler.get2D(u, v);
 
-  return incidentVectors;
-}
-
-std::vector<Ray>
-AreaLightSquare::getShadowRay(Vec3 const & position, bool & use_dist) const
-{
-  use_dist = true;
-  double xStep = 0.25;
-  double yStep = 0.25;
-  double startY = pos_.y() - side_/2;
-  std::vector<Ray> shadowRays;
-
-  // for every 0.25 x 0.25 square on area light, generate a shadow ray
-  // with random jittering
-  srand(seed);
-  for(; startY < pos_.y() + side_/2; startY += yStep){
-    double startX = pos_.x() - side_/2;
-    for(; startX < pos_.x() + side_/2; startX += xStep){
-      double jitter_x = 0.15 * (std::rand() / (double)RAND_MAX);
-      double jitter_y = 0.15 * (std::rand() / (double)RAND_MAX);
-      Vec3 areaPos_ = Vec3(std::min(startX + jitter_x, pos_.x() + side_/2), std::min(startY + jitter_y, pos_.y() + side_/2), pos_.z());
-      shadowRays.push_back(Ray::fromOriginAndEnd(position,areaPos_,1));
-    }
+  for(int i = 0; i < samples_; i++){
+    Vec3 samplePos = getSamplePosition(i, u, v);
+    Vec3 toLight = samplePos - position;
+    out[i].position = samplePos;
+    out[i].distance = toLight.length();
+    out[i].direction = toLight / out[i].distance;
+    out[i].radiance = AreaLightSquare::getColor(toLight);
   }
 
-  return shadowRays;
+  return samples_;
+}
+
+double
+AreaLightSquare::getSampleWeight(int num_samples) const
+{
+  // The original renderer fired one ray per 0.25 x 0.25 cell and weighted the sum by cells^-0.9, i.e. it returned the mean
+  // scaled by cells^0.1. Keep that brightness while the sample budget no longer depends on the size of the square.
+  double cells = std::max(std::ceil(side_ / 0.25 - 1e-9), 1.0);
+  return std::pow(cells * cells, 0.10) / num_samples;
 }
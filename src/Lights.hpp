@@ -10,6 +10,23 @@
 #define __Lights_hpp__
 
 #include "Globals.hpp"
+#include "Sampler.hpp"
+
+/** One sample point on a light, as seen from a shading position. */
+struct LightSample
+{
+  Vec3 position;    ///< Point on the light. Unused for directional lights.
+  Vec3 direction;   ///< Normalized direction FROM the shading position TO the sample point.
+  double distance;  ///< Distance from the shading position to the sample point, infinite for directional lights.
+  RGB radiance;     ///< Light arriving at the shading position from this sample (after falloff etc), ignoring shadows.
+
+  /**
+   * Get the ray from \a origin (usually the shading position nudged off the surface) to the sample point, used to check for
+   * shadows. For a sample with a position, the ray ends at the sample point and its minT() is 1, so only hits in between
+   * count; for a directional sample every positive hit time indicates shadowing.
+   */
+  Ray shadowRay(Vec3 const & origin) const;
+};
 
 /** Interface for a light. */
 class Light
@@ -22,7 +39,6 @@ class Light
     double falloff_;
     double angular_falloff_;
     double dead_distance_;
-    int seed;
 
   public:
     /** Destructor. */
@@ -37,28 +53,33 @@ class Light
     /** Get the color of the light at a point in the scene (after falloff etc). */
     virtual RGB getColor(Vec3 const & p) const;
 
+    /** Get the exponent of the distance falloff. */
+    double getFalloff() const { return falloff_; }
+
+    /** Get the distance added to the light distance before applying falloff. */
+    double getDeadDistance() const { return dead_distance_; }
+
     /**
-     * Returns a vector of normalized vectors describing the direction of lights at a given position. The direction should be FROM the
-     * point TO the light source. This is used in the shading calculation. We have used a vector since for an area light
-     * there are multiple incident rays
+     * Get the bounding box \a lo - \a hi of the points the light emits from. Returns false, leaving the box unset, for lights
+     * with no position.
      */
-    virtual std::vector<Vec3> getIncidenceVector(Vec3 const & position) const = 0;
+    virtual bool getBounds(Vec3 & lo, Vec3 & hi) const;
+
+    /** Maximum number of samples any light returns per evaluation, so callers can size fixed buffers. */
+    static int const MAX_SAMPLES = 256;
 
     /**
-     * Get the rays from the given position to the light, used to check for shadows. The length of the ray's direction vector
-     * should be the <i>unnormalized distance</i> from \a position to the light, so that hit times <= 1 indicate shadowing.
-     * \a use_dist is normally set to true. For direction lights, which have no source position, the length of the direction
-     * vector is arbitrary, and use_dist is set to false, indicating that the distance (i.e. time) check should be ignored --
-     * all positive hit times indicate shadowing.
+     * Samples the light as seen from a given position, writing the position, direction, distance and radiance of each sample
+     * to \a out, which must hold at least MAX_SAMPLES entries, and returns how many were written. There can be several since
+     * an area light has multiple sample points; these draw their positions from \a sampler.
      */
-    virtual std::vector<Ray> getShadowRay(Vec3 const & position, bool & use_dist) const = 0;
+    virtual int sample(Vec3 const & position, Sampler & sampler, LightSample * out) const = 0;
 
     /**
-     * this function is for controlling the random sampling of incident rays
-     * and shadow rays in area lights since we want the shadow rays and incident rays
-     * to be indentical and also want some random jittering
+     * Get the factor each of the \a num_samples unshadowed samples returned by sample() contributes with. Summing all the
+     * light of a multi-sample light is too bright and averaging it too dim, so the default is the 1/n^0.9 tradeoff.
      */
-    void setSeed(int s){ seed = s; }
+    virtual double getSampleWeight(int num_samples) const;
 };
 
 /** Ambient light, constant throughout the scene. */
@@ -68,8 +89,7 @@ class AmbientLight : public Light
     AmbientLight();
     AmbientLight(RGB const & illumination);
 
-    std::vector<Vec3> getIncidenceVector(Vec3 const & position) const;
-    std::vector<Ray> getShadowRay(Vec3 const & position, bool & use_dist) const;
+    int sample(Vec3 const & position, Sampler & sampler, LightSample * out) const;
 };
 
 /** Point light, with a fixed location in the scene. */
@@ -81,8 +101,8 @@ class PointLight : public Light
     void setPosition(Vec3 const & pos);
 
     RGB getColor(Vec3 const & p) const;
-    std::vector<Vec3> getIncidenceVector(Vec3 const & position) const;
-    std::vector<Ray> getShadowRay(Vec3 const & position, bool & use_dist) const;
+    bool getBounds(Vec3 & lo, Vec3 & hi) const;
+    int sample(Vec3 const & position, Sampler & sampler, LightSample * out) const;
 
   private:
     Vec3 pos_;
@@ -95,29 +115,55 @@ class DirectionalLight : public Light
     DirectionalLight(RGB const & illumination);
     void setDirection(Vec3 const & dir);
 
-    std::vector<Vec3> getIncidenceVector(Vec3 const & position) const;
-    std::vector<Ray> getShadowRay(Vec3 const & position, bool & use_dist) const;
+    int sample(Vec3 const & position, Sampler & sampler, LightSample * out) const;
 
   private:
     Vec3 dir_;
 };
 
-/** Area light of the form of a square, fixed location in scene, parallel to xy axis */
+/**
+ * Area light of the form of a square, fixed location in scene, parallel to xy axis. Each evaluation uses a fixed number of
+ * stratified sample points, independent of the size of the square.
+ */
 class AreaLightSquare : public Light
 {
   public:
+    /** Number of samples used when neither the scene nor the command line sets one. */
+    static int const DEFAULT_SAMPLES = 64;
+
     AreaLightSquare(RGB const & illumination);
     AreaLightSquare(RGB const & illumination, double falloff, double dead_distance);
     void setPosition(Vec3 const & pos);
     void setSide(double const & side);
 
+    /** Set the number of sample points per evaluation, at most MAX_SAMPLES. Zero selects the default. */
+    void setSamples(int samples);
+
+    /** Get the number of sample points per evaluation. */
+    int getSamples() const { return samples_; }
+
     RGB getColor(Vec3 const & p) const;
-    std::vector<Vec3> getIncidenceVector(Vec3 const & position) const;
-    std::vector<Ray> getShadowRay(Vec3 const & position, bool & use_dist) const;
+    bool getBounds(Vec3 & lo, Vec3 & hi) const;
+    int sample(Vec3 const & position, Sampler & sampler, LightSample * out) const;
+    double getSampleWeight(int num_samples) const;
 
   private:
+    /** Get the \a i 'th sample point, for a stratified pattern shifted by (\a u, \a v). */
+    Vec3 getSamplePosition(int i, double u, double v) const;
+
     Vec3 pos_;
     double side_;
+    int samples_;
+    int grid_;   // samples_ is grid_ * grid_ if it is square, else zero
 };
 
+inline Ray
+LightSample::shadowRay(Vec3 const & origin) const
+{
+  if (distance == std::numeric_limits<double>::infinity())
+    return Ray::fromOriginAndDirection(origin, direction);
+
+  return Ray::fromOriginAndEnd(origin, position, 1);
+}
+
 #endif  // __Lights_hpp__
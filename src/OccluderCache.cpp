@@ -0,0 +1,17 @@
+/*
+ * OccluderCache.cpp
+ *
+ * Per-thread memory of the primitives that last blocked shadow rays to each light.
+ */
+
+#include "OccluderCache.hpp"
+
+OccluderCache::OccluderCache()
+: lookups_(0), hits_(0)
+{
+  for (int i = 0; i < NUM_SLOTS; ++i)
+  {
+    lights_[i] = NULL;
+    occluders_[i] = Occluder();
+  }
+}
@@ -0,0 +1,60 @@
+/*
+ * OccluderCache.hpp
+ *
+ * Per-thread memory of the primitives that last blocked shadow rays to each light.
+ */
+
+#ifndef __OccluderCache_hpp__
+#define __OccluderCache_hpp__
+
+#include "Globals.hpp"
+#include "Lights.hpp"
+#include "Primitives.hpp"
+
+/**
+ * Remembers, for each light, the last element of a primitive found blocking a shadow ray to it. Neighbouring shading points
+ * usually have the same occluder, so testing it first often settles a shadow ray without traversing the world; for a set of
+ * triangles, only the one triangle is tested. The cache is direct-mapped on the light pointer, so a thread can keep one for the
+ * whole render without any allocation; lights that collide simply evict each other. Not thread-safe: each thread owns its own.
+ */
+class OccluderCache
+{
+  public:
+    /** Constructor. Starts empty. */
+    OccluderCache();
+
+    /** Get the slot holding the last occluder of a light, whose prim is NULL if there is none or it was evicted. */
+    Occluder & slot(Light const * light);
+
+    /** Record a lookup, and whether the cached occluder blocked the ray. */
+    void count(bool hit) { ++lookups_; if (hit) ++hits_; }
+
+    /** Get the number of lookups. */
+    unsigned long lookups() const { return lookups_; }
+
+    /** Get the number of lookups settled by the cached occluder. */
+    unsigned long hits() const { return hits_; }
+
+  private:
+    static int const NUM_SLOTS = 64;
+
+    Light const * lights_[NUM_SLOTS];
+    Occluder occluders_[NUM_SLOTS];
+    unsigned long lookups_;
+    unsigned long hits_;
+};
+
+inline Occluder &
+OccluderCache::slot(Light const * light)
+{
+  size_t key = (size_t)light;
+  int i = (int)((key >> 4) ^ (key >> 10)) & (NUM_SLOTS - 1);
+  if (lights_[i] != light)
+  {
+    lights_[i] = light;
+    occluders_[i] = Occluder();
+  }
+  return occluders_[i];
+}
+
+#endif  // __OccluderCache_hpp__
@@ -8,68 +8,305 @@
 
 #include "Primitives.hpp"
 
-Primitive::Primitive(RGB const & c, Material const & m, Mat4 const & modelToWorld)
+namespace {
+
+// Find the nearest hit time in (0, t] of a ray with direction dir and origin offset by f from the centre of a sphere of radius
+// sqrt(radius2), lowering t if there is one. Solved in the form of Haines et al., "Precision Improvements for Ray/Sphere
+// Intersection", Ray Tracing Gems (2019): the discriminant comes from the distance of the centre to the line, which does not
+// cancel catastrophically for distant spheres, and the two roots are taken without subtracting nearly equal terms.
+bool
+intersectSphere(Vec3 const & f, Vec3 const & dir, double radius2, double & t)
 {
-  c_ = c;
-  m_ = m;
-  modelToWorld_ = modelToWorld;
-  worldToModel_ = modelToWorld.inverse();
+  double a = dir * dir;
+  double b = -(f * dir);                  // minus half the linear coefficient
+  Vec3 l = f + dir * (b / a);             // offset of the centre from the closest point on the line
+  double discriminant = a * (radius2 - l * l);
+  if(discriminant < 0){ return false; }
+
+  double q = b + (b >= 0 ? 1 : -1) * std::sqrt(discriminant);
+  double t0 = (f * f - radius2) / q, t1 = q / a;
+  if(t0 > t1){ std::swap(t0, t1); }
+
+  double nearest = (t0 > 0) ? t0 : t1;
+  if(nearest <= 0 || nearest > t){ return false; }
+
+  t = nearest;
+  return true;
+}
+
+} // namespace
+
+uint32_t
+MaterialTable::add(RGB const & c, Material const & m)
+{
+  // a fixed-size key, so a lookup allocates nothing; adding 0 turns -0 into 0, which compares bytewise equal to it
+  double const values[NUM_VALUES] = { c[0], c[1], c[2], m.getMA(), m.getML(), m.getMS(), m.getMSP(), m.getMSM(), m.getMR(),
+                                      m.getMT(), m.getMTN() };
+  Key key;
+  for (int i = 0; i < NUM_VALUES; ++i)
+    key.values[i] = values[i] + 0.0;
+
+  std::unordered_map<Key, uint32_t, KeyHash>::const_iterator existing = index_.find(key);
+  if (existing != index_.end())
+    return existing->second;
+
+  uint32_t index = (uint32_t)colors_.size();
+  colors_.push_back(c);
+  materials_.push_back(m);
+  index_[key] = index;
+  return index;
+}
+
+Primitive::Primitive(uint32_t material, Mat4 const & modelToWorld)
+{
+  material_ = material;
+  modelToWorld_ = Affine3(modelToWorld);
+  worldToModel_ = modelToWorld_.inverse();
 }
 
 Primitive::~Primitive()
 {
 }
 
-Sphere::Sphere(double radius, RGB const & c, Material const & m, Mat4 const & modelToWorld): Primitive(c, m, modelToWorld)
+Sphere::Sphere(double radius, uint32_t material, Mat4 const & modelToWorld): Primitive(material, modelToWorld)
 {
   r_ = radius;
+
+  double scale = 0;
+  similarity_ = modelToWorld_.isSimilarity(scale);
+  world_centre_ = modelToWorld_.transformPoint(Vec3(0, 0, 0));
+  world_radius_ = scale * r_;
 }
 
 bool
 Sphere::intersect(Ray & ray) const
 {
-  // transform world coordinates to local coordinates
+  if(similarity_){
+    double t = ray.minT();
+    if(!intersectSphere(ray.start() - world_centre_, ray.direction(), world_radius_ * world_radius_, t)){ return false; }
+
+    ray.setMinT(t);
+    return true;
+  }
+
+  // transform world coordinates to local coordinates, where the sphere is centred at the origin
   ray.transform(worldToModel_);
 
-  double dot = (ray.start()*ray.direction());
-  double discriminant1 = std::pow(dot,2);
-  double discriminant2 = ray.direction().length2()*(ray.start().length2() - r_*r_);
-  discriminant1 -= discriminant2;
-  if(discriminant1 < 0){ return false; } // if discriminant negative implies no intersection
-  else{ // else
-    double t1 = -dot + std::sqrt(discriminant1);
-    double t2 = -dot - std::sqrt(discriminant1);
-    t1 = t1/ray.direction().length2();
-    t2 = t2/ray.direction().length2();
-    if((t1 <= 0 && t2 <= 0) || (t1 > ray.minT() && t2 > ray.minT())){
-      return false;
-    }
-    else{
-      if(t2 <= 0){ ray.setMinT(t1); }
-      else{ ray.setMinT(t2); }
-      return true;
-    }
+  double t = ray.minT();
+  if(!intersectSphere(ray.start(), ray.direction(), r_ * r_, t)){ return false; }
+
+  ray.setMinT(t);
+  return true;
+}
+
+bool
+Sphere::intersect(Rayf const & ray, Hitf & hit) const
+{
+  if(similarity_){
+    // in double precision: large spheres, such as those standing in for walls, lose too much in single precision
+    double t = hit.t;
+    if(!intersectSphere(ray.org.toVec3() - world_centre_, ray.dir.toVec3(), world_radius_ * world_radius_, t)){ return false; }
+
+    hit.t = (float)t;
+    hit.element = 0;
+    return true;
+  }
+
+  Ray r = Ray::fromOriginAndDirection(ray.org.toVec3(), ray.dir.toVec3(), hit.t);
+  if(!intersect(r)){ return false; }
+
+  hit.t = (float)r.minT();
+  hit.element = 0;
+  return true;
+}
+
+void
+Sphere::getBounds(Vec3 & lo, Vec3 & hi) const
+{
+  if(similarity_){
+    Vec3 extent(world_radius_, world_radius_, world_radius_);
+    lo = world_centre_ - extent;
+    hi = world_centre_ + extent;
+    return;
   }
+
+  // the sphere's image is an ellipsoid, whose half-width along world axis i is r_ times the length of row i of the 3x3 part
+  Vec3 c0 = modelToWorld_.transformVector(Vec3(1, 0, 0));
+  Vec3 c1 = modelToWorld_.transformVector(Vec3(0, 1, 0));
+  Vec3 c2 = modelToWorld_.transformVector(Vec3(0, 0, 1));
+  Vec3 extent;
+  for(int i = 0; i < 3; i++){
+    extent[i] = r_ * std::sqrt(c0[i]*c0[i] + c1[i]*c1[i] + c2[i]*c2[i]);
+  }
+  Vec3 centre = modelToWorld_.transformPoint(Vec3(0, 0, 0));
+  lo = centre - extent;
+  hi = centre + extent;
 }
 
 Vec3
-Sphere::calculateNormal(Vec3 const & position) const
+Sphere::calculateNormal(Vec3 const & position, uint32_t element) const
 {
+  if(similarity_){
+    Vec3 world_normal_direction = position - world_centre_;
+    return world_normal_direction.normalize();
+  }
+
   // convert world coordinates to local coordinates
-  Vec3 local_position = Vec3(worldToModel_* Vec4(position, 1.0));
+  Vec3 local_position = worldToModel_.transformPoint(position);
   Vec3 local_normal_direction = (local_position)/r_ ; // local normal
-  Mat4 normalMatrix = modelToWorld_.inverse().transpose();
-  Vec3 world_normal_direction = Vec3(normalMatrix * Vec4(local_normal_direction, 0.0), 3); // transform to global normal
+  // normals transform by the inverse transpose of modelToWorld_, i.e. the transpose of worldToModel_
+  Vec3 world_normal_direction = worldToModel_.transposeTransformVector(local_normal_direction); // transform to global normal
   return world_normal_direction.normalize();
 }
 
+SphereSet::SphereSet()
+: Primitive(0, identity3D()), count_(0)
+{
+  for (int i = 0; i < WIDTH; ++i)
+  {
+    cx_[i] = cy_[i] = cz_[i] = 0;
+    r2_[i] = -1;
+    material_[i] = 0;
+  }
+}
+
+bool
+SphereSet::add(Vec3 const & centre, double radius, uint32_t material)
+{
+  if (count_ == WIDTH)
+    return false;
+
+  cx_[count_] = centre[0];
+  cy_[count_] = centre[1];
+  cz_[count_] = centre[2];
+  r2_[count_] = radius * radius;
+  material_[count_] = material;
+  ++count_;
+  return true;
+}
+
+bool
+SphereSet::findNearest(Vec3 const & org, Vec3 const & dir, double & t, uint32_t & element) const
+{
+#ifdef ALGEBRA3_AVX
+  // The same solution as intersectSphere(), for four spheres per instruction: the set is two halves of four lanes in double
+  // precision, which large spheres (such as those standing in for walls) need
+  __m256d const dx = _mm256_set1_pd(dir[0]), dy = _mm256_set1_pd(dir[1]), dz = _mm256_set1_pd(dir[2]);
+  __m256d const a = _mm256_set1_pd(dir * dir);
+  __m256d const zero = _mm256_setzero_pd();
+  __m256d const sign_bit = _mm256_set1_pd(-0.0);
+
+  double nearest[WIDTH];
+  int hits = 0;  // one bit per sphere
+  for (int h = 0; h < WIDTH; h += 4)
+  {
+    __m256d fx = _mm256_sub_pd(_mm256_set1_pd(org[0]), _mm256_loadu_pd(cx_ + h));
+    __m256d fy = _mm256_sub_pd(_mm256_set1_pd(org[1]), _mm256_loadu_pd(cy_ + h));
+    __m256d fz = _mm256_sub_pd(_mm256_set1_pd(org[2]), _mm256_loadu_pd(cz_ + h));
+    __m256d r2 = _mm256_loadu_pd(r2_ + h);
+
+    __m256d fd = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(fx, dx), _mm256_mul_pd(fy, dy)), _mm256_mul_pd(fz, dz));
+    __m256d b = _mm256_xor_pd(fd, sign_bit);
+    __m256d s = _mm256_div_pd(b, a);
+    __m256d lx = _mm256_add_pd(fx, _mm256_mul_pd(dx, s));
+    __m256d ly = _mm256_add_pd(fy, _mm256_mul_pd(dy, s));
+    __m256d lz = _mm256_add_pd(fz, _mm256_mul_pd(dz, s));
+    __m256d ll = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(lx, lx), _mm256_mul_pd(ly, ly)), _mm256_mul_pd(lz, lz));
+    __m256d discriminant = _mm256_mul_pd(a, _mm256_sub_pd(r2, ll));
+    __m256d valid = _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ);
+
+    // q = b + sign(b) sqrt(discriminant), taking the sign of zero as positive as intersectSphere() does
+    __m256d root = _mm256_sqrt_pd(_mm256_max_pd(discriminant, zero));
+    __m256d negative = _mm256_cmp_pd(b, zero, _CMP_LT_OQ);
+    __m256d q = _mm256_add_pd(b, _mm256_xor_pd(root, _mm256_and_pd(negative, sign_bit)));
+
+    __m256d ff = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(fx, fx), _mm256_mul_pd(fy, fy)), _mm256_mul_pd(fz, fz));
+    __m256d t0 = _mm256_div_pd(_mm256_sub_pd(ff, r2), q);
+    __m256d t1 = _mm256_div_pd(q, a);
+    __m256d near = _mm256_min_pd(t0, t1), far = _mm256_max_pd(t0, t1);
+    __m256d hit = _mm256_blendv_pd(far, near, _mm256_cmp_pd(near, zero, _CMP_GT_OQ));
+
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(hit, zero, _CMP_GT_OQ));
+    hits |= _mm256_movemask_pd(valid) << h;
+    _mm256_storeu_pd(nearest + h, hit);
+  }
+
+  bool found = false;
+  for (int i = 0; i < count_; ++i)
+  {
+    if ((hits & (1 << i)) && nearest[i] <= t)
+    {
+      t = nearest[i];
+      element = (uint32_t)i;
+      found = true;
+    }
+  }
+
+  return found;
+#else
+  bool found = false;
+  for (int i = 0; i < count_; ++i)
+  {
+    if (intersectSphere(org - Vec3(cx_[i], cy_[i], cz_[i]), dir, r2_[i], t))
+    {
+      element = (uint32_t)i;
+      found = true;
+    }
+  }
+
+  return found;
+#endif
+}
+
+bool
+SphereSet::intersect(Ray & ray) const
+{
+  double t = ray.minT();
+  uint32_t element;
+  if (!findNearest(ray.start(), ray.direction(), t, element))
+    return false;
+
+  ray.setMinT(t);
+  return true;
+}
+
+bool
+SphereSet::intersect(Rayf const & ray, Hitf & hit) const
+{
+  double t = hit.t;
+  if (!findNearest(ray.org.toVec3(), ray.dir.toVec3(), t, hit.element))
+    return false;
+
+  hit.t = (float)t;
+  return true;
+}
+
+Vec3
+SphereSet::calculateNormal(Vec3 const & position, uint32_t element) const
+{
+  Vec3 world_normal_direction = position - Vec3(cx_[element], cy_[element], cz_[element]);
+  return world_normal_direction.normalize();
+}
+
+void
+SphereSet::getBounds(Vec3 & lo, Vec3 & hi) const
+{
+  for (int i = 0; i < count_; ++i)
+  {
+    Vec3 centre(cx_[i], cy_[i], cz_[i]);
+    double r = std::sqrt(r2_[i]);
+    Vec3 extent(r, r, r);
+    lo = (i == 0) ? centre - extent : min(lo, centre - extent);
+    hi = (i == 0) ? centre + extent : max(hi, centre + extent);
+  }
+}
+
 //=============================================================================================================================
 // Triangle and other primitives are for Assignment 3b, after the midsem. Do not do this for 3a.
 //=============================================================================================================================
 
-Triangle::Triangle(Vec3 const & v0, Vec3 const & v1, Vec3 const & v2, RGB const & c, Material const & m,
-                   Mat4 const & modelToWorld)
-: Primitive(c, m, modelToWorld)
+Triangle::Triangle(Vec3 const & v0, Vec3 const & v1, Vec3 const & v2, uint32_t material, Mat4 const & modelToWorld)
+: Primitive(material, modelToWorld)
 {
   verts[0] = v0;
   verts[1] = v1;
@@ -82,50 +319,60 @@ Triangle::Triangle(Vec3 const & v0, Vec3 const & v1, Vec3 const & v2, RGB const
   vertexNormal[0] = surfaceNormal;
   vertexNormal[1] = surfaceNormal;
   vertexNormal[2] = surfaceNormal;
+
+  Vec3 w0 = modelToWorld_.transformPoint(v0);
+  Vec3 w1 = modelToWorld_.transformPoint(v1);
+  Vec3 w2 = modelToWorld_.transformPoint(v2);
+  world_v0_ = Vec3f(w0);
+  world_e1_ = Vec3f(w1 - w0);
+  world_e2_ = Vec3f(w2 - w0);
 }
 
 bool
 Triangle::intersect(Ray & ray) const
 {
-  // solve the equation (s + cd - b).n = 0 for c where
-  // s -> starting point of ray
-  // d -> direction of ray
-  // b -> any one vertex of triangle
-  // n -> local normal of Triangle
-  // Calculate local normal
-  ray.transform(worldToModel_);
+  Hitf hit;
+  hit.t = (float)ray.minT();
+  if(!intersect(Rayf(ray), hit)){ return false; }
 
-  double RHS = verts[1]*surfaceNormal;
-  double LHS1 = ray.start()*surfaceNormal;
-  double LHS2 = ray.direction()*surfaceNormal;
-  if(LHS2 == 0){ return false; } // Assumption : grazing condition
-  else{
-    double t = (RHS - LHS1)/LHS2;
-    if(t <= 0 || t > ray.minT()){ return false; }
-    else{
-      // check if point lies inside Triangle
-      Vec3 p = ray.start() + t*ray.direction();
-      Vec3 p0 = ray.start();
-
-      // courtesy : https://www.cs.princeton.edu/courses/archive/fall00/cs426/lectures/raycast/sld018.htm
-      Vec3 n1 = (verts[1] - p0)^(verts[0] - p0); n1.normalize();
-      double d1 = p*n1 - p0*n1; if(d1 < 0) return false;
-      n1 = (verts[2] - p0)^(verts[1] - p0); n1.normalize();
-      d1 = p*n1 - p0*n1; if(d1 < 0) return false;
-      n1 = (verts[0] - p0)^(verts[2] - p0); n1.normalize();
-      d1 = p*n1 - p0*n1; if(d1 < 0) return false;
-
-      ray.setMinT(t);
-      return true;
-    }
-  }
+  ray.setMinT(hit.t);
+  return true;
+}
+
+bool
+Triangle::intersect(Rayf const & ray, Hitf & hit) const
+{
+  // test in world space; the ray's hit time is the same in model and world space since the transform is affine. Only rays
+  // arriving against the normal (counter-clockwise winding) hit, as before.
+  if(!intersectTriangle(ray, world_v0_, world_e1_, world_e2_, hit.t)){ return false; }
+
+  hit.element = 0;
+  return true;
+}
+
+bool
+Triangle::getWorldTriangle(Vec3 & w0, Vec3 & w1, Vec3 & w2) const
+{
+  w0 = modelToWorld_.transformPoint(verts[0]);
+  w1 = modelToWorld_.transformPoint(verts[1]);
+  w2 = modelToWorld_.transformPoint(verts[2]);
+  return true;
+}
+
+void
+Triangle::getBounds(Vec3 & lo, Vec3 & hi) const
+{
+  // the vertices that the single-precision intersection test sees
+  Vec3 w0 = world_v0_.toVec3(), w1 = (world_v0_ + world_e1_).toVec3(), w2 = (world_v0_ + world_e2_).toVec3();
+  lo = min(w0, min(w1, w2));
+  hi = max(w0, max(w1, w2));
 }
 
 Vec3
-Triangle::calculateNormal(Vec3 const & position) const
+Triangle::calculateNormal(Vec3 const & position, uint32_t element) const
 {
   // Assumption: points assumed to be in counter clockwise direction
-  Vec3 local_position = Vec3(worldToModel_* Vec4(position, 1.0));
+  Vec3 local_position = worldToModel_.transformPoint(position);
   double weight1 = 0, weight2 = 0, weight3 = 0;
 
   // find weights using triangular interpolation
@@ -135,11 +382,20 @@ Triangle::calculateNormal(Vec3 const & position) const
 
   Vec3 local_normal_direction = vertexNormal[0]*weight1 + vertexNormal[1]*weight2 + vertexNormal[2]*weight3;
   local_normal_direction.normalize();
-  Mat4 normalMatrix = modelToWorld_.inverse().transpose();
-  Vec3 world_normal_direction = Vec3(normalMatrix * Vec4(local_normal_direction, 0.0), 3); // transform to global normal
+  // normals transform by the inverse transpose of modelToWorld_, i.e. the transpose of worldToModel_
+  Vec3 world_normal_direction = worldToModel_.transposeTransformVector(local_normal_direction); // transform to global normal
   return world_normal_direction.normalize(); // transformation from local to global and then normalize
 }
 
+void
+Triangle::getWorldVertexNormals(Vec3 & n0, Vec3 & n1, Vec3 & n2) const
+{
+  // normals transform by the inverse transpose of modelToWorld_, i.e. the transpose of worldToModel_
+  n0 = worldToModel_.transposeTransformVector(vertexNormal[0]);
+  n1 = worldToModel_.transposeTransformVector(vertexNormal[1]);
+  n2 = worldToModel_.transposeTransformVector(vertexNormal[2]);
+}
+
 Vec3
 Triangle::getvert1(){ return verts[0]; }
 
@@ -216,3 +472,101 @@ Triangle::computeVertexNormal() {
   vertexNormal[1].normalize();
   vertexNormal[2].normalize();
 }
+
+TriangleSet::TriangleSet()
+: Primitive(0, identity3D())
+{
+}
+
+uint32_t
+TriangleSet::addVertex(Vec3f const & position, Vec3f const & normal)
+{
+  positions_.push_back(position);
+  normals_.push_back(normal);
+  return (uint32_t)positions_.size() - 1;
+}
+
+void
+TriangleSet::addTriangle(uint32_t v0, uint32_t v1, uint32_t v2, uint32_t material)
+{
+  corners_.push_back(v0);
+  corners_.push_back(v1);
+  corners_.push_back(v2);
+  materials_.push_back(material);
+}
+
+bool
+TriangleSet::intersect(Ray & ray) const
+{
+  Hitf hit;
+  hit.t = (float)ray.minT();
+  if(!intersect(Rayf(ray), hit)){ return false; }
+
+  ray.setMinT(hit.t);
+  return true;
+}
+
+bool
+TriangleSet::intersect(Rayf const & ray, Hitf & hit) const
+{
+  bool found = false;
+  for (uint32_t i = 0; i < size(); ++i)
+  {
+    uint32_t const * c = getCorners(i);
+    Vec3f const & v0 = positions_[c[0]];
+    if (intersectTriangle(ray, v0, positions_[c[1]] - v0, positions_[c[2]] - v0, hit.t))
+    {
+      hit.element = i;
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+bool
+TriangleSet::intersectElement(Rayf const & ray, Hitf & hit, uint32_t element) const
+{
+  uint32_t const * c = getCorners(element);
+  Vec3f const & v0 = positions_[c[0]];
+  if (!intersectTriangle(ray, v0, positions_[c[1]] - v0, positions_[c[2]] - v0, hit.t))
+    return false;
+
+  hit.element = element;
+  return true;
+}
+
+Vec3
+TriangleSet::calculateNormal(Vec3 const & position, uint32_t element) const
+{
+  uint32_t const * c = getCorners(element);
+  Vec3 v0 = positions_[c[0]].toVec3(), v1 = positions_[c[1]].toVec3(), v2 = positions_[c[2]].toVec3();
+
+  // weight each vertex normal by the area of the sub-triangle opposite it, as Triangle does in model space: an affine
+  // transform scales all areas in the plane alike, so the interpolated direction is the same
+  double weight1 = ((position - v1)^(position - v2)).length();
+  double weight2 = ((position - v0)^(position - v2)).length();
+  double weight3 = ((position - v0)^(position - v1)).length();
+
+  Vec3 normal = normals_[c[0]].toVec3()*weight1 + normals_[c[1]].toVec3()*weight2 + normals_[c[2]].toVec3()*weight3;
+  return normal.normalize();
+}
+
+void
+TriangleSet::getBounds(Vec3 & lo, Vec3 & hi) const
+{
+  lo = hi = Vec3(0, 0, 0);
+  for (size_t i = 0; i < positions_.size(); ++i)
+  {
+    Vec3 p = positions_[i].toVec3();
+    lo = (i == 0) ? p : min(lo, p);
+    hi = (i == 0) ? p : max(hi, p);
+  }
+}
+
+size_t
+TriangleSet::memoryUsage() const
+{
+  return sizeof(TriangleSet) + positions_.size() * 2 * sizeof(Vec3f) + corners_.size() * sizeof(uint32_t)
+       + materials_.size() * sizeof(uint32_t);
+}
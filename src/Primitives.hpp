@@ -10,12 +10,63 @@
 #define __Primitive_hpp__
 
 #include "Globals.hpp"
+#include <cstring>
+#include <unordered_map>
+
+/**
+ * A table of distinct (color, material) pairs. Primitives refer to their appearance by an index into the World's table rather
+ * than holding their own copy.
+ */
+class MaterialTable
+{
+  public:
+    /** Get the index of a color and material, adding them to the table if they are not already in it. */
+    uint32_t add(RGB const & c, Material const & m);
+
+    /** Get the number of entries. */
+    uint32_t size() const { return (uint32_t)colors_.size(); }
+
+    /** Get the color with a given index. */
+    RGB const & getColor(uint32_t index) const { return colors_[index]; }
+
+    /** Get the material with a given index. */
+    Material const & getMaterial(uint32_t index) const { return materials_[index]; }
+
+  private:
+    static int const NUM_VALUES = 11;
+
+    /** The color and material values of an entry, by which entries are looked up. */
+    struct Key
+    {
+      double values[NUM_VALUES];
+
+      bool operator==(Key const & other) const { return std::memcmp(values, other.values, sizeof(values)) == 0; }
+    };
+
+    /** Hash of the bytes of a Key (FNV-1a). */
+    struct KeyHash
+    {
+      size_t operator()(Key const & key) const
+      {
+        unsigned char const * bytes = reinterpret_cast<unsigned char const *>(key.values);
+        size_t h = 2166136261u;
+        for (size_t i = 0; i < sizeof(key.values); ++i)
+          h = (h ^ bytes[i]) * 16777619u;
+
+        return h;
+      }
+    };
+
+    std::vector<RGB> colors_;
+    std::vector<Material> materials_;
+    std::unordered_map<Key, uint32_t, KeyHash> index_;  // index of each entry
+};
 
 /** Interface for a scene primitive (e.g. a sphere). */
 class Primitive
 {
   protected:
-    Primitive(RGB const & c, Material const & m, Mat4 const & modelToWorld);  // primitives are an abstract class
+    Primitive(uint32_t material, Mat4 const & modelToWorld);  // primitives are an abstract class
 
   public:
     /** Destructor. */
@@ -33,32 +84,59 @@ class Primitive
     virtual bool intersect(Ray & ray) const = 0;
 
     /**
-     * Calculates the normal for the given position on this primitive. You may assume the position is actually on the
-     * primitive. The position is specified in world space.
+     * Single-precision form of intersect(Ray &), used when tracing through the World. If the ray hits this primitive at a
+     * positive time smaller than hit.t, sets hit.t (and hit.element, for primitives made of several elements) and returns true.
+     * hit.prim is left to the caller. The ray is not modified.
+     */
+    virtual bool intersect(Rayf const & ray, Hitf & hit) const = 0;
+
+    /**
+     * As intersect(Rayf const &, Hitf &), testing only one element of a primitive made of several, as found in hit.element by an
+     * earlier test. By default, tests the whole primitive.
+     */
+    virtual bool intersectElement(Rayf const & ray, Hitf & hit, uint32_t element) const { return intersect(ray, hit); }
+
+    /**
+     * Calculates the normal for the given position on this primitive, which lies on the given element for primitives made of
+     * several elements. You may assume the position is actually on the primitive. The position is specified in world space.
      *
      * !!! REMEMBER TO TAKE THE PRIMITIVE TRANSFORM (modelToWorld_/worldToModel_) INTO ACCOUNT !!!
      */
-    virtual Vec3 calculateNormal(Vec3 const & position) const = 0;
+    virtual Vec3 calculateNormal(Vec3 const & position, uint32_t element = 0) const = 0;
 
-    /** Set the primitive's color. */
-    void setColor(RGB const & c) { c_ = c; }
+    /** Get the world-space axis-aligned bounding box of the primitive. */
+    virtual void getBounds(Vec3 & lo, Vec3 & hi) const = 0;
 
-    /** Set the primitive's material. */
-    void setMaterial(Material const & m) { m_ = m; }
+    /** Get the memory used by the primitive, in bytes. */
+    virtual size_t memoryUsage() const = 0;
 
-    /** Get the primitive's color. */
-    RGB const & getColor() const { return c_; }
+    /**
+     * If the primitive is a single triangle, get its world-space vertices, in counter-clockwise order seen from the side it can
+     * be hit from, and return true. Spatial indices use this to store triangles in their own compact form.
+     */
+    virtual bool getWorldTriangle(Vec3 & w0, Vec3 & w1, Vec3 & w2) const { return false; }
 
-    /** Get the primitive's material. */
-    Material const & getMaterial() const { return m_; }
+    /** Set the index of the primitive's color and material in the world's MaterialTable. */
+    void setMaterialIndex(uint32_t material) { material_ = material; }
+
+    /** Get the index of the primitive's color and material, or those of one of its elements, in the world's MaterialTable. */
+    virtual uint32_t getMaterialIndex(uint32_t element = 0) const { return material_; }
 
   protected:
-    Mat4 modelToWorld_;
-    Mat4 worldToModel_;
+    Affine3 modelToWorld_;
+    Affine3 worldToModel_;
 
   private:
-    RGB c_;
-    Material m_;
+    uint32_t material_;
+};
+
+/** An element of a primitive, such as one that blocked a shadow ray (see World::occluded()). */
+struct Occluder
+{
+  Primitive const * prim;  // NULL for none
+  uint32_t element;
+
+  Occluder() : prim(NULL), element(0) {}
 };
 
 /** A sphere primitive. */
@@ -66,13 +144,57 @@ class Sphere : public Primitive
 {
   public:
     /** Constructor. */
-    Sphere(double radius, RGB const & c, Material const & m, Mat4 const & modelToWorld);
+    Sphere(double radius, uint32_t material, Mat4 const & modelToWorld);
 
     bool intersect(Ray & ray) const;
-    Vec3 calculateNormal(Vec3 const & position) const;
+    bool intersect(Rayf const & ray, Hitf & hit) const;
+    Vec3 calculateNormal(Vec3 const & position, uint32_t element = 0) const;
+    void getBounds(Vec3 & lo, Vec3 & hi) const;
+    size_t memoryUsage() const { return sizeof(Sphere); }
 
   private:
     double r_;
+
+    // A translation, rotation and uniform scale keep the sphere a sphere, which is then intersected directly in world space
+    bool similarity_;
+    Vec3 world_centre_;
+    double world_radius_;
+};
+
+/**
+ * Up to WIDTH spheres, given directly in world space, with their centres and squared radii stored as structures of arrays so
+ * all of them are tested against a ray at once with SIMD instructions. Elements are the spheres, in the order they were added,
+ * and each has its own material index.
+ */
+class SphereSet : public Primitive
+{
+  public:
+    static int const WIDTH = 8;
+
+    /** Constructor. */
+    SphereSet();
+
+    /** Add a sphere, with the index of its color and material. Returns false if the set is already full. */
+    bool add(Vec3 const & centre, double radius, uint32_t material);
+
+    /** Get the number of spheres in the set. */
+    int size() const { return count_; }
+
+    bool intersect(Ray & ray) const;
+    bool intersect(Rayf const & ray, Hitf & hit) const;
+    Vec3 calculateNormal(Vec3 const & position, uint32_t element = 0) const;
+    void getBounds(Vec3 & lo, Vec3 & hi) const;
+    size_t memoryUsage() const { return sizeof(SphereSet); }
+    uint32_t getMaterialIndex(uint32_t element = 0) const { return material_[element]; }
+
+  private:
+    /** Find the nearest sphere hit by the ray at a time in (0, t], setting t and element if there is one. */
+    bool findNearest(Vec3 const & org, Vec3 const & dir, double & t, uint32_t & element) const;
+
+    // Unused slots have a negative squared radius, which no ray hits
+    double cx_[WIDTH], cy_[WIDTH], cz_[WIDTH], r2_[WIDTH];
+    uint32_t material_[WIDTH];
+    int count_;
 };
 
 //=============================================================================================================================
@@ -85,10 +207,14 @@ class Triangle : public Primitive
 {
   public:
     /** Constructor. */
-    Triangle(Vec3 const & v0, Vec3 const & v1, Vec3 const & v2, RGB const & c, Material const & m, Mat4 const & modelToWorld);
+    Triangle(Vec3 const & v0, Vec3 const & v1, Vec3 const & v2, uint32_t material, Mat4 const & modelToWorld);
 
     bool intersect(Ray & ray) const;
-    Vec3 calculateNormal(Vec3 const & position) const;
+    bool intersect(Rayf const & ray, Hitf & hit) const;
+    Vec3 calculateNormal(Vec3 const & position, uint32_t element = 0) const;
+    void getBounds(Vec3 & lo, Vec3 & hi) const;
+    bool getWorldTriangle(Vec3 & w0, Vec3 & w1, Vec3 & w2) const;
+    size_t memoryUsage() const { return sizeof(Triangle); }
     void findCommon(Triangle* tri); /* find common vertices with triangle; update vertex normals accordingly */
 
     Vec3 getvert1(); /* get vertex 0 */
@@ -102,11 +228,92 @@ class Triangle : public Primitive
     void addVertNorm3(Vec3 x); /* add vector to normal at vertex 2 */
     void computeVertexNormal(); /* normalise vertex normals */
 
+    /**
+     * Get the vertex normals transformed to world space, in the order of getWorldTriangle(). They are not normalised, so that
+     * interpolating them and normalising the result gives the normal calculateNormal() does.
+     */
+    void getWorldVertexNormals(Vec3 & n0, Vec3 & n1, Vec3 & n2) const;
+
   private:
     Vec3 verts[3];
     double area_;
     Vec3 surfaceNormal;
     Vec3 vertexNormal[3];
+
+    // World-space copy of the triangle in single precision, as a vertex and the two edges leaving it, for intersection tests
+    Vec3f world_v0_;
+    Vec3f world_e1_;
+    Vec3f world_e2_;
+};
+
+/**
+ * The triangles of a mesh, given directly in world space, stored compactly: each distinct vertex once, with its position and
+ * normal in single precision, and each triangle as the indices of its three vertices and of its color and material. Elements
+ * are the triangles, in the order they were added. Spatial indices gather triangles into one of these so the scene need not
+ * keep a Triangle, with its transforms, for each; intersect() tests every triangle, so is only meant for small sets.
+ */
+class TriangleSet : public Primitive
+{
+  public:
+    /** Constructor. */
+    TriangleSet();
+
+    /** Add a vertex, with the normal to interpolate there, and return its index. */
+    uint32_t addVertex(Vec3f const & position, Vec3f const & normal);
+
+    /** Add a triangle with the given vertices, in counter-clockwise order, and color and material index. */
+    void addTriangle(uint32_t v0, uint32_t v1, uint32_t v2, uint32_t material);
+
+    /** Get the number of triangles. */
+    uint32_t size() const { return (uint32_t)materials_.size(); }
+
+    /** Get the position of a vertex. */
+    Vec3f const & getVertex(uint32_t index) const { return positions_[index]; }
+
+    /** Get the indices of the three vertices of a triangle. */
+    uint32_t const * getCorners(uint32_t element) const { return &corners_[3 * element]; }
+
+    bool intersect(Ray & ray) const;
+    bool intersect(Rayf const & ray, Hitf & hit) const;
+    bool intersectElement(Rayf const & ray, Hitf & hit, uint32_t element) const;
+    Vec3 calculateNormal(Vec3 const & position, uint32_t element = 0) const;
+    void getBounds(Vec3 & lo, Vec3 & hi) const;
+    size_t memoryUsage() const;
+    uint32_t getMaterialIndex(uint32_t element = 0) const { return materials_[element]; }
+
+  private:
+    std::vector<Vec3f> positions_;
+    std::vector<Vec3f> normals_;
+    std::vector<uint32_t> corners_;    // three vertices per triangle
+    std::vector<uint32_t> materials_;  // one per triangle
 };
 
+/**
+ * Moller-Trumbore test of a ray against the triangle with vertex \a v0 and edges \a e1, \a e2 leaving it, in single precision.
+ * Only rays arriving against the normal e1 x e2 hit. If the ray hits at a positive time no greater than \a t, sets \a t and
+ * returns true.
+ */
+inline bool
+intersectTriangle(Rayf const & ray, Vec3f const & v0, Vec3f const & e1, Vec3f const & e2, float & t)
+{
+  Vec3f pvec = ray.dir ^ e2;
+  float det = e1 * pvec;
+  if(det <= 0){ return false; } // back-facing or grazing
+
+  float inv_det = 1.0f / det;
+  Vec3f tvec = ray.org - v0;
+  float u = (tvec * pvec) * inv_det;
+  if(u < 0 || u > 1){ return false; }
+
+  Vec3f qvec = tvec ^ e1;
+  float v = (ray.dir * qvec) * inv_det;
+  if(v < 0 || u + v > 1){ return false; }
+
+  float hit_t = (e2 * qvec) * inv_det;
+  if(hit_t <= 0 || hit_t > t){ return false; }
+
+  t = hit_t;
+  return true;
+}
+
 #endif  // __Primitive_hpp__
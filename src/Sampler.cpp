@@ -0,0 +1,437 @@
+/*
+ * Sampler.cpp
+ *
+ * Sample generators for the pixel and light dimensions of the renderer.
+ */
+
+#include "Sampler.hpp"
+
+namespace {
+
+double const ONE_MINUS_EPSILON = 0.99999999999999989;
+
+double
+toUnit(uint32_t x)
+{
+  return x * (1.0 / 4294967296.0);
+}
+
+uint32_t
+reverseBits(uint32_t x)
+{
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+// Pseudo-random permutation of [0, l) selected by p, from Kensler, "Correlated Multi-Jittered Sampling" (2013).
+uint32_t
+permute(uint32_t i, uint32_t l, uint32_t p)
+{
+  uint32_t w = l - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+
+  do
+  {
+    i ^= p; i *= 0xe170893du;
+    i ^= p >> 16;
+    i ^= (i & w) >> 4;
+    i ^= p >> 8; i *= 0x0929eb3fu;
+    i ^= p >> 23;
+    i ^= (i & w) >> 1; i *= 1 | p >> 27;
+    i *= 0x6935fa69u;
+    i ^= (i & w) >> 11; i *= 0x74dcb303u;
+    i ^= (i & w) >> 2; i *= 0x9e501cc3u;
+    i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= l);
+
+  return (i + p) % l;
+}
+
+// Base-2 nested uniform (Owen) scramble of a bit-reversed value, from Burley (2020).
+uint32_t
+nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+  x = reverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverseBits(x);
+}
+
+// Second Sobol dimension. The first is the bit-reversed index.
+uint32_t
+sobolDim1(uint32_t index)
+{
+  uint32_t x = 0;
+  uint32_t v = 0x80000000u;
+  for ( ; index != 0; index >>= 1, v ^= v >> 1)
+  {
+    if (index & 1)
+      x ^= v;
+  }
+  return x;
+}
+
+uint32_t const PRIMES[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+                            59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131 };
+uint32_t const NUM_PRIMES = sizeof(PRIMES) / sizeof(PRIMES[0]);
+
+int const MASK_SIZE = 64;
+int const MASK_CELLS = MASK_SIZE * MASK_SIZE;
+
+int
+findExtremeEnergy(std::vector<double> const & energy, std::vector<bool> const & on, bool want_on, bool want_max)
+{
+  int best = -1;
+  for (int i = 0; i < MASK_CELLS; ++i)
+  {
+    if (on[i] != want_on)
+      continue;
+
+    if (best < 0 || (want_max ? energy[i] > energy[best] : energy[i] < energy[best]))
+      best = i;
+  }
+  return best;
+}
+
+void
+splatEnergy(std::vector<double> & energy, std::vector<double> const & kernel, int cell, double sign)
+{
+  int cx = cell % MASK_SIZE, cy = cell / MASK_SIZE;
+  for (int y = 0; y < MASK_SIZE; ++y)
+  {
+    double const * row = &kernel[((y - cy + MASK_SIZE) % MASK_SIZE) * MASK_SIZE];
+    double * out = &energy[y * MASK_SIZE];
+    for (int x = 0; x < MASK_SIZE; ++x)
+      out[x] += sign * row[(x - cx + MASK_SIZE) % MASK_SIZE];
+  }
+}
+
+// Ranks every cell of a toroidal 64x64 mask with Ulichney's void-and-cluster method, so that thresholding the ranks at any
+// level gives a blue noise point set. Deterministic, and built once on first use.
+std::vector<uint16_t>
+buildBlueNoiseMask()
+{
+  double const sigma = 1.5;
+  std::vector<double> kernel(MASK_CELLS);
+  for (int y = 0; y < MASK_SIZE; ++y)
+  {
+    for (int x = 0; x < MASK_SIZE; ++x)
+    {
+      int dx = std::min(x, MASK_SIZE - x), dy = std::min(y, MASK_SIZE - y);
+      kernel[y * MASK_SIZE + x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+    }
+  }
+
+  // Initial pattern: 10% of the cells, chosen by hash, then relaxed by moving the tightest cluster into the largest void
+  std::vector<bool> on(MASK_CELLS, false);
+  std::vector<double> energy(MASK_CELLS, 0.0);
+  int num_on = 0;
+  for (uint32_t i = 0; num_on < MASK_CELLS / 10; ++i)
+  {
+    int cell = (int)(Sampler::hash(i) % MASK_CELLS);
+    if (!on[cell])
+    {
+      on[cell] = true;
+      splatEnergy(energy, kernel, cell, 1);
+      ++num_on;
+    }
+  }
+
+  for (int iter = 0; iter < MASK_CELLS; ++iter)
+  {
+    int cluster = findExtremeEnergy(energy, on, true, true);
+    on[cluster] = false;
+    splatEnergy(energy, kernel, cluster, -1);
+
+    int avoid = findExtremeEnergy(energy, on, false, false);
+    on[avoid] = true;
+    splatEnergy(energy, kernel, avoid, 1);
+
+    if (avoid == cluster)
+      break;
+  }
+
+  std::vector<uint16_t> rank(MASK_CELLS);
+  std::vector<bool> prototype(on);
+  std::vector<double> prototype_energy(energy);
+
+  // Rank the initial points by repeatedly removing the tightest cluster
+  for (int r = num_on - 1; r >= 0; --r)
+  {
+    int cluster = findExtremeEnergy(energy, on, true, true);
+    on[cluster] = false;
+    splatEnergy(energy, kernel, cluster, -1);
+    rank[cluster] = (uint16_t)r;
+  }
+
+  // Rank the rest by repeatedly filling the largest void
+  on = prototype;
+  energy = prototype_energy;
+  for (int r = num_on; r < MASK_CELLS; ++r)
+  {
+    int avoid = findExtremeEnergy(energy, on, false, false);
+    on[avoid] = true;
+    splatEnergy(energy, kernel, avoid, 1);
+    rank[avoid] = (uint16_t)r;
+  }
+
+  return rank;
+}
+
+std::vector<uint16_t> const &
+blueNoiseMask()
+{
+  static std::vector<uint16_t> const mask = buildBlueNoiseMask();
+  return mask;
+}
+
+} // namespace
+
+//=============================================================================================================================
+// Sampler
+//=============================================================================================================================
+
+Sampler::Sampler(uint32_t seed, int samples_per_pixel)
+: seed_(hash(seed)), samples_per_pixel_(std::max(samples_per_pixel, 1)), pixel_x_(0), pixel_y_(0), pixel_(0), sample_(0),
+  dimension_(0)
+{
+}
+
+Sampler::~Sampler()
+{
+}
+
+Sampler *
+Sampler::create(std::string const & name, uint32_t seed, int samples_per_pixel)
+{
+  if (name == "random")
+    return new RandomSampler(seed, samples_per_pixel);
+  else if (name == "stratified")
+    return new StratifiedSampler(seed, samples_per_pixel);
+  else if (name == "halton")
+    return new HaltonSampler(seed, samples_per_pixel);
+  else if (name == "sobol")
+    return new SobolSampler(seed, samples_per_pixel);
+  else if (name == "bluenoise")
+    return new BlueNoiseSampler(seed, samples_per_pixel);
+
+  return NULL;
+}
+
+void
+Sampler::startPixelSample(int pixel_x, int pixel_y, int sample_index)
+{
+  // Pixels are keyed by coordinates rather than a running index so the sequence does not depend on the image traversal.
+  pixel_x_ = pixel_x;
+  pixel_y_ = pixel_y;
+  pixel_ = hash((uint32_t)pixel_x + hash((uint32_t)pixel_y));
+  sample_ = (uint32_t)sample_index;
+  dimension_ = 0;
+}
+
+void
+Sampler::sample2D(uint32_t dim, double & u, double & v) const
+{
+  u = sample1D(dim);
+  v = sample1D(dim + 1);
+}
+
+//=============================================================================================================================
+// RandomSampler
+//=============================================================================================================================
+
+RandomSampler::RandomSampler(uint32_t seed, int samples_per_pixel)
+: Sampler(seed, samples_per_pixel)
+{
+}
+
+Sampler *
+RandomSampler::clone() const
+{
+  return new RandomSampler(*this);
+}
+
+double
+RandomSampler::sample1D(uint32_t dim) const
+{
+  return randomValue(dim);
+}
+
+//=============================================================================================================================
+// StratifiedSampler
+//=============================================================================================================================
+
+StratifiedSampler::StratifiedSampler(uint32_t seed, int samples_per_pixel)
+: Sampler(seed, samples_per_pixel)
+{
+  grid_ = (int)std::floor(std::sqrt((double)samples_per_pixel_) + 0.5);
+}
+
+Sampler *
+StratifiedSampler::clone() const
+{
+  return new StratifiedSampler(*this);
+}
+
+double
+StratifiedSampler::sample1D(uint32_t dim) const
+{
+  uint32_t n = (uint32_t)samples_per_pixel_;
+  uint32_t stratum = permute(sample_ % n, n, pixelHash(dim));
+  return std::min((stratum + randomValue(dim)) / n, ONE_MINUS_EPSILON);
+}
+
+void
+StratifiedSampler::sample2D(uint32_t dim, double & u, double & v) const
+{
+  if (grid_ * grid_ != samples_per_pixel_)
+  {
+    // Latin hypercube: each axis stratified on its own
+    Sampler::sample2D(dim, u, v);
+    return;
+  }
+
+  uint32_t n = (uint32_t)samples_per_pixel_;
+  uint32_t stratum = permute(sample_ % n, n, pixelHash(dim));
+  u = std::min((stratum % grid_ + randomValue(dim)) / grid_, ONE_MINUS_EPSILON);
+  v = std::min((stratum / grid_ + randomValue(dim + 1)) / grid_, ONE_MINUS_EPSILON);
+}
+
+//=============================================================================================================================
+// HaltonSampler
+//=============================================================================================================================
+
+HaltonSampler::HaltonSampler(uint32_t seed, int samples_per_pixel)
+: Sampler(seed, samples_per_pixel)
+{
+}
+
+Sampler *
+HaltonSampler::clone() const
+{
+  return new HaltonSampler(*this);
+}
+
+double
+HaltonSampler::sample1D(uint32_t dim) const
+{
+  if (dim >= NUM_PRIMES)
+    return randomValue(dim);
+
+  // Radical inverse with each digit permuted by a hash of the digits before it (Owen scrambling). Once the index runs out of
+  // digits, the remaining infinitely many scrambled zero digits amount to a uniform offset within the last interval.
+  uint32_t const base = PRIMES[dim];
+  uint32_t const scramble = pixelHash(dim);
+  uint32_t index = sample_;
+  uint32_t limit = (uint32_t)samples_per_pixel_ - 1;  // every index gets as many digits as the largest one
+  uint32_t prefix = 0;
+  double inv_base_k = 1.0 / base;
+  double value = 0;
+
+  for (int k = 0; index != 0 || limit != 0; ++k)
+  {
+    uint32_t digit = index % base;
+    index /= base;
+    limit /= base;
+    value += permute(digit, base, hash(scramble + hash(prefix + (uint32_t)k))) * inv_base_k;
+    prefix = prefix * base + digit;
+    inv_base_k /= base;
+  }
+
+  value += randomValue(dim) * inv_base_k * base;
+  return std::min(value, ONE_MINUS_EPSILON);
+}
+
+//=============================================================================================================================
+// SobolSampler
+//=============================================================================================================================
+
+SobolSampler::SobolSampler(uint32_t seed, int samples_per_pixel)
+: Sampler(seed, samples_per_pixel)
+{
+}
+
+Sampler *
+SobolSampler::clone() const
+{
+  return new SobolSampler(*this);
+}
+
+void
+SobolSampler::sobol2D(uint32_t index, uint32_t seed, double & u, double & v)
+{
+  index = nestedUniformScramble(index, seed);
+  u = toUnit(nestedUniformScramble(reverseBits(index), hash(seed)));
+  v = toUnit(nestedUniformScramble(sobolDim1(index), hash(seed + 1)));
+}
+
+double
+SobolSampler::sample1D(uint32_t dim) const
+{
+  uint32_t seed = pixelHash(dim);
+  uint32_t index = nestedUniformScramble(sample_, seed);
+  return toUnit(nestedUniformScramble(reverseBits(index), hash(seed)));
+}
+
+void
+SobolSampler::sample2D(uint32_t dim, double & u, double & v) const
+{
+  sobol2D(sample_, pixelHash(dim), u, v);
+}
+
+//=============================================================================================================================
+// BlueNoiseSampler
+//=============================================================================================================================
+
+BlueNoiseSampler::BlueNoiseSampler(uint32_t seed, int samples_per_pixel)
+: SobolSampler(seed, samples_per_pixel)
+{
+  blueNoiseMask();  // build the mask here rather than inside the render threads
+}
+
+Sampler *
+BlueNoiseSampler::clone() const
+{
+  return new BlueNoiseSampler(*this);
+}
+
+double
+BlueNoiseSampler::maskValue(uint32_t dim) const
+{
+  uint32_t offset = hash(seed_ + dim);
+  int x = (pixel_x_ + (int)(offset & (MASK_SIZE - 1))) & (MASK_SIZE - 1);
+  int y = (pixel_y_ + (int)((offset >> 8) & (MASK_SIZE - 1))) & (MASK_SIZE - 1);
+  return (blueNoiseMask()[y * MASK_SIZE + x] + 0.5) / MASK_CELLS;
+}
+
+double
+BlueNoiseSampler::sample1D(uint32_t dim) const
+{
+  // Same scramble in every pixel, so neighbouring pixels differ only by their blue noise shift
+  uint32_t seed = hash(seed_ + hash(dim));
+  uint32_t index = nestedUniformScramble(sample_, seed);
+  double u = toUnit(nestedUniformScramble(reverseBits(index), hash(seed))) + maskValue(dim);
+  return u >= 1 ? u - 1 : u;
+}
+
+void
+BlueNoiseSampler::sample2D(uint32_t dim, double & u, double & v) const
+{
+  sobol2D(sample_, hash(seed_ + hash(dim)), u, v);
+  u += maskValue(dim);
+  v += maskValue(dim + 1);
+  if (u >= 1) u -= 1;
+  if (v >= 1) v -= 1;
+}
@@ -0,0 +1,185 @@
+/*
+ * Sampler.hpp
+ *
+ * Sample generators for the pixel and light dimensions of the renderer.
+ */
+
+#ifndef __Sampler_hpp__
+#define __Sampler_hpp__
+
+#include "Globals.hpp"
+#include <stdint.h>
+
+/**
+ * Interface for generating the sample values consumed while tracing one camera ray. Every value is a pure function of (seed,
+ * pixel, sample index, dimension), where the dimension is a counter advanced by each draw. Nothing is shared between samplers,
+ * so each render thread owns a clone() and images are bit-reproducible regardless of thread count or the order in which pixels
+ * are rendered. Saving dimension() and restoring it with setDimension() replays the same values.
+ *
+ * The first two dimensions of every camera ray are the position within the pixel; later dimensions are consumed by lights in
+ * shading order.
+ */
+class Sampler
+{
+  public:
+    /** Destructor. */
+    virtual ~Sampler();
+
+    /**
+     * Create a sampler by name: "random", "stratified", "halton", "sobol" or "bluenoise". \a samples_per_pixel is the number of
+     * sample indices that will be requested per pixel, which the stratified patterns are built for. Returns NULL for an unknown
+     * name.
+     */
+    static Sampler * create(std::string const & name, uint32_t seed, int samples_per_pixel);
+
+    /** Get a copy of this sampler, for use by another thread. */
+    virtual Sampler * clone() const = 0;
+
+    /** Start the sequence for the \a sample_index 'th ray through pixel (\a pixel_x, \a pixel_y). */
+    void startPixelSample(int pixel_x, int pixel_y, int sample_index);
+
+    /** Get the next value in [0, 1). */
+    double get1D() { return sample1D(dimension_++); }
+
+    /** Get the next two values in [0, 1), as a well-distributed 2D point. */
+    void get2D(double & u, double & v) { sample2D(dimension_, u, v); dimension_ += 2; }
+
+    /** Get the index of the next dimension to be drawn. */
+    uint32_t dimension() const { return dimension_; }
+
+    /** Rewind or skip to a given dimension. */
+    void setDimension(uint32_t d) { dimension_ = d; }
+
+    /** Hash function from the PCG family, used to build all the counter-based generators. */
+    static uint32_t hash(uint32_t v);
+
+  protected:
+    /** Constructor. */
+    Sampler(uint32_t seed, int samples_per_pixel);
+
+    /** Get the value of dimension \a dim for the current pixel sample. */
+    virtual double sample1D(uint32_t dim) const = 0;
+
+    /** Get the values of dimensions \a dim and \a dim + 1 for the current pixel sample. Defaults to two 1D draws. */
+    virtual void sample2D(uint32_t dim, double & u, double & v) const;
+
+    /** Get an independent uniform random number for dimension \a dim of the current pixel sample. */
+    double randomValue(uint32_t dim) const;
+
+    /** Get a hash of the current pixel and \a dim, that is the same for every sample index in the pixel. */
+    uint32_t pixelHash(uint32_t dim) const;
+
+    uint32_t seed_;
+    int samples_per_pixel_;
+    int pixel_x_;
+    int pixel_y_;
+    uint32_t pixel_;
+    uint32_t sample_;
+
+  private:
+    uint32_t dimension_;
+};
+
+/** Independent uniform random numbers for every dimension. */
+class RandomSampler : public Sampler
+{
+  public:
+    RandomSampler(uint32_t seed, int samples_per_pixel);
+    Sampler * clone() const;
+
+  protected:
+    double sample1D(uint32_t dim) const;
+};
+
+/**
+ * Jittered stratification of the samples in a pixel, independently for every dimension: 1D dimensions are split into
+ * samples_per_pixel strata and 2D dimensions into a grid (or a Latin hypercube if the count is not square). Each dimension
+ * visits its strata in a different pseudo-random order, so dimensions stay uncorrelated.
+ */
+class StratifiedSampler : public Sampler
+{
+  public:
+    StratifiedSampler(uint32_t seed, int samples_per_pixel);
+    Sampler * clone() const;
+
+  protected:
+    double sample1D(uint32_t dim) const;
+    void sample2D(uint32_t dim, double & u, double & v) const;
+
+  private:
+    int grid_;
+};
+
+/**
+ * Owen-scrambled Halton sequence over the samples in a pixel, with a distinct prime base per dimension. Dimensions beyond the
+ * built-in prime table fall back to random values.
+ */
+class HaltonSampler : public Sampler
+{
+  public:
+    HaltonSampler(uint32_t seed, int samples_per_pixel);
+    Sampler * clone() const;
+
+  protected:
+    double sample1D(uint32_t dim) const;
+};
+
+/**
+ * Owen-scrambled Sobol (0,2)-sequence, padded across dimension pairs by shuffling the sample index independently per pair, as
+ * in Burley, "Practical Hash-based Owen Scrambling" (2020). Each pixel gets its own scramble.
+ */
+class SobolSampler : public Sampler
+{
+  public:
+    SobolSampler(uint32_t seed, int samples_per_pixel);
+    Sampler * clone() const;
+
+  protected:
+    double sample1D(uint32_t dim) const;
+    void sample2D(uint32_t dim, double & u, double & v) const;
+
+    /** Get the scrambled, shuffled Sobol point \a index for the pair seeded with \a seed. */
+    static void sobol2D(uint32_t index, uint32_t seed, double & u, double & v);
+};
+
+/**
+ * The same Sobol points in every pixel, toroidally shifted per pixel by a 64x64 void-and-cluster blue noise mask, so the
+ * remaining error is distributed as blue noise in screen space (Georgiev and Fajardo, "Blue-noise dithered sampling", 2016).
+ */
+class BlueNoiseSampler : public SobolSampler
+{
+  public:
+    BlueNoiseSampler(uint32_t seed, int samples_per_pixel);
+    Sampler * clone() const;
+
+  protected:
+    double sample1D(uint32_t dim) const;
+    void sample2D(uint32_t dim, double & u, double & v) const;
+
+  private:
+    /** Get the mask value in [0, 1) at the current pixel, with the mask offset per dimension. */
+    double maskValue(uint32_t dim) const;
+};
+
+inline uint32_t
+Sampler::hash(uint32_t v)
+{
+  uint32_t state = v * 747796405u + 2891336453u;
+  uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+inline double
+Sampler::randomValue(uint32_t dim) const
+{
+  uint32_t h = hash(seed_ + hash(pixel_ + hash(sample_ + hash(dim))));
+  return h * (1.0 / 4294967296.0);
+}
+
+inline uint32_t
+Sampler::pixelHash(uint32_t dim) const
+{
+  return hash(seed_ + hash(pixel_ + hash(dim)));
+}
+
+#endif  // __Sampler_hpp__
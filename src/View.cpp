@@ -28,14 +28,12 @@ View::~View()
 }
 
 void
-View::getSample(int pixel_x, int pixel_y, int ray_index, Sample & s) const
+View::getSample(int pixel_x, int pixel_y, int ray_index, Sample & s, Sampler & sampler) const
 {
-  // Some random jitter to break up patterns
-  double jitter_x = 0.25 * (std::rand() / (double)RAND_MAX);
-  double jitter_y = 0.25 * (std::rand() / (double)RAND_MAX);
-
-  double pixel_sub_x = (ray_index % rays_per_pixel_edge_ + 0.5 + jitter_x) / (double)rays_per_pixel_edge_;
-  double pixel_sub_y = (ray_index / rays_per_pixel_edge_ + 0.5 + jitter_y) / (double)rays_per_pixel_edge_;
+  // The sampler places the ray_index 'th point within the pixel. For the stratified and low-discrepancy samplers the points of
+  // one pixel cover its area evenly, so ray_index only selects the point in the sequence.
+  double pixel_sub_x, pixel_sub_y;
+  sampler.get2D(pixel_sub_x, pixel_sub_y);
 
   s.setX((pixel_x + pixel_sub_x) / (double)pixels_wide_);
   s.setY((pixel_y + pixel_sub_y) / (double)pixels_high_);
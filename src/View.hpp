@@ -10,6 +10,7 @@
 #define __View_hpp__
 
 #include "Globals.hpp"
+#include "Sampler.hpp"
 
 /** View holds all the information about our camera. This includes how to sample across the viewport. */
 class View
@@ -42,8 +43,9 @@ class View
      * @param pixel_y The y coordinate (row) of the pixel.
      * @param ray_index The index of the ray through the pixel, in the range [0, raysPerPixel() - 1].
      * @param s Used to return the sampled point.
+     * @param sampler Supplies the position within the pixel, and must have been started for this pixel and ray index.
      */
-    void getSample(int pixel_x, int pixel_y, int ray_index, Sample & s) const;
+    void getSample(int pixel_x, int pixel_y, int ray_index, Sample & s, Sampler & sampler) const;
 
     /** Get the world-space point corresponding to a given sample. */
     Vec3 getSamplePosition(Sample const & s) const;
@@ -7,30 +7,178 @@
  */
 
 #include "World.hpp"
+#include <algorithm>
+
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
+namespace {
+
+int
+getMaxThreads()
+{
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+int
+getThreadNum()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// Spread the low 21 bits of v so there are two zero bits between each, for interleaving three coordinates into a Morton code.
+uint64_t
+spreadBits21(uint64_t v)
+{
+  v &= 0x1fffff;
+  v = (v | (v << 32)) & 0x1f00000000ffffull;
+  v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+  v = (v | (v << 8))  & 0x100f00f00f00f00full;
+  v = (v | (v << 4))  & 0x10c30c30c30c30c3ull;
+  v = (v | (v << 2))  & 0x1249249249249249ull;
+  return v;
+}
+
+} // namespace
 
 World::World()
+: accelerator_(NULL), accelerator_name_("none"), triangle_set_(NULL), extra_rays_(0)
 {
+  RayCount zero = RayCount();
+  ray_counts_.assign((size_t)getMaxThreads(), zero);
 }
 
 World::~World()
 {
-  // Auto-generated destructor stub
+  delete accelerator_;
+  delete triangle_set_;
 }
 
 Primitive *
 World::intersect(Ray & r) const
 {
-  Primitive* nearest = NULL;
+  uint32_t element;
+  return intersect(r, element);
+}
+
+Primitive *
+World::intersect(Ray & r, uint32_t & element) const
+{
+  countRays(1);
+
+  Rayf ray(r);
+  Hitf hit(ray);
+  if(accelerator_ != NULL)
+    accelerator_->intersect(ray, hit);
+  else{
+    for(size_t i = 0; i < primitives_.size(); ++i){
+      if(primitives_[i]->intersect(ray, hit))
+        hit.prim = (uint32_t)i;
+    }
+  }
+
+  if(hit.prim == Hitf::NONE)
+    return NULL;
+
+  r.setMinT(hit.t);
+  element = hit.element;
+  return primitives_[hit.prim];
+}
+
+void
+World::intersect(Rayf const * rays, Hitf * hits, int n) const
+{
+  countRays((unsigned long)n);
+
+  for (int j = 0; j < n; ++j)
+    hits[j] = Hitf(rays[j]);
+
+  if (accelerator_ != NULL)
+  {
+    accelerator_->intersectBatch(rays, hits, n);
+    return;
+  }
+
+  for(size_t i = 0; i < primitives_.size(); ++i){
+    Primitive const * p = primitives_[i];
+    for (int j = 0; j < n; ++j){
+      if(p->intersect(rays[j], hits[j]))
+        hits[j].prim = (uint32_t)i;
+    }
+  }
+}
+
+bool
+World::occluded(Ray const & r, Occluder * hint) const
+{
+  countRays(1);
+
+  Rayf ray(r);
+  Hitf hit(ray);
+  if (hint != NULL && hint->prim != NULL)
+  {
+    if (hint->prim->intersectElement(ray, hit, hint->element))
+      return true;
+  }
+
+  if (accelerator_ != NULL)
+  {
+    uint32_t blocker, element;
+    if (!accelerator_->occluded(ray, blocker, element))
+      return false;
+
+    if (hint != NULL)
+    {
+      hint->prim = primitives_[blocker];
+      hint->element = element;
+    }
+    return true;
+  }
 
   for(PrimitiveConstIterator i = primitivesBegin(); i != primitivesEnd(); ++i){
-    Ray copy(r);
-  	if(((*i)->intersect)(copy)){
-      r.setMinT(copy.minT());
-      nearest = (*i);
+    if(((*i)->intersect)(ray, hit)){
+      if (hint != NULL)
+      {
+        hint->prim = *i;
+        hint->element = hit.element;
+      }
+      return true;
     }
   }
 
-  return nearest;
+  return false;
+}
+
+void
+World::occluded(Rayf const * rays, Hitf * hits, int n) const
+{
+  countRays((unsigned long)n);
+
+  for (int j = 0; j < n; ++j)
+    hits[j] = Hitf(rays[j]);
+
+  if (accelerator_ != NULL)
+  {
+    accelerator_->occludedBatch(rays, hits, n);
+    return;
+  }
+
+  for(size_t i = 0; i < primitives_.size(); ++i){
+    Primitive const * p = primitives_[i];
+    for (int j = 0; j < n; ++j){
+      if(hits[j].prim == Hitf::NONE && p->intersect(rays[j], hits[j]))
+        hits[j].prim = (uint32_t)i;
+    }
+  }
 }
 
 void
@@ -39,12 +187,120 @@ World::addPrimitive(Primitive * p)
   primitives_.push_back(p);
 }
 
+void
+World::addSphere(Vec3 const & centre, double radius, uint32_t material)
+{
+  PendingSphere s;
+  s.centre = centre;
+  s.radius = radius;
+  s.material = material;
+  s.key = 0;
+  pending_spheres_.push_back(s);
+}
+
+void
+World::buildSphereSets()
+{
+  if (pending_spheres_.empty())
+    return;
+
+  // order the spheres along a Morton curve, so each set holds spheres close to each other
+  Vec3 lo = pending_spheres_[0].centre, hi = lo;
+  for (size_t i = 1; i < pending_spheres_.size(); ++i)
+  {
+    for (int a = 0; a < 3; ++a)
+    {
+      lo[a] = std::min(lo[a], pending_spheres_[i].centre[a]);
+      hi[a] = std::max(hi[a], pending_spheres_[i].centre[a]);
+    }
+  }
+
+  for (size_t i = 0; i < pending_spheres_.size(); ++i)
+  {
+    PendingSphere & s = pending_spheres_[i];
+    s.key = 0;
+    for (int a = 0; a < 3; ++a)
+    {
+      double extent = hi[a] - lo[a];
+      uint64_t q = extent > 0 ? (uint64_t)std::min((s.centre[a] - lo[a]) / extent * 2097152.0, 2097151.0) : 0;
+      s.key |= spreadBits21(q) << (2 - a);
+    }
+  }
+
+  std::stable_sort(pending_spheres_.begin(), pending_spheres_.end());
+
+  SphereSet * set = NULL;
+  for (size_t i = 0; i < pending_spheres_.size(); ++i)
+  {
+    PendingSphere const & s = pending_spheres_[i];
+    if (set == NULL || !set->add(s.centre, s.radius, s.material))
+    {
+      set = new SphereSet();
+      set->add(s.centre, s.radius, s.material);
+      addPrimitive(set);
+    }
+  }
+
+  pending_spheres_.clear();
+}
+
+bool
+World::buildAccelerator(std::string const & name, double split_budget)
+{
+  Accelerator * accelerator = NULL;
+  if (name != "none")
+  {
+    accelerator = Accelerator::create(name, split_budget);
+    if (accelerator == NULL)
+      return false;
+
+    accelerator->build(primitives_);
+
+    // the index now keeps the triangles, so the Triangle primitives, with their transforms and model-space copies, can go
+    TriangleSet * set = accelerator->releaseTriangles();
+    if (set != NULL)
+    {
+      std::vector<Primitive *> others;
+      for (size_t i = 0; i < primitives_.size(); ++i)
+      {
+        if (dynamic_cast<Triangle *>(primitives_[i]) != NULL)
+          delete primitives_[i];
+        else
+          others.push_back(primitives_[i]);
+      }
+      others.push_back(set);
+      primitives_.swap(others);
+      std::vector<Triangle *>().swap(triangles);
+      triangle_set_ = set;
+    }
+  }
+
+  delete accelerator_;
+  accelerator_ = accelerator;
+  accelerator_name_ = name;
+  return true;
+}
+
 void
 World::addLight(Light * l)
 {
   lights_.push_back(l);
 }
 
+void
+World::buildLightTree()
+{
+  light_tree_.build(lights_.begin(), lights_.end());
+
+  unbounded_lights_.clear();
+  for (LightConstIterator i = lightsBegin(); i != lightsEnd(); ++i)
+  {
+    Vec3 lo, hi;
+    if (!(*i)->getBounds(lo, hi))
+      unbounded_lights_.push_back(*i);
+  }
+}
+
 void
 World::setAmbientLightColor(RGB ambientColor)
 {
@@ -57,11 +313,48 @@ World::getAmbientLightColor() const
   return ambientLight_.getColor();
 }
 
+void
+World::countRays(unsigned long n) const
+{
+  // each thread counts into its own slot, so tracing rays never writes to memory shared between threads
+  size_t thread = (size_t)getThreadNum();
+  if (thread < ray_counts_.size())
+    ray_counts_[thread].n += n;
+  else
+  {
+#pragma omp atomic
+    extra_rays_ += n;
+  }
+}
+
+unsigned long
+World::numRaysTraced() const
+{
+  unsigned long total = extra_rays_;
+  for (size_t i = 0; i < ray_counts_.size(); ++i)
+    total += ray_counts_[i].n;
+
+  return total;
+}
+
 void
 World::printStats() const
 {
   std::cout << "World data:" << std::endl;
-  std::cout << " primitives: " << primitives_.size() << std::endl;
+  size_t primitive_bytes = primitives_.size() * sizeof(Primitive *);
+  for (size_t i = 0; i < primitives_.size(); ++i)
+    primitive_bytes += primitives_[i]->memoryUsage();
+
+  std::cout << " primitives: " << primitives_.size() << ", " << primitive_bytes / 1024 << " KB" << std::endl;
+  std::cout << " materials: " << materials_.size() << std::endl;
+  std::cout << " accelerator: " << accelerator_name_;
+  if (accelerator_ != NULL)
+  {
+    size_t index_bytes = accelerator_->memoryUsage();
+    std::cout << ", " << accelerator_->numNodes() << " nodes, " << index_bytes / 1024 << " KB, "
+              << (index_bytes + primitive_bytes) / 1024 << " KB with the primitives";
+  }
+  std::cout << std::endl;
   std::cout << " lights: " << lights_.size() << std::endl;
 }
 
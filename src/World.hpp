@@ -10,6 +10,8 @@
 #define __World_hpp__
 
 #include "Globals.hpp"
+#include "BVH.hpp"
+#include "LightTree.hpp"
 #include "Lights.hpp"
 #include "Primitives.hpp"
 
@@ -32,9 +34,62 @@ class World
      */
     Primitive * intersect(Ray & r) const;
 
+    /** As intersect(Ray &), also setting \a element to the element of the returned primitive that was hit. */
+    Primitive * intersect(Ray & r, uint32_t & element) const;
+
+    /**
+     * Find the nearest intersections of a batch of \a n compact rays with the world. hits[i] is set to the nearest hit along
+     * rays[i], with prim the index of the primitive hit (see getPrimitive()) or Hitf::NONE. Without an accelerator, each
+     * primitive is tested against the whole batch before moving on to the next, so it stays in cache; with one, the batch goes
+     * to Accelerator::intersectBatch(), which may trace runs of rays as packets. Either way, batches sorted so that neighbouring
+     * rays have similar origins and directions make the most of this.
+     */
+    void intersect(Rayf const * rays, Hitf * hits, int n) const;
+
+    /**
+     * Check a batch of \a n compact rays for any primitive hit before their t_max, as for shadow rays. hits[i].prim is set to the
+     * index of a primitive blocking rays[i], with hits[i].element the element of it that was hit, or to Hitf::NONE. Batches are
+     * traced as for intersect(Rayf const *, Hitf *, int).
+     */
+    void occluded(Rayf const * rays, Hitf * hits, int n) const;
+
+    /**
+     * Check whether any primitive hits the ray before r.minT(), as for a shadow ray. Stops at the first such primitive rather
+     * than finding the nearest. If \a hint names an element of a primitive, that element is tested first; on return, a
+     * non-NULL \a hint is set to the blocking element, if one was found.
+     */
+    bool occluded(Ray const & r, Occluder * hint = NULL) const;
+
     /** Add a primitive to the world. */
     void addPrimitive(Primitive * p);
 
+    /**
+     * Add a color and material to the world's table, returning their index for use by primitives. Adding the same pair again
+     * gives the same index.
+     */
+    uint32_t addMaterial(RGB const & c, Material const & m) { return materials_.add(c, m); }
+
+    /**
+     * Add a sphere given in world space, with the index of its color and material. Such spheres are not primitives of their
+     * own: buildSphereSets() packs them, nearby ones together, into SphereSet primitives.
+     */
+    void addSphere(Vec3 const & centre, double radius, uint32_t material);
+
+    /** Pack the spheres added with addSphere() into primitives. Call once all spheres have been added. */
+    void buildSphereSets();
+
+    /**
+     * Build a spatial index over the primitives added so far, by name as for Accelerator::create(), or "none" to test every
+     * primitive against every ray, with \a split_budget the fraction of extra primitive references spatial splits may add.
+     * Call once, after all primitives have been added. An index that keeps its own compact copy of the triangles (see
+     * Accelerator::releaseTriangles()) replaces the Triangle primitives, which are freed, with a single TriangleSet at the end
+     * of the list. Returns false for an unknown name.
+     */
+    bool buildAccelerator(std::string const & name, double split_budget = 0);
+
+    /** Get the table of colors and materials that primitives' material indices refer to. */
+    MaterialTable const & getMaterials() const { return materials_; }
+
     /** Add a light to the world. */
     void addLight(Light * l);
 
@@ -47,6 +102,9 @@ class World
     /** Get the number of primitives. */
     int numPrimitives() const { return (int)primitives_.size(); }
 
+    /** Get the primitive with a given index, as found in Hitf::prim. */
+    Primitive * getPrimitive(uint32_t index) const { return primitives_[index]; }
+
     /** Get an iterator pointing to the first primitive. */
     PrimitiveConstIterator primitivesBegin() const { return primitives_.begin(); }
 
@@ -62,6 +120,21 @@ class World
     /** Get an iterator pointing to the one position beyond the last light. */
     LightConstIterator lightsEnd() const { return lights_.end(); }
 
+    /** Build the light tree over the lights added so far. Call once all lights have been added. */
+    void buildLightTree();
+
+    /** Get the tree over the lights that have a position. Empty until buildLightTree() is called. */
+    LightTree const & getLightTree() const { return light_tree_; }
+
+    /** Get an iterator pointing to the first light that is not in the light tree. */
+    LightConstIterator unboundedLightsBegin() const { return unbounded_lights_.begin(); }
+
+    /** Get an iterator pointing to the one position beyond the last light that is not in the light tree. */
+    LightConstIterator unboundedLightsEnd() const { return unbounded_lights_.end(); }
+
+    /** Get the number of rays traced through the world so far, including shadow rays. */
+    unsigned long numRaysTraced() const;
+
     /** Print debugging stats. */
     void printStats() const;
 
@@ -72,11 +145,42 @@ class World
     void trianglesComputeVertexNormal();
 
   private:
+    /** A sphere waiting to be packed into a SphereSet. */
+    struct PendingSphere
+    {
+      Vec3 centre;
+      double radius;
+      uint32_t material;
+      uint64_t key;  // position along a Morton curve through the spheres' bounding box
+
+      bool operator<(PendingSphere const & other) const { return key < other.key; }
+    };
+
     std::vector<Primitive *> primitives_;
+    std::vector<PendingSphere> pending_spheres_;
+    MaterialTable materials_;
     /* this vector made specifically for bookkeeping of triangles sharing vertices */
     std::vector<Triangle *> triangles;
     std::vector<Light *> lights_;
+    std::vector<Light *> unbounded_lights_;
+    Accelerator * accelerator_;
+    std::string accelerator_name_;
+    TriangleSet * triangle_set_;  // the triangles, if the accelerator handed them over; owned by the world
+    LightTree light_tree_;
     AmbientLight ambientLight_;
+
+    /** Rays traced by one thread, padded so that the counts of different threads never share a cache line. */
+    struct RayCount
+    {
+      unsigned long n;
+      char padding[128 - sizeof(unsigned long)];
+    };
+
+    /** Add to the count of rays traced by the calling thread. */
+    void countRays(unsigned long n) const;
+
+    mutable std::vector<RayCount> ray_counts_;  // one per thread
+    mutable unsigned long extra_rays_;          // rays traced by threads beyond those counted in ray_counts_
 };
 
 #endif  // __World_hpp__
@@ -27,6 +27,11 @@
 //  -   Use standard C++ headers
 //  -   Formatting cleanup
 //
+//  Modified Oct 2026
+//  -   AVX versions of Mat4 . Vec4 and Mat4 . Mat4, selected when the
+//      compiler targets AVX (disable with ALGEBRA3_NO_SIMD)
+//  -   Affine3 transform type with closed-form inverse
+//
 #ifndef __Algebra3_hpp__
 #define __Algebra3_hpp__
 
@@ -36,6 +41,14 @@
 #include <cstdlib>
 #include <iostream>
 
+#if defined(__AVX__) && !defined(ALGEBRA3_NO_SIMD)
+#  define ALGEBRA3_AVX
+#  include <immintrin.h>
+#elif defined(__SSE2__) && !defined(ALGEBRA3_NO_SIMD)
+#  define ALGEBRA3_SSE2     // every x86-64 target has SSE2, so the portable build uses these two-lane kernels
+#  include <emmintrin.h>
+#endif
+
 // this line defines a new type: pointer to a function which returns
 // double and takes as argument a double
 typedef double (*ALG3_FCT_PTR)(double);
@@ -48,6 +61,7 @@ class Vec3;
 class Vec4;
 class Mat3;
 class Mat4;
+class Affine3;
 
 //
 //  PI
@@ -221,6 +235,7 @@ class Vec3
     friend class Vec2;
     friend class Vec4;
     friend class Mat3;
+    friend class Affine3;
     friend Vec2 operator * (Mat3 const & a, Vec2 const & v);  // homogenous linear transform
     friend Vec3 operator * (Mat3 const & a, Vec3 const & v);  //
     friend Mat3 operator * (Mat3 const & a, Mat3 const & b);  // matrix 3 product
@@ -305,6 +320,7 @@ class Vec4
 
     friend class Vec3;
     friend class Mat4;
+    friend class Affine3;
     friend Vec3 operator * (Mat4 const & a, Vec3 const & v);  // linear transform
     friend Mat4 operator * (Mat4 const & a, Mat4 const & b);  // matrix 4 product
 
@@ -433,12 +449,62 @@ class Mat4
 
     // necessary friend declarations
 
+    friend class Affine3;
     friend Vec4 operator * (Mat4 const & a, Vec4 const & v);      // linear transform
     friend Vec3 operator * (Mat4 const & a, Vec3 const & v);      // linear transform
 
 }; // class Mat4
 
 
+/****************************************************************
+*                                                               *
+*              Affine transform                                 *
+*                                                               *
+****************************************************************/
+
+// A 4x4 matrix whose bottom row is (0, 0, 0, 1), as used for every
+// object transform. Stored as its four columns, each padded to four
+// doubles, so that transforming a point is three multiply-adds of
+// whole columns. Skips the homogeneous row and divide, and inverts in
+// closed form rather than by elimination.
+
+class Affine3
+{
+  protected:
+
+    double c[4][4];   // columns; c[j][3] is always 0
+
+  public:
+
+    // Constructors
+
+    Affine3();
+    explicit Affine3(Mat4 const & m);   // drops the bottom row of m, which should be (0, 0, 0, 1)
+    Affine3(Affine3 const & m);
+
+    // Assignment operators
+
+    Affine3 & operator = (Affine3 const & m);   // assignment of an Affine3
+
+    // special functions
+
+    Mat4 toMat4() const;                        // as a 4x4 matrix
+    Vec3 transformPoint(Vec3 const & p) const;  // M . (p, 1)
+    Vec3 transformVector(Vec3 const & d) const; // M . (d, 0)
+    Vec3 transposeTransformVector(Vec3 const & d) const;  // transpose of the 3x3 part, times d; applied with the inverse of
+                                                          // a transform, this transforms normals
+    double determinant() const;                 // determinant of the 3x3 part
+    bool isSimilarity(double & scale) const;    // is this a rotation/reflection, uniform scale and translation? If so,
+                                                // gives the scale
+    Affine3 inverse() const;                    // inverse
+
+    // friends
+
+    friend Affine3 operator * (Affine3 const & a, Affine3 const & b);   // m1 * m2
+
+}; // class Affine3
+
+
 /****************************************************************
 *                                                               *
 *          2D functions and 3D functions                        *
@@ -956,10 +1022,36 @@ inline Vec4 operator * (double const d, Vec4 const & a)
 
 inline Vec4 operator * (Mat4 const & a, Vec4 const & v)
 {
+#ifdef ALGEBRA3_AVX
+  // products of each row with v, then pairwise sums gathered into one vector of the four dot products
+  __m256d x = _mm256_loadu_pd(v.n);
+  __m256d p0 = _mm256_mul_pd(_mm256_loadu_pd(a.v[0].n), x);
+  __m256d p1 = _mm256_mul_pd(_mm256_loadu_pd(a.v[1].n), x);
+  __m256d p2 = _mm256_mul_pd(_mm256_loadu_pd(a.v[2].n), x);
+  __m256d p3 = _mm256_mul_pd(_mm256_loadu_pd(a.v[3].n), x);
+  __m256d h01 = _mm256_hadd_pd(p0, p1);   // (p0[0]+p0[1], p1[0]+p1[1], p0[2]+p0[3], p1[2]+p1[3])
+  __m256d h23 = _mm256_hadd_pd(p2, p3);
+  __m256d lo = _mm256_permute2f128_pd(h01, h23, 0x20);
+  __m256d hi = _mm256_permute2f128_pd(h01, h23, 0x31);
+  Vec4 r;
+  _mm256_storeu_pd(r.n, _mm256_add_pd(lo, hi));
+  return r;
+#elif defined(ALGEBRA3_SSE2)
+  // each row times v as two pairs of products, summed; then the two lanes of each sum are added across a pair of rows
+  __m128d x01 = _mm_loadu_pd(v.n), x23 = _mm_loadu_pd(v.n + 2);
+  __m128d s[4];
+  for (int i = 0; i < 4; i++)
+    s[i] = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(a.v[i].n), x01), _mm_mul_pd(_mm_loadu_pd(a.v[i].n + 2), x23));
+  Vec4 r;
+  _mm_storeu_pd(r.n, _mm_add_pd(_mm_unpacklo_pd(s[0], s[1]), _mm_unpackhi_pd(s[0], s[1])));
+  _mm_storeu_pd(r.n + 2, _mm_add_pd(_mm_unpacklo_pd(s[2], s[3]), _mm_unpackhi_pd(s[2], s[3])));
+  return r;
+#else
 #define ALG3_ROWCOL(i) a.v[i].n[0]*v.n[0] + a.v[i].n[1]*v.n[1] \
                      + a.v[i].n[2]*v.n[2] + a.v[i].n[3]*v.n[3]
   return Vec4(ALG3_ROWCOL(0), ALG3_ROWCOL(1), ALG3_ROWCOL(2), ALG3_ROWCOL(3));
 #undef ALG3_ROWCOL // (i)
+#endif
 }
 
 inline Vec4 operator * (Vec4 const & v, Mat4 const & a)
@@ -1310,6 +1402,38 @@ inline Mat4 operator - (Mat4 const & a, Mat4 const & b)
 
 inline Mat4 operator * (Mat4 const & a, Mat4 const & b)
 {
+#ifdef ALGEBRA3_AVX
+  // row i of the product is the sum of the rows of b weighted by row i of a
+  __m256d b0 = _mm256_loadu_pd(b.v[0].n), b1 = _mm256_loadu_pd(b.v[1].n),
+          b2 = _mm256_loadu_pd(b.v[2].n), b3 = _mm256_loadu_pd(b.v[3].n);
+  Mat4 r;
+  for (int i = 0; i < 4; i++)
+  {
+    double const * ai = a.v[i].n;
+    __m256d ri = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(ai[0]), b0),
+                                             _mm256_mul_pd(_mm256_set1_pd(ai[1]), b1)),
+                               _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(ai[2]), b2),
+                                             _mm256_mul_pd(_mm256_set1_pd(ai[3]), b3)));
+    _mm256_storeu_pd(r.v[i].n, ri);
+  }
+  return r;
+#elif defined(ALGEBRA3_SSE2)
+  // as for AVX, with each row of b in two halves
+  Mat4 r;
+  for (int h = 0; h < 4; h += 2)
+  {
+    __m128d b0 = _mm_loadu_pd(b.v[0].n + h), b1 = _mm_loadu_pd(b.v[1].n + h),
+            b2 = _mm_loadu_pd(b.v[2].n + h), b3 = _mm_loadu_pd(b.v[3].n + h);
+    for (int i = 0; i < 4; i++)
+    {
+      double const * ai = a.v[i].n;
+      __m128d ri = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(ai[0]), b0), _mm_mul_pd(_mm_set1_pd(ai[1]), b1)),
+                              _mm_add_pd(_mm_mul_pd(_mm_set1_pd(ai[2]), b2), _mm_mul_pd(_mm_set1_pd(ai[3]), b3)));
+      _mm_storeu_pd(r.v[i].n + h, ri);
+    }
+  }
+  return r;
+#else
 #define ALG3_ROWCOL(i, j) a.v[i].n[0]*b.v[0][j] + a.v[i].n[1]*b.v[1][j] + \
                           a.v[i].n[2]*b.v[2][j] + a.v[i].n[3]*b.v[3][j]
   return Mat4(
@@ -1319,6 +1443,7 @@ inline Mat4 operator * (Mat4 const & a, Mat4 const & b)
     Vec4(ALG3_ROWCOL(3,0), ALG3_ROWCOL(3,1), ALG3_ROWCOL(3,2), ALG3_ROWCOL(3,3))
   );
 #undef ALG3_ROWCOL
+#endif
 }
 
 inline Mat4 operator * (Mat4 const & a, double const d)
@@ -1357,6 +1482,208 @@ inline void swap(Mat4 & a, Mat4 & b)
 { Mat4 tmp(a); a = b; b = tmp; }
 
 
+/****************************************************************
+*                                                               *
+*           Affine3 member functions                            *
+*                                                               *
+****************************************************************/
+
+// CONSTRUCTORS
+
+inline Affine3::Affine3() {}
+
+inline Affine3::Affine3(Mat4 const & m)
+{
+  for (int j = 0; j < 4; j++)
+  {
+    c[j][0] = m.v[0].n[j];
+    c[j][1] = m.v[1].n[j];
+    c[j][2] = m.v[2].n[j];
+    c[j][3] = 0.0;
+  }
+}
+
+inline Affine3::Affine3(Affine3 const & m)
+{ *this = m; }
+
+// ASSIGNMENT OPERATORS
+
+inline Affine3 & Affine3::operator = (Affine3 const & m)
+{
+  for (int j = 0; j < 4; j++)
+    for (int i = 0; i < 4; i++)
+      c[j][i] = m.c[j][i];
+  return *this;
+}
+
+// SPECIAL FUNCTIONS
+
+inline Mat4 Affine3::toMat4() const
+{ return Mat4(Vec4(c[0][0], c[1][0], c[2][0], c[3][0]),
+              Vec4(c[0][1], c[1][1], c[2][1], c[3][1]),
+              Vec4(c[0][2], c[1][2], c[2][2], c[3][2]),
+              Vec4(0.0, 0.0, 0.0, 1.0)); }
+
+inline Vec3 Affine3::transformPoint(Vec3 const & p) const
+{
+#ifdef ALGEBRA3_AVX
+  __m256d r = _mm256_loadu_pd(c[3]);
+  r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(p.n[0]), _mm256_loadu_pd(c[0])));
+  r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(p.n[1]), _mm256_loadu_pd(c[1])));
+  r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(p.n[2]), _mm256_loadu_pd(c[2])));
+  double out[4];
+  _mm256_storeu_pd(out, r);
+  return Vec3(out[0], out[1], out[2]);
+#elif defined(ALGEBRA3_SSE2)
+  // x and y in one register, z (with the unused fourth row) in another
+  __m128d px = _mm_set1_pd(p.n[0]), py = _mm_set1_pd(p.n[1]), pz = _mm_set1_pd(p.n[2]);
+  __m128d xy = _mm_loadu_pd(c[3]), zw = _mm_loadu_pd(c[3] + 2);
+  xy = _mm_add_pd(xy, _mm_mul_pd(px, _mm_loadu_pd(c[0])));
+  zw = _mm_add_pd(zw, _mm_mul_pd(px, _mm_loadu_pd(c[0] + 2)));
+  xy = _mm_add_pd(xy, _mm_mul_pd(py, _mm_loadu_pd(c[1])));
+  zw = _mm_add_pd(zw, _mm_mul_pd(py, _mm_loadu_pd(c[1] + 2)));
+  xy = _mm_add_pd(xy, _mm_mul_pd(pz, _mm_loadu_pd(c[2])));
+  zw = _mm_add_pd(zw, _mm_mul_pd(pz, _mm_loadu_pd(c[2] + 2)));
+  Vec3 r;
+  _mm_storeu_pd(r.n, xy);
+  _mm_store_sd(r.n + 2, zw);
+  return r;
+#else
+  return Vec3(c[0][0]*p.n[0] + c[1][0]*p.n[1] + c[2][0]*p.n[2] + c[3][0],
+              c[0][1]*p.n[0] + c[1][1]*p.n[1] + c[2][1]*p.n[2] + c[3][1],
+              c[0][2]*p.n[0] + c[1][2]*p.n[1] + c[2][2]*p.n[2] + c[3][2]);
+#endif
+}
+
+inline Vec3 Affine3::transformVector(Vec3 const & d) const
+{
+#ifdef ALGEBRA3_AVX
+  __m256d r = _mm256_mul_pd(_mm256_set1_pd(d.n[0]), _mm256_loadu_pd(c[0]));
+  r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(d.n[1]), _mm256_loadu_pd(c[1])));
+  r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(d.n[2]), _mm256_loadu_pd(c[2])));
+  double out[4];
+  _mm256_storeu_pd(out, r);
+  return Vec3(out[0], out[1], out[2]);
+#elif defined(ALGEBRA3_SSE2)
+  __m128d dx = _mm_set1_pd(d.n[0]), dy = _mm_set1_pd(d.n[1]), dz = _mm_set1_pd(d.n[2]);
+  __m128d xy = _mm_mul_pd(dx, _mm_loadu_pd(c[0]));
+  __m128d zw = _mm_mul_pd(dx, _mm_loadu_pd(c[0] + 2));
+  xy = _mm_add_pd(xy, _mm_mul_pd(dy, _mm_loadu_pd(c[1])));
+  zw = _mm_add_pd(zw, _mm_mul_pd(dy, _mm_loadu_pd(c[1] + 2)));
+  xy = _mm_add_pd(xy, _mm_mul_pd(dz, _mm_loadu_pd(c[2])));
+  zw = _mm_add_pd(zw, _mm_mul_pd(dz, _mm_loadu_pd(c[2] + 2)));
+  Vec3 r;
+  _mm_storeu_pd(r.n, xy);
+  _mm_store_sd(r.n + 2, zw);
+  return r;
+#else
+  return Vec3(c[0][0]*d.n[0] + c[1][0]*d.n[1] + c[2][0]*d.n[2],
+              c[0][1]*d.n[0] + c[1][1]*d.n[1] + c[2][1]*d.n[2],
+              c[0][2]*d.n[0] + c[1][2]*d.n[1] + c[2][2]*d.n[2]);
+#endif
+}
+
+inline Vec3 Affine3::transposeTransformVector(Vec3 const & d) const
+{ return Vec3(c[0][0]*d.n[0] + c[0][1]*d.n[1] + c[0][2]*d.n[2],
+              c[1][0]*d.n[0] + c[1][1]*d.n[1] + c[1][2]*d.n[2],
+              c[2][0]*d.n[0] + c[2][1]*d.n[1] + c[2][2]*d.n[2]); }
+
+inline double Affine3::determinant() const
+{
+  Vec3 c0(c[0][0], c[0][1], c[0][2]), c1(c[1][0], c[1][1], c[1][2]), c2(c[2][0], c[2][1], c[2][2]);
+  return c0 * (c1 ^ c2);
+}
+
+inline bool Affine3::isSimilarity(double & scale) const    // columns of the 3x3 part orthogonal and of equal length
+{
+  Vec3 c0(c[0][0], c[0][1], c[0][2]), c1(c[1][0], c[1][1], c[1][2]), c2(c[2][0], c[2][1], c[2][2]);
+  double scale2 = c0.length2();
+  double tolerance = 1e-9 * scale2;
+  if (fabs(c1.length2() - scale2) > tolerance || fabs(c2.length2() - scale2) > tolerance
+   || fabs(c0 * c1) > tolerance || fabs(c1 * c2) > tolerance || fabs(c2 * c0) > tolerance)
+    return false;
+
+  scale = sqrt(scale2);
+  return true;
+}
+
+inline Affine3 Affine3::inverse() const    // adjugate of the 3x3 part, then the translation mapped back
+{
+#ifdef ALGEBRA3_AVX
+  // lane i holds the pair of columns whose cross product is row i of the adjugate, (c1, c2), (c2, c0) and (c0, c1), so
+  // component k of the three cross products is column k of the inverse
+  __m256d px = _mm256_set_pd(0.0, c[0][0], c[2][0], c[1][0]), qx = _mm256_set_pd(0.0, c[1][0], c[0][0], c[2][0]);
+  __m256d py = _mm256_set_pd(0.0, c[0][1], c[2][1], c[1][1]), qy = _mm256_set_pd(0.0, c[1][1], c[0][1], c[2][1]);
+  __m256d pz = _mm256_set_pd(0.0, c[0][2], c[2][2], c[1][2]), qz = _mm256_set_pd(0.0, c[1][2], c[0][2], c[2][2]);
+  __m256d b0 = _mm256_sub_pd(_mm256_mul_pd(py, qz), _mm256_mul_pd(pz, qy));
+  __m256d b1 = _mm256_sub_pd(_mm256_mul_pd(pz, qx), _mm256_mul_pd(px, qz));
+  __m256d b2 = _mm256_sub_pd(_mm256_mul_pd(px, qy), _mm256_mul_pd(py, qx));
+
+  // the determinant is c0 . (c1 ^ c2), and c1 ^ c2 is lane 0
+  double det = c[0][0] * _mm256_cvtsd_f64(b0) + c[0][1] * _mm256_cvtsd_f64(b1) + c[0][2] * _mm256_cvtsd_f64(b2);
+  if (det == 0.)
+    ALG3_ERROR("Affine3::inverse: singular matrix; can't invert\n");
+
+  __m256d det_inv = _mm256_set1_pd(1. / det);
+  b0 = _mm256_mul_pd(b0, det_inv);
+  b1 = _mm256_mul_pd(b1, det_inv);
+  b2 = _mm256_mul_pd(b2, det_inv);
+
+  __m256d t = _mm256_mul_pd(_mm256_set1_pd(c[3][0]), b0);
+  t = _mm256_add_pd(t, _mm256_mul_pd(_mm256_set1_pd(c[3][1]), b1));
+  t = _mm256_add_pd(t, _mm256_mul_pd(_mm256_set1_pd(c[3][2]), b2));
+
+  Affine3 b;
+  _mm256_storeu_pd(b.c[0], b0);
+  _mm256_storeu_pd(b.c[1], b1);
+  _mm256_storeu_pd(b.c[2], b2);
+  _mm256_storeu_pd(b.c[3], _mm256_sub_pd(_mm256_setzero_pd(), t));
+  return b;
+#else
+  Vec3 c0(c[0][0], c[0][1], c[0][2]), c1(c[1][0], c[1][1], c[1][2]), c2(c[2][0], c[2][1], c[2][2]);
+
+  // the rows of the inverse of a matrix with columns c0, c1, c2 are the cross products of pairs of columns over the determinant
+  Vec3 r0 = c1 ^ c2, r1 = c2 ^ c0, r2 = c0 ^ c1;
+  double det = c0 * r0;
+  if (det == 0.)
+    ALG3_ERROR("Affine3::inverse: singular matrix; can't invert\n");
+
+  double det_inv = 1. / det;
+  r0 *= det_inv; r1 *= det_inv; r2 *= det_inv;
+
+  Vec3 t(c[3][0], c[3][1], c[3][2]);
+  Affine3 b;
+  for (int j = 0; j < 3; j++)
+  {
+    b.c[j][0] = r0.n[j];
+    b.c[j][1] = r1.n[j];
+    b.c[j][2] = r2.n[j];
+    b.c[j][3] = 0.0;
+  }
+  b.c[3][0] = -(r0 * t);
+  b.c[3][1] = -(r1 * t);
+  b.c[3][2] = -(r2 * t);
+  b.c[3][3] = 0.0;
+  return b;
+#endif
+}
+
+// FRIENDS
+
+inline Affine3 operator * (Affine3 const & a, Affine3 const & b)
+{
+  Affine3 r;
+  for (int j = 0; j < 3; j++)
+  {
+    Vec3 col = a.transformVector(Vec3(b.c[j][0], b.c[j][1], b.c[j][2]));
+    r.c[j][0] = col[0]; r.c[j][1] = col[1]; r.c[j][2] = col[2]; r.c[j][3] = 0.0;
+  }
+  Vec3 t = a.transformPoint(Vec3(b.c[3][0], b.c[3][1], b.c[3][2]));
+  r.c[3][0] = t[0]; r.c[3][1] = t[1]; r.c[3][2] = t[2]; r.c[3][3] = 0.0;
+  return r;
+}
+
+
 /****************************************************************
 *                                                               *
 *          2D functions and 3D functions                        *
@@ -13,6 +13,7 @@
 
 #include "mathexpr.hpp"
 #include "Algebra3.hpp"
+#include "SceneArena.hpp"
 
 /** Holds a value parametrized by time. */
 class ParametricValue
@@ -51,6 +52,9 @@ class ConstValue : public ParametricValue
 
 }; // class ConstValue
 
+/** Constant values hold nothing to destroy. */
+template <> struct ArenaDestroys<ConstValue> { static bool const value = false; };
+
 
 /** Holds an expression and its result. */
 class ExprValue : public ParametricValue
@@ -22,8 +22,9 @@ tab(int level)
 void
 printNode(SceneInstance * n, int level = 0)
 {
+  // one line per node, which for large scenes is far too many to flush each
   tab(level);
-  std::cout << "Node " << n->getName() << " {" << std::endl;
+  std::cout << "Node " << n->getName() << " {\n";
 
   if (n->getChild())
   {
@@ -36,7 +37,7 @@ printNode(SceneInstance * n, int level = 0)
   }
 
   tab(level);
-  std::cout << "}" << std::endl;
+  std::cout << "}\n";
 }
 
 void Scene::printScene()
@@ -49,6 +50,7 @@ Scene::Scene(string const & path)
   loader_ = new SceneLoader(*this, path);
   std::cout << "Loaded scene:" << std::endl;
   printScene();
+  std::cout.flush();
 }
 
 Scene::~Scene()
@@ -9,6 +9,7 @@
 #ifndef __Scene_hpp__
 #define __Scene_hpp__
 
+#include "SceneArena.hpp"
 #include "SceneInstance.hpp"
 #include "SceneGroup.hpp"
 
@@ -36,6 +37,7 @@ class Scene
   private:
     friend class SceneLoader;
 
+    SceneArena arena_;      ///< Owns every node of the scene DAG, which is freed all at once with the scene.
     SceneInstance * root_;  ///< The starting point for traversing the scene DAG.
     SceneLoader * loader_;  ///< Loader handles the file reading bits.
 
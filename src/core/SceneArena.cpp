@@ -0,0 +1,56 @@
+/*
+ * SceneArena.cpp
+ *
+ * Bump allocator for the nodes of a scene graph, and hash tables keyed by names interned in it.
+ */
+
+#include "SceneArena.hpp"
+#include <cstdint>
+#include <cstdlib>
+
+SceneArena::SceneArena()
+: next_(NULL), limit_(NULL)
+{
+}
+
+SceneArena::~SceneArena()
+{
+  for (std::vector<Destructor>::reverse_iterator it = destructors_.rbegin(); it != destructors_.rend(); ++it)
+    it->destroy(it->object);
+
+  for (std::vector<char *>::iterator it = blocks_.begin(); it != blocks_.end(); ++it)
+    free(*it);
+}
+
+void *
+SceneArena::allocate(size_t size, size_t align)
+{
+  uintptr_t p = ((uintptr_t)next_ + (align - 1)) & ~(uintptr_t)(align - 1);
+  if (next_ == NULL || p + size > (uintptr_t)limit_)
+  {
+    // objects too large to share a block get one of their own, leaving the current block in use
+    size_t block_size = size + align > BLOCK_SIZE / 4 ? size + align : BLOCK_SIZE;
+    char * block = (char *)malloc(block_size);
+    if (block == NULL)
+      throw std::bad_alloc();
+
+    blocks_.push_back(block);
+    p = ((uintptr_t)block + (align - 1)) & ~(uintptr_t)(align - 1);
+    if (block_size != BLOCK_SIZE)
+      return (void *)p;
+
+    limit_ = block + block_size;
+  }
+
+  next_ = (char *)(p + size);
+  return (void *)p;
+}
+
+char const *
+SceneArena::copyString(char const * text, size_t length)
+{
+  char * copy = (char *)allocate(length + 1, 1);
+  memcpy(copy, text, length);
+  copy[length] = 0;
+  return copy;
+}
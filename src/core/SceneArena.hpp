@@ -0,0 +1,136 @@
+/*
+ * SceneArena.hpp
+ *
+ * Bump allocator for the nodes of a scene graph, and hash tables keyed by names interned in it.
+ */
+
+#ifndef __SceneArena_hpp__
+#define __SceneArena_hpp__
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Whether a SceneArena runs the destructor of objects of type T. Classes whose destructor is virtual but does nothing, and the
+ * bulk of large scenes, specialise this to false, so the arena does not record a destructor for each of them.
+ */
+template <typename T>
+struct ArenaDestroys
+{
+  static bool const value = !std::is_trivially_destructible<T>::value;
+};
+
+/**
+ * Owns the nodes of a scene graph -- instances, groups, transforms, parametric values and the rest -- and the strings naming
+ * them. Objects are carved out of large blocks, and all are destroyed together with the arena, so nodes never delete each
+ * other, and nodes shared between groups (such as materials) need no further bookkeeping. Destructors run in reverse order of
+ * creation, and only for objects that have one to run.
+ */
+class SceneArena
+{
+  public:
+    /** Constructor. */
+    SceneArena();
+
+    /** Destructor. Destroys every object created in the arena and frees its memory. */
+    ~SceneArena();
+
+    /** Create an object in the arena, passing \a args to its constructor. */
+    template <typename T, typename... Args> T * create(Args &&... args)
+    {
+      T * object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+      if (ArenaDestroys<T>::value)
+      {
+        Destructor d = { object, &destroy<T> };
+        destructors_.push_back(d);
+      }
+
+      return object;
+    }
+
+    /** Copy a string into the arena, returning the copy, which is null-terminated. */
+    char const * copyString(char const * text, size_t length);
+
+    /** Copy a null-terminated string into the arena. */
+    char const * copyString(char const * text) { return copyString(text, strlen(text)); }
+
+  private:
+    // make these private; they shouldn't be called
+    SceneArena(SceneArena const & copy);
+    SceneArena & operator=(SceneArena const & arena);
+
+    static size_t const BLOCK_SIZE = 64 * 1024;
+
+    struct Destructor
+    {
+      void * object;
+      void (*destroy)(void *);
+    };
+
+    template <typename T> static void destroy(void * object) { static_cast<T *>(object)->~T(); }
+
+    /** Get uninitialised memory for an object. */
+    void * allocate(size_t size, size_t align);
+
+    std::vector<char *> blocks_;
+    char * next_;   // first free byte of the current block
+    char * limit_;  // end of the current block
+    std::vector<Destructor> destructors_;
+};
+
+/** Hash of a null-terminated string (FNV-1a). */
+struct NameHash
+{
+  size_t operator()(char const * name) const
+  {
+    size_t h = 2166136261u;
+    for ( ; *name; ++name)
+      h = (h ^ (unsigned char)*name) * 16777619u;
+
+    return h;
+  }
+};
+
+/** Equality of null-terminated strings. */
+struct NameEqual
+{
+  bool operator()(char const * a, char const * b) const { return strcmp(a, b) == 0; }
+};
+
+/**
+ * Hash table from names to objects. Keys are compared by content, so any string can be looked up, but the keys stored are
+ * interned copies in a SceneArena, which the objects can share as their own names.
+ */
+template <typename T>
+class NameTable
+{
+  public:
+    /** Find the object with a given name, or NULL if there is none. Never adds an entry. */
+    T * find(char const * name) const
+    {
+      typename Map::const_iterator it = map_.find(name);
+      return it == map_.end() ? NULL : it->second;
+    }
+
+    /**
+     * Add an object under a name, which must not be in the table already, and return the interned copy of the name, allocated
+     * in \a arena.
+     */
+    char const * insert(SceneArena & arena, char const * name, T * object)
+    {
+      char const * key = arena.copyString(name);
+      map_[key] = object;
+      return key;
+    }
+
+  private:
+    typedef std::unordered_map<char const *, T *, NameHash, NameEqual> Map;
+    Map map_;
+};
+
+#endif  // __SceneArena_hpp__
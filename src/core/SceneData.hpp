@@ -3,6 +3,7 @@
  *
  *  These classes are used internally to wrap ParametricValues
  *  The Scene 'Group' and 'Instance' classes will not return them to users of the class.
+ *  They are all created in the Scene's SceneArena, which owns them and the values they refer to, so none deletes another.
  *
  *  Created on: Feb 8, 2009
  *      Author: jima
@@ -71,14 +72,6 @@ class GeneralTransform : public Transform
 
       return out;
     }
-
-    ~GeneralTransform()
-    {
-      for (std::vector<ParametricValue *>::iterator it = matrix.begin(); it != matrix.end(); ++it)
-      {
-        delete *it;
-      }
-    }
 };
 
 /** A time-varying translation. */
@@ -107,12 +100,6 @@ class Translate : public Transform
       for (int i = 0; i < 3; i++)
         translate[i] = NULL;
     }
-
-    ~Translate()
-    {
-      for (int i = 0; i < 3; i++)
-        delete translate[i];
-    }
 };
 
 /** A time-varying scaling transform. */
@@ -142,12 +129,6 @@ class Scale : public Transform
       for (int i = 0; i < 3; i++)
         scale[i] = NULL;
     }
-
-    ~Scale()
-    {
-      for (int i = 0; i < 3; i++)
-        delete scale[i];
-    }
 };
 
 /** A time-varying rotation. */
@@ -184,16 +165,13 @@ class Rotate : public Transform
       for (int i = 0; i < 3; i++)
         axis[i] = NULL;
     }
-
-    ~Rotate()
-    {
-      delete angle;
-
-      for (int i = 0; i < 3; i++)
-        delete axis[i];
-    }
 };
 
+/** Translations, scalings and rotations only refer to values in the arena, so have nothing to destroy. */
+template <> struct ArenaDestroys<Translate> { static bool const value = false; };
+template <> struct ArenaDestroys<Scale> { static bool const value = false; };
+template <> struct ArenaDestroys<Rotate> { static bool const value = false; };
+
 /** A color varying over time. */
 class ParametricColor
 {
@@ -214,12 +192,6 @@ class ParametricColor
       for (int i = 0; i < 3; i++)
         color_[i] = NULL;
     }
-
-    ~ParametricColor()
-    {
-      for (int i = 0; i < 3; i++)
-        delete color_[i];
-    }
 };
 
 /** A time-varying LOD index. */
@@ -236,11 +208,6 @@ class LOD
     }
 
     LOD() : level_(NULL) {}
-
-    ~LOD()
-    {
-      delete level_;
-    }
 };
 
 /** A time-varying material. */
@@ -268,14 +235,6 @@ class ParametricMaterial
       for (int i = 0; i < 7; i++)
         coefficients_[i] = 0;
     }
-
-    ~ParametricMaterial()
-    {
-      delete RGB_;
-
-      for (int i = 0; i < 7; i++)
-        delete coefficients_[i];
-    }
 };
 
 /** A sphere with time-varying radius. */
@@ -297,11 +256,6 @@ class ParametricSphere
     }
 
     ParametricSphere() : radius_(NULL), material_(NULL) {}
-
-    ~ParametricSphere()
-    {
-      delete radius_;
-    }
 };
 
 /** A time-varying camera. */
@@ -331,16 +285,6 @@ class ParametricCamera
         frustum_[i] = NULL;
       }
     }
-
-    ~ParametricCamera()
-    {
-      delete perspective_;
-
-      for (int i = 0; i < 6; i++)
-      {
-        delete frustum_[i];
-      }
-    }
 };
 
 /** A time-varying light. */
@@ -353,25 +297,19 @@ class ParametricLight
     ParametricValue * angularFalloff_;
     ParametricValue * deadDistance_;
     ParametricValue * side_; // add side_ parameter for area lights
+    ParametricValue * samples_; // number of shadow rays per area light evaluation, 0 for the default
     friend class SceneLoader;
 
   public:
-    ParametricLight() : type_(NULL), color_(NULL), falloff_(NULL), angularFalloff_(NULL), deadDistance_(NULL), side_(NULL) {}
-    ~ParametricLight()
-    {
-      delete type_;
-      delete color_;
-      delete falloff_;
-      delete angularFalloff_;
-      delete deadDistance_;
-      delete side_;
-    }
+    ParametricLight() : type_(NULL), color_(NULL), falloff_(NULL), angularFalloff_(NULL), deadDistance_(NULL), side_(NULL),
+                        samples_(NULL) {}
 
     LightInfo getLight(int time)
     {
       return LightInfo((int)type_->getValue(time),
                        color_->getColor(time), falloff_->getValue(time),
-                       angularFalloff_->getValue(time), deadDistance_->getValue(time), side_->getValue(time));
+                       angularFalloff_->getValue(time), deadDistance_->getValue(time), side_->getValue(time),
+                       (int)samples_->getValue(time));
     }
 };
 
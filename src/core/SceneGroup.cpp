@@ -19,14 +19,10 @@ SceneGroup::SceneGroup()
   mesh_ = NULL;
 }
 
-// don't delete children, just local stuff; freeing children is SceneLoader's job
+// don't delete anything; the children and local stuff are all owned by the Scene's SceneArena
 // (because cleaning up after a DAG with only local info is not good)
 SceneGroup::~SceneGroup()
 {
-  delete sphere_;
-  delete light_;
-  delete camera_;
-  delete mesh_;
 }
 
 int
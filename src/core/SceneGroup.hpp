@@ -37,7 +37,7 @@ class SceneGroup
     SceneGroup(const SceneGroup &);
     SceneGroup & operator=(const SceneGroup &);
 
-    std::string name_;
+    char const * name_;  // in the Scene's SceneArena
     std::vector<SceneInstance *> children_;
     ParametricSphere * sphere_;
     ParametricLight * light_;
@@ -46,6 +46,7 @@ class SceneGroup
     ParametricMaterial * meshMaterial_;
 
     friend class SceneLoader;
+    friend class SceneArena;
 };
 
 #endif  // __SceneGroup_hpp__
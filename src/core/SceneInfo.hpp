@@ -69,11 +69,14 @@ struct LightInfo
   double angularFalloff;
   double deadDistance;
   double side; // add side parameter for area lights
+  int samples; // shadow rays per evaluation of an area light, 0 for the default
 
   LightInfo() {}
 
-  LightInfo(int type, RGB color, double falloff = 2, double angularFalloff = 0.1, double deadDistance = 0.1, double side = 0)
-    : type(type), color(color), falloff(falloff), angularFalloff(angularFalloff), deadDistance(deadDistance), side(side)
+  LightInfo(int type, RGB color, double falloff = 2, double angularFalloff = 0.1, double deadDistance = 0.1, double side = 0,
+            int samples = 0)
+    : type(type), color(color), falloff(falloff), angularFalloff(angularFalloff), deadDistance(deadDistance), side(side),
+      samples(samples)
   {}
 };
 
@@ -17,13 +17,9 @@ SceneInstance::SceneInstance()
   child_ = NULL;
 }
 
+// the transforms, color and LOD are owned by the Scene's SceneArena, like the instance itself
 SceneInstance::~SceneInstance()
 {
-  delete color_;
-  delete lod_;
-
-  for (vector<Transform *>::iterator it = transforms_.begin(); it != transforms_.end(); ++it)
-    delete *it;
 }
 
 SceneGroup * SceneInstance::getChild()
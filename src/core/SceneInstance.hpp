@@ -34,7 +34,7 @@ class SceneInstance
     SceneInstance(const SceneInstance &);
     SceneInstance & operator=(const SceneInstance &);
 
-    string name_;
+    char const * name_;  // in the Scene's SceneArena
 
     vector<Transform *> transforms_;
     ParametricColor * color_;
@@ -43,6 +43,7 @@ class SceneInstance
     SceneGroup * child_;
 
     friend class SceneLoader;
+    friend class SceneArena;
 };
 
 #endif // __SceneInstance_hpp__
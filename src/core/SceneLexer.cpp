@@ -0,0 +1,307 @@
+/*
+ * SceneLexer.cpp
+ *
+ * Splits a scene file into tokens for SceneLoader, in one pass over the file mapped into memory.
+ */
+
+#include "SceneLexer.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// character classes, indexed by unsigned char
+enum { NAME_CHAR = 1, NUMBER_START = 2, NUMBER_CHAR = 4 };
+
+struct CharClasses
+{
+  unsigned char c[256];
+
+  CharClasses()
+  {
+    memset(c, 0, sizeof(c));
+    for (int i = 'a'; i <= 'z'; ++i) c[i] = NAME_CHAR | NUMBER_CHAR;
+    for (int i = 'A'; i <= 'Z'; ++i) c[i] = NAME_CHAR | NUMBER_CHAR;
+    for (int i = '0'; i <= '9'; ++i) c[i] = NAME_CHAR | NUMBER_START | NUMBER_CHAR;
+    c[(unsigned char)'_'] = NAME_CHAR | NUMBER_CHAR;
+    c[(unsigned char)'.'] = NUMBER_START | NUMBER_CHAR;
+    c[(unsigned char)'+'] = NUMBER_START | NUMBER_CHAR;
+    c[(unsigned char)'-'] = NUMBER_START | NUMBER_CHAR;
+  }
+};
+
+CharClasses const CHAR_CLASSES;
+
+inline bool
+hasClass(char c, int cls)
+{
+  return (CHAR_CLASSES.c[(unsigned char)c] & cls) != 0;
+}
+
+// Exact powers of ten, for converting decimals with few enough digits without strtod
+double const POWERS_OF_TEN[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16,
+                                 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+} // namespace
+
+bool
+SceneToken::isName() const
+{
+  if (type == WORD)
+    return true;
+
+  if (type != NUMBER)
+    return false;
+
+  for (size_t i = 0; i < length; ++i)
+  {
+    if (!hasClass(text[i], NAME_CHAR))
+      return false;
+  }
+
+  return true;
+}
+
+bool
+SceneToken::toDouble(double & value) const
+{
+  if (type != NUMBER)
+    return false;
+
+  // Plain decimals of up to 15 digits are an exact integer divided by an exact power of ten, which is correctly rounded, so
+  // this gives the same result as strtod
+  char const * p = text, * e = text + length;
+  bool negative = (p < e && *p == '-');
+  if (p < e && (*p == '-' || *p == '+'))
+    ++p;
+
+  unsigned long long mantissa = 0;
+  int digits = 0, fraction_digits = 0;
+  bool point = false;
+  for ( ; p < e; ++p)
+  {
+    if (*p >= '0' && *p <= '9')
+    {
+      mantissa = mantissa * 10 + (unsigned)(*p - '0');
+      ++digits;
+      fraction_digits += point;
+    }
+    else if (*p == '.' && !point)
+      point = true;
+    else
+      break;
+  }
+
+  if (p == e && digits > 0 && digits <= 15)
+  {
+    value = (double)mantissa / POWERS_OF_TEN[fraction_digits];
+    if (negative)
+      value = -value;
+    return true;
+  }
+
+  // Anything else (exponents, long mantissas, malformed numbers) goes through strtod
+  char buf[64];
+  if (length >= sizeof(buf))
+    return false;
+
+  memcpy(buf, text, length);
+  buf[length] = 0;
+  char * end;
+  value = strtod(buf, &end);
+  return end == buf + length && length > 0;
+}
+
+SceneLexer::SceneLexer()
+: data_(NULL), size_(0), pos_(0), last_end_(0), mapped_(false)
+{
+  next_.type = SceneToken::END;
+  next_.text = NULL;
+  next_.length = 0;
+  next_.offset = 0;
+}
+
+SceneLexer::~SceneLexer()
+{
+  close();
+}
+
+void
+SceneLexer::close()
+{
+  if (mapped_)
+    munmap(const_cast<char *>(data_), size_);
+
+  data_ = NULL;
+  size_ = 0;
+  pos_ = 0;
+  last_end_ = 0;
+  mapped_ = false;
+  contents_.clear();
+  line_starts_.clear();
+}
+
+bool
+SceneLexer::open(std::string const & path)
+{
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd >= 0)
+  {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+      void * p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED)
+      {
+        madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+        data_ = (char const *)p;
+        size_ = (size_t)st.st_size;
+        mapped_ = true;
+      }
+    }
+
+    ::close(fd);
+  }
+
+  // Fall back to reading the file, for empty files and anything that cannot be mapped
+  if (!mapped_)
+  {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+    {
+      scan();
+      return false;
+    }
+
+    std::ostringstream ss;
+    ss << file.rdbuf();
+    contents_ = ss.str();
+    data_ = contents_.data();
+    size_ = contents_.size();
+  }
+
+  scan();
+  return true;
+}
+
+void
+SceneLexer::scan()
+{
+  last_end_ = pos_;
+
+  // skip white space and comments
+  while (pos_ < size_)
+  {
+    char c = data_[pos_];
+    if (c == '#')
+    {
+      char const * nl = (char const *)memchr(data_ + pos_, '\n', size_ - pos_);
+      pos_ = nl ? (size_t)(nl - data_) + 1 : size_;
+    }
+    else if ((unsigned char)c <= ' ')
+      ++pos_;
+    else
+      break;
+  }
+
+  next_.offset = pos_;
+  next_.text = data_ + pos_;
+  next_.length = 0;
+  if (pos_ >= size_)
+  {
+    next_.type = SceneToken::END;
+    return;
+  }
+
+  char c = data_[pos_];
+  size_t start = pos_;
+  if (c == '(' || c == ')')
+  {
+    next_.type = (c == '(' ? SceneToken::OPEN : SceneToken::CLOSE);
+    next_.length = 1;
+    ++pos_;
+  }
+  else if (c == '"')
+  {
+    char const * q = (char const *)memchr(data_ + start + 1, '"', size_ - start - 1);
+    next_.text = data_ + start + 1;
+    if (q)
+    {
+      next_.type = SceneToken::STRING;
+      next_.length = (size_t)(q - next_.text);
+      pos_ = (size_t)(q - data_) + 1;
+    }
+    else
+    {
+      next_.type = SceneToken::UNTERMINATED;
+      next_.length = size_ - start - 1;
+      pos_ = size_;
+    }
+  }
+  else if (c == '{')
+  {
+    // a brace inside a comment does not end the expression
+    size_t p = start + 1;
+    while (p < size_ && data_[p] != '}')
+    {
+      if (data_[p] == '#')
+      {
+        char const * nl = (char const *)memchr(data_ + p, '\n', size_ - p);
+        p = nl ? (size_t)(nl - data_) : size_;
+      }
+      else
+        ++p;
+    }
+
+    next_.text = data_ + start + 1;
+    next_.length = (p < size_ ? p : size_) - start - 1;
+    next_.type = (p < size_ ? SceneToken::EXPRESSION : SceneToken::UNTERMINATED);
+    pos_ = (p < size_ ? p + 1 : size_);
+  }
+  else if (hasClass(c, NAME_CHAR | NUMBER_START))
+  {
+    int cls = hasClass(c, NUMBER_START) ? NUMBER_CHAR : NAME_CHAR;
+    next_.type = (cls == NUMBER_CHAR ? SceneToken::NUMBER : SceneToken::WORD);
+    ++pos_;
+    while (pos_ < size_ && hasClass(data_[pos_], cls))
+      ++pos_;
+    next_.length = pos_ - start;
+  }
+  else
+  {
+    next_.type = SceneToken::OTHER;
+    next_.length = 1;
+    ++pos_;
+  }
+}
+
+void
+SceneLexer::getLineAndColumn(size_t offset, int & line, int & column)
+{
+  if (line_starts_.empty())
+  {
+    line_starts_.push_back(0);
+    for (char const * p = data_, * e = data_ + size_; p < e; )
+    {
+      char const * nl = (char const *)memchr(p, '\n', (size_t)(e - p));
+      if (!nl)
+        break;
+
+      p = nl + 1;
+      line_starts_.push_back((size_t)(p - data_));
+    }
+  }
+
+  std::vector<size_t>::const_iterator it = std::upper_bound(line_starts_.begin(), line_starts_.end(), offset);
+  line = (int)(it - line_starts_.begin());
+  column = (int)(offset - line_starts_[line - 1]);
+}
@@ -0,0 +1,116 @@
+/*
+ * SceneLexer.hpp
+ *
+ * Splits a scene file into tokens for SceneLoader, in one pass over the file mapped into memory.
+ */
+
+#ifndef __SceneLexer_hpp__
+#define __SceneLexer_hpp__
+
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/** A token of a scene file. The text points into the file, so it is valid for as long as the lexer is. */
+struct SceneToken
+{
+  enum Type
+  {
+    OPEN,          ///< (
+    CLOSE,         ///< )
+    WORD,          ///< letters, digits and underscores, starting with a letter or underscore
+    NUMBER,        ///< letters, digits, underscores, points and signs, starting with a digit, point or sign
+    STRING,        ///< text between double quotes, not including them
+    EXPRESSION,    ///< text between braces, not including them, with any comments still in it
+    UNTERMINATED,  ///< a string or expression that runs to the end of the file
+    OTHER,         ///< any other single character
+    END            ///< end of the file
+  };
+
+  Type type;
+  char const * text;
+  size_t length;
+  size_t offset;  ///< position of the start of the token in the file
+
+  /** Get the text of the token as a string. */
+  std::string str() const { return std::string(text, length); }
+
+  /** Check whether the text of the token is \a word, without making a string of it. */
+  bool operator==(char const * word) const { return strncmp(text, word, length) == 0 && word[length] == 0; }
+
+  /** Check whether the text of the token is not \a word. */
+  bool operator!=(char const * word) const { return !(*this == word); }
+
+  /** Check whether the token can be used as a name: a word, or a number made only of letters, digits and underscores. */
+  bool isName() const;
+
+  /** Convert a number token to a value. Returns false if the whole token is not a number. */
+  bool toDouble(double & value) const;
+};
+
+/** Write the text of a token. */
+inline std::ostream &
+operator<<(std::ostream & out, SceneToken const & t)
+{
+  return out.write(t.text, (std::streamsize)t.length);
+}
+
+/**
+ * Tokeniser for scene files. The file is mapped into memory (or read, where it cannot be mapped) and scanned once, front to
+ * back, one token ahead of the parser; comments from # to the end of the line are skipped. Line numbers for error messages are
+ * found by binary search in a table of line starts, built the first time one is asked for.
+ */
+class SceneLexer
+{
+  public:
+    /** Constructor. */
+    SceneLexer();
+
+    /** Destructor. Unmaps the file. */
+    ~SceneLexer();
+
+    /** Open a file, replacing any previous one. Returns false if it could not be read. */
+    bool open(std::string const & path);
+
+    /** Look at the next token without consuming it. */
+    SceneToken const & peek() const { return next_; }
+
+    /** Consume the next token and return it. */
+    SceneToken next() { SceneToken t = next_; scan(); return t; }
+
+    /**
+     * Get the position in the file just after the last token consumed, or the start of the next token if it has been rejected
+     * since.
+     */
+    size_t offset() const { return last_end_; }
+
+    /** Leave the next token unconsumed after finding it is not what was wanted, so that errors are reported at it. */
+    void reject() { last_end_ = next_.offset; }
+
+    /** Convert a position in the file to a line number, from 1, and a column, from 0. */
+    void getLineAndColumn(size_t offset, int & line, int & column);
+
+  private:
+    // make these private; they shouldn't be called
+    SceneLexer(SceneLexer const & copy);
+    SceneLexer & operator=(SceneLexer const & lexer);
+
+    /** Close the file. */
+    void close();
+
+    /** Find the token that starts at or after pos_, and store it in next_. */
+    void scan();
+
+    char const * data_;
+    size_t size_;
+    size_t pos_;       // position just after next_
+    size_t last_end_;  // position just after the last token consumed, or of the next token if rejected
+    bool mapped_;      // whether data_ is a mapping of the file, or points into contents_
+    std::string contents_;
+    SceneToken next_;
+    std::vector<size_t> line_starts_;
+};
+
+#endif  // __SceneLexer_hpp__
@@ -1,219 +1,129 @@
 #include "SceneLoader.hpp"
 #include "Algebra3.hpp"
-#include <fstream>
+#include <map>
 #include <string>
 
 using namespace std;
 
 SceneLoader::SceneLoader(Scene & scene, string file)
+: arena(scene.arena_)
 {
   err = &cout;
-  scene.root_ = new SceneInstance();
+  scene.root_ = arena.create<SceneInstance>();
   root = scene.root_;
-  root->name_ = "toplevel";
+  root->name_ = arena.copyString("toplevel");
   buildScene(file);
 }
 
+// everything loaded belongs to the Scene's arena, so there is nothing to free here
 SceneLoader::~SceneLoader()
 {
-  for (map<string, SceneGroup *>::iterator it = groups.begin();
-       it != groups.end(); ++it)
-  {
-    delete it->second;
-  }
-
-  for (map<string, ParametricMaterial *>::iterator it = materials.begin();
-       it != materials.end(); ++it)
-  {
-    delete it->second;
-  }
-
-  for (vector<SceneInstance *>::iterator it = instances.begin(); it != instances.end(); ++it)
-  {
-    delete *it;
-  }
 }
 
-void SceneLoader::buildEndlineTable(string filename)
+void SceneLoader::curPos(ostream & out, size_t g)
 {
-  ifstream file(filename.c_str());
-  string line;
-
-  while (getline( file, line ))
-    endlineTable.push_back(file.tellg());
+  int line, column;
+  lexer.getLineAndColumn(g, line, column);
 
-  endlineTable.push_back(file.tellg());
+  // columns have always been reported counting from -1
+  out << "line: " << line << " char: " << (column - 1);
 }
 
-void SceneLoader::curPos(ostream & out, int g)
+string SceneLoader::getString()
 {
-  int line = 1;
-  int lastg = 0;
-
-  for (vector<int>::iterator it = endlineTable.begin(); it != endlineTable.end(); ++it)
+  if (!lexer.peek().isName())
   {
-    if (*it > g)
-    {
-      out << "line: " << line << " char: " << (g - lastg - 1);
-      return;
-    }
-
-    lastg = *it;
-    line ++;
-  }
-
-  out << "line: " << line << " char: " << (g - lastg);
-}
-
-string SceneLoader::getString(istream & str)
-{
-  string ret;
-  char temp;
-  str >> temp; // get rid of white space, get to first char
-  str.putback(temp);
-
-  while (str.get(temp))
-  {
-    if ((temp >= 'a' && temp <= 'z')
-        || (temp >= 'A' && temp <= 'Z')
-        || (temp >= '0' && temp <= '9')
-        || (temp == '_'))
-    {
-      ret += temp;
-    }
-    else if (temp == '#')
-    {
-      string no;
-      getline(str, no);
-
-      if (ret.empty())
-        return getString(str);
-      else
-        return ret;
-    }
-    else
-    {
-      str.putback(temp);
-      break;
-    }
+    lexer.reject();
+    return string();
   }
 
-  return ret;
+  return lexer.next().str();
 }
 
-string SceneLoader::getQuoted(istream & str)
+string SceneLoader::getQuoted()
 {
-  string ret;
-  char temp;
-  str >> temp;
-
-  if (temp != '"')
+  if (lexer.peek().type != SceneToken::STRING)
   {
     *err << "expected opening \" at ";
-    curPos(*err, str.tellg());
+    curPos(*err, lexer.peek().offset);
     *err << endl;
+    return string();
   }
 
-  getline(str, ret, '"');
-  return ret;
+  return lexer.next().str();
 }
 
-bool SceneLoader::readCommand(istream & str, string & name)
+bool SceneLoader::readCommand(SceneToken & name)
 {
-  name = getString(str);
-
-  if (name.empty())
+  if (!lexer.peek().isName())
   {
+    lexer.reject();
     *err << "error: expected command but did not find one at ";
-    curPos(*err, str.tellg());
+    curPos(*err, lexer.peek().offset);
     *err << endl;
     return false;
   }
 
+  name = lexer.next();
   return true;
 }
 
-bool SceneLoader::findOpenParen(istream & str)
+bool SceneLoader::findOpenParen()
 {
-  char temp;
-  string line;
+  SceneToken t = lexer.next();
 
-  while (str >> temp)
-  {
-    if (temp == '(')
-      return true;
-    else if (temp == '#')
-      getline(str, line);
-    else
-    {
-      *err << "error: unexpected char " << temp << " at ";
-      curPos(*err, str.tellg());
-      *err << endl;
-      return false;
-    }
-  }
+  if (t.type == SceneToken::OPEN)
+    return true;
+  else if (t.type == SceneToken::END)
+    return false;
 
+  *err << "error: unexpected " << t.str() << " at ";
+  curPos(*err, t.offset);
+  *err << endl;
   return false;
 }
 
 enum { OPEN, CLOSED, ERROR };  // possible types of paren, used by the findOpenOrClosedParen function below
-int SceneLoader::findOpenOrClosedParen(istream & str)
+int SceneLoader::findOpenOrClosedParen()
 {
-  char temp;
-  string line;
+  SceneToken const & t = lexer.peek();
 
-  while (str >> temp)
+  if (t.type == SceneToken::OPEN)
   {
-    if (temp == '(')
-      return OPEN;
-    else if (temp == '#')
-      getline(str, line);
-    else if (temp == ')')
-    {
-      str.putback(temp);
-      return CLOSED;
-    }
-    else
-    {
-      *err << "error: unexpected char " << temp << " at ";
-      curPos(*err, str.tellg());
-      *err << endl;
-      return false;
-    }
+    lexer.next();
+    return OPEN;
   }
+  else if (t.type == SceneToken::CLOSE)
+    return CLOSED;
+  else if (t.type == SceneToken::END)
+    return ERROR;
 
+  *err << "error: unexpected " << t.str() << " at ";
+  curPos(*err, t.offset);
+  *err << endl;
   return ERROR;
 }
 
-bool SceneLoader::findCloseParen(istream & str)
+bool SceneLoader::findCloseParen()
 {
-  char temp;
-  string line;
   int close = 0;
 
-  while (str >> temp)
+  for (SceneToken::Type t = lexer.next().type; t != SceneToken::END; t = lexer.next().type)
   {
-    if (temp == '#')
-      getline(str, line);
-
-    if (temp == '(')
+    if (t == SceneToken::OPEN)
       close++;
-
-    if (temp == ')')
-      close--;
-
-    if (close < 0)
+    else if (t == SceneToken::CLOSE && --close < 0)
       return true;
   }
 
   return false;
 }
 
-int SceneLoader::getValues(istream & str, vector<ParametricValue *> & vals)
+int SceneLoader::getValues(vector<ParametricValue *> & vals)
 {
   ParametricValue * val;
 
-  while ( (val = getValue(str)) != NULL )
+  while ( (val = getValue()) != NULL )
   {
     vals.push_back(val);
   }
@@ -221,160 +131,141 @@ int SceneLoader::getValues(istream & str, vector<ParametricValue *> & vals)
   return int(vals.size());
 }
 
-ParametricValue * SceneLoader::getValue(istream & str)
+ParametricValue * SceneLoader::getValue()
 {
-  char temp;
-  str >> temp;
+  SceneToken const & t = lexer.peek();
 
-  if (temp == '{') // time-varying expression
+  if (t.type == SceneToken::EXPRESSION) // time-varying expression
   {
-    int start = str.tellg();
+    // drop comments, which run to the end of the line
     string expr;
-
-    while (str.get(temp))
+    for (size_t i = 0; i < t.length; ++i)
     {
-      if (temp == '}') // completed expr
+      if (t.text[i] == '#')
       {
-        ParametricValue * v = new ExprValue(expr.c_str());
-
-        if (!v->good())
-        {
-          *err << "Error: couldn't parse expression \"" << expr << "\" at ";
-          curPos(*err, str.tellg());
-          *err << endl;
-          delete v;
-          return NULL;
-        }
-        else
-        {
-          return v;
-        }
-      }
-      else if (temp == '#')
-      {
-        string no;
-        getline(str, no);
+        while (i + 1 < t.length && t.text[i + 1] != '\n')
+          ++i;
+        ++i;
       }
       else
-      {
-        expr += temp;
-      }
+        expr += t.text[i];
+    }
+
+    lexer.next();
+    ParametricValue * v = arena.create<ExprValue>(expr.c_str());
+
+    if (!v->good())
+    {
+      *err << "Error: couldn't parse expression \"" << expr << "\" at ";
+      curPos(*err, lexer.offset());
+      *err << endl;
+      return NULL;
     }
 
+    return v;
+  }
+  else if (t.type == SceneToken::UNTERMINATED)
+  {
     *err << "Error: No closing brace for expr at ";
-    curPos(*err, start);
+    curPos(*err, t.offset);
     *err << endl;
+    lexer.next();
     return NULL;
   }
-  else if (temp == ')')
+  else if (t.type == SceneToken::CLOSE || t.type == SceneToken::END)
   {
-    str.putback(temp);
+    lexer.reject();
     return NULL;
   }
-  else if (temp == '#')
+
+  double val;
+
+  if (!t.toDouble(val))
   {
-    string no;
-    getline(str, no);
-    return getValue(str);
+    *err << "Failed to extract a numeric value at ";
+    curPos(*err, t.offset);
+    *err << endl;
+    lexer.reject();
+    return NULL;
   }
-  else
-  {
-    str.putback(temp);
-    double val;
-    str.peek();
-    str >> val;
 
-    if (str.fail())
-    {
-      str.clear();
-      *err << "Failed to extract a numeric value at ";
-      curPos(*err, str.tellg());
-      *err << endl;
-      str.peek();
-      return NULL;
-    }
-    else
-    {
-      return new ConstValue(val);
-    }
-  }
+  lexer.next();
+  return arena.create<ConstValue>(val);
 }
 
-void SceneLoader::errLine(int at)
+void SceneLoader::errLine(size_t at)
 {
   curPos(*err, at);
   *err << endl;
 }
 
-void SceneLoader::cleanAfter(vector<ParametricValue *> & vals, unsigned int i)
+SceneInstance * SceneLoader::doI(string & name)
 {
-  for (; i < vals.size(); i++)
-  {
-    delete vals[i];
-  }
-}
-
-SceneInstance * SceneLoader::doI(istream & str, string & name)
-{
-  name = getString(str);
+  name = getString();
 
   if (name.empty())
   {
     *err << "Couldn't read instance name at ";
-    errLine(str.tellg());
+    errLine(lexer.offset());
     return NULL;
   }
 
-  string var = getString(str);
+  string var = getString();
 
-  if (groups[var] == NULL)
+  SceneGroup * child = groups.find(var.c_str());
+  if (child == NULL)
   {
     *err << "Instancing node " << var << " which doesn't exist yet at ";
-    curPos(*err, str.tellg());
+    curPos(*err, lexer.offset());
     *err << endl;
     return NULL;
   }
 
-  SceneInstance * n = new SceneInstance();
-  instances.push_back(n); //nodes[name] = n;
-  n->name_ = name;
-  n->child_ = groups[var];
+  SceneInstance * n = arena.create<SceneInstance>();
+  n->name_ = arena.copyString(name.c_str(), name.size());
+  n->child_ = child;
+
+  // instances are the bulk of large scenes, so the buffers for their values and transforms are kept from one to the next, and
+  // the transforms are copied out once, at their final size
+  SceneToken cmd;
+  vector<ParametricValue *> & values = instance_values;
+  instance_transforms.clear();
 
   do
   {
-    int state = findOpenOrClosedParen(str);
+    int state = findOpenOrClosedParen();
 
     if (state == ERROR)
       return NULL;
     else if (state == CLOSED)
+    {
+      n->transforms_.assign(instance_transforms.begin(), instance_transforms.end());
       return n;
+    }
     else if (state == OPEN)
     {
-      string cmd;
-      vector<ParametricValue *> values;
+      values.clear();
 
-      if (readCommand(str, cmd))
+      if (readCommand(cmd))
       {
         if (cmd == "R") // load rotations
         {
-          int numv = getValues(str, values);
+          int numv = getValues(values);
           Rotate * r = NULL;
 
           if (numv < 1)
           {
             *err << "R with no args at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else if (numv < 4)
           {
-            cleanAfter(values, 1);
-            r = new Rotate();
+            r = arena.create<Rotate>();
             r->angle = values[0];
           }
           else
           {
-            cleanAfter(values, 4);
-            r = new Rotate();
+            r = arena.create<Rotate>();
             r->angle = values[0];
 
             for (int i = 0; i < 3; i++)
@@ -382,109 +273,105 @@ SceneInstance * SceneLoader::doI(istream & str, string & name)
           }
 
           if (r != NULL)
-            n->transforms_.push_back(r);
+            instance_transforms.push_back(r);
         }
         else if (cmd == "Xform")
         {
-          int numv = getValues(str, values);
+          int numv = getValues(values);
           GeneralTransform * g = NULL;
 
           if (numv < 9)
           {
             *err << "Xform with too few parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else if (numv < 16)     // 2d
           {
-            cleanAfter(values, 9);
-            g = new GeneralTransform();
+            g = arena.create<GeneralTransform>();
 
             for (int i = 0; i < 9; i++)
               g->matrix.push_back(values[i]);
           }
           else
           {
-            cleanAfter(values, 16);
-            g = new GeneralTransform();
+            g = arena.create<GeneralTransform>();
 
             for (int i = 0; i < 16; i++)
               g->matrix.push_back(values[i]);
           }
 
           if (g != NULL)
-            n->transforms_.push_back(g);
+            instance_transforms.push_back(g);
         }
         else if (cmd == "T")
         {
-          int numv = getValues(str, values);
+          int numv = getValues(values);
           Translate * t = NULL;
 
           if (numv < 2)
           {
             *err << "T with too few parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else if (numv == 2)
           {
-            t = new Translate();
+            t = arena.create<Translate>();
 
             for (int i = 0; i < 2; i++)
               t->translate[i] = values[i];
           }
           else
           {
-            cleanAfter(values, 3);
-            t = new Translate();
+            t = arena.create<Translate>();
 
             for (int i = 0; i < 3; i++)
               t->translate[i] = values[i];
           }
 
           if (t != NULL)
-            n->transforms_.push_back(t);
+            instance_transforms.push_back(t);
         }
         else if (cmd == "S")
         {
-          int numv = getValues(str, values);
+          int numv = getValues(values);
           Scale * s = NULL;
 
           if (numv < 2)
           {
             *err << "S with too few parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else if (numv == 2)
           {
-            s = new Scale();
+            s = arena.create<Scale>();
 
             for (int i = 0; i < 2; i++)
               s->scale[i] = values[i];
           }
           else
           {
-            s = new Scale();
+            s = arena.create<Scale>();
 
             for (int i = 0; i < 3; i++)
               s->scale[i] = values[i];
           }
 
           if (s != NULL)
-            n->transforms_.push_back(s);
+            instance_transforms.push_back(s);
         }
         else if (cmd == "color")
         {
-          int numv = getValues(str, values);
+          int numv = getValues(values);
           ParametricColor * c = NULL;
 
           if (numv < 3)
           {
             *err << "color with too few parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 3);
-            c = new ParametricColor();
+            c = arena.create<ParametricColor>();
 
             for (int i = 0; i < 3; i++)
               c->color_[i] = values[i];
@@ -495,19 +382,18 @@ SceneInstance * SceneLoader::doI(istream & str, string & name)
         }
         else if (cmd == "lod")
         {
-          int numv = getValues(str, values);
+          int numv = getValues(values);
           LOD * l = NULL;
 
           if (numv < 1)
           {
             *err << "lod with no parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
             //cout << "got lod" << endl;
-            cleanAfter(values, 1);
-            l = new LOD();
+            l = arena.create<LOD>();
             l->level_ = values[0];
           }
 
@@ -517,32 +403,32 @@ SceneInstance * SceneLoader::doI(istream & str, string & name)
         else
         {
           *err << "Error: command " << cmd << " not recognized at ";
-          curPos(*err, str.tellg());
+          curPos(*err, lexer.offset());
           *err << endl;
         }
 
-        findCloseParen(str);
+        findCloseParen();
       }
     }
   }
   while (true);
 }
 
-bool SceneLoader::getName(istream & str, string type, string & name)
+bool SceneLoader::getName(string type, string & name)
 {
-  name = getString(str);
+  name = getString();
 
   if (name.empty())
   {
     *err << "Couldn't read " << type << " name at ";
-    errLine(str.tellg());
+    errLine(lexer.offset());
     return false;
   }
 
-  if (groups[name] != NULL)
+  if (groups.find(name.c_str()) != NULL)
   {
     *err << "Illegal re-use of name \"" << name << "\" at ";
-    errLine(str.tellg());
+    errLine(lexer.offset());
     return false;
   }
 
@@ -553,34 +439,34 @@ void SceneLoader::setMaterialDefaults(ParametricMaterial * n)
 {
   if (n->RGB_ == NULL)
   {
-    n->RGB_ = new ParametricColor();
-    n->RGB_->color_[0] = new ConstValue(0);
-    n->RGB_->color_[1] = new ConstValue(0);
-    n->RGB_->color_[2] = new ConstValue(0);
+    n->RGB_ = arena.create<ParametricColor>();
+    n->RGB_->color_[0] = arena.create<ConstValue>(0);
+    n->RGB_->color_[1] = arena.create<ConstValue>(0);
+    n->RGB_->color_[2] = arena.create<ConstValue>(0);
   }
 
   for (int i = 0; i < 7; i++)
   {
     if (n->coefficients_[i] == NULL)
-      n->coefficients_[i] = new ConstValue(0);
+      n->coefficients_[i] = arena.create<ConstValue>(0);
   }
 }
 
-bool SceneLoader::doMaterial(istream & str, string & name)
+bool SceneLoader::doMaterial(string & name)
 {
-  name = getString(str);
+  name = getString();
 
   if (name.empty())
   {
     *err << "Couldn't read material name at ";
-    errLine(str.tellg());
+    errLine(lexer.offset());
     return false;
   }
 
-  if (materials[name] != NULL)
+  if (materials.find(name.c_str()) != NULL)
   {
     *err << "Illegal re-use of name \"" << name << "\" at ";
-    errLine(str.tellg());
+    errLine(lexer.offset());
     return false;
   }
 
@@ -592,12 +478,12 @@ bool SceneLoader::doMaterial(istream & str, string & name)
   indices["msm"] = MAT_MSM;
   indices["mt"] = MAT_MT;
   indices["mtn"] = MAT_MTN;
-  ParametricMaterial * n = new ParametricMaterial();
-  materials[name] = n;
+  ParametricMaterial * n = arena.create<ParametricMaterial>();
+  materials.insert(arena, name.c_str(), n);
 
   do
   {
-    int state = findOpenOrClosedParen(str);
+    int state = findOpenOrClosedParen();
 
     if (state == ERROR)
     {
@@ -611,47 +497,45 @@ bool SceneLoader::doMaterial(istream & str, string & name)
     }
     else if (state == OPEN)
     {
-      string cmd;
+      SceneToken cmd;
       vector<ParametricValue *> values;
 
-      if (readCommand(str, cmd))
+      if (readCommand(cmd))
       {
         if (cmd == "color")
         {
-          if (getValues(str, values) < 3)
+          if (getValues(values) < 3)
           {
             *err << "Color with insufficent parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 3);
-            n->RGB_ = new ParametricColor();
+            n->RGB_ = arena.create<ParametricColor>();
 
             for (int ci = 0; ci < 3; ci++)
               n->RGB_->color_[ci] = values[ci];
           }
         }
-        else if (indices.find(cmd) != indices.end())
+        else if (indices.find(cmd.str()) != indices.end())
         {
-          if (getValues(str, values) < 1)
+          if (getValues(values) < 1)
           {
             *err << cmd << " with no parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 1);
-            n->coefficients_[indices[cmd]] = values[0];
+            n->coefficients_[indices[cmd.str()]] = values[0];
           }
         }
         else
         {
           *err << "Error: command " << cmd << " not recognized at ";
-          errLine(str.tellg());
+          errLine(lexer.offset());
         }
 
-        findCloseParen(str);
+        findCloseParen();
       }
     }
   }
@@ -662,37 +546,36 @@ void SceneLoader::setSphereDefaults(SceneGroup * n)
 {
   if (n->sphere_->material_ == NULL)
   {
-    n->sphere_->material_ = new ParametricMaterial();
+    n->sphere_->material_ = arena.create<ParametricMaterial>();
     setMaterialDefaults(n->sphere_->material_);
   }
 
   if (n->sphere_->radius_ == NULL)
   {
-    n->sphere_->radius_ = new ConstValue(1);
+    n->sphere_->radius_ = arena.create<ConstValue>(1);
   }
 }
 
 // no obj includes in as5; they come back in as6
-bool SceneLoader::doInclude(istream & str, string & name)
+bool SceneLoader::doInclude(string & name)
 {
-  if (!getName(str, "include", name))
+  if (!getName("include", name))
     return false;
 
-  SceneGroup * n = new SceneGroup();
-  groups[name] = n;
-  n->name_ = name;
-  string file = getQuoted(str);
-  n->mesh_ = new TriangleMesh(file);
+  SceneGroup * n = arena.create<SceneGroup>();
+  n->name_ = groups.insert(arena, name.c_str(), n);
+  string file = getQuoted();
+  n->mesh_ = arena.create<TriangleMesh>(file);
 
   do
   {
-    int state = findOpenOrClosedParen(str);
+    int state = findOpenOrClosedParen();
 
     if (state == ERROR)
     {
       if (n->meshMaterial_ == NULL)
       {
-        n->meshMaterial_ = new ParametricMaterial();
+        n->meshMaterial_ = arena.create<ParametricMaterial>();
         setMaterialDefaults(n->meshMaterial_);
       }
 
@@ -702,7 +585,7 @@ bool SceneLoader::doInclude(istream & str, string & name)
     {
       if (n->meshMaterial_ == NULL)
       {
-        n->meshMaterial_ = new ParametricMaterial();
+        n->meshMaterial_ = arena.create<ParametricMaterial>();
         setMaterialDefaults(n->meshMaterial_);
       }
 
@@ -710,55 +593,54 @@ bool SceneLoader::doInclude(istream & str, string & name)
     }
     else if (state == OPEN)
     {
-      string cmd;
+      SceneToken cmd;
 
-      if (readCommand(str, cmd))
+      if (readCommand(cmd))
       {
         if (cmd == "material")
         {
-          string matName = getString(str);
+          string matName = getString();
 
           if (matName.empty())
           {
             *err << "No material name after material command at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
-          else if (materials[matName] == NULL)
+          else if (materials.find(matName.c_str()) == NULL)
           {
             *err << "Unknown material " << matName << " referenced at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            n->meshMaterial_ = materials[matName];
+            n->meshMaterial_ = materials.find(matName.c_str());
           }
         }
         else
         {
           *err << "Error: command " << cmd << " not recognized at ";
-          errLine(str.tellg());
+          errLine(lexer.offset());
         }
 
-        findCloseParen(str);
+        findCloseParen();
       }
     }
   }
   while (true);
 }
 
-bool SceneLoader::doSphere(istream & str, string & name)
+bool SceneLoader::doSphere(string & name)
 {
-  if (!getName(str, "sphere", name))
+  if (!getName("sphere", name))
     return false;
 
-  SceneGroup * n = new SceneGroup();
-  groups[name] = n;
-  n->name_ = name;
-  n->sphere_ = new ParametricSphere();
+  SceneGroup * n = arena.create<SceneGroup>();
+  n->name_ = groups.insert(arena, name.c_str(), n);
+  n->sphere_ = arena.create<ParametricSphere>();
 
   do
   {
-    int state = findOpenOrClosedParen(str);
+    int state = findOpenOrClosedParen();
 
     if (state == ERROR)
     {
@@ -772,50 +654,49 @@ bool SceneLoader::doSphere(istream & str, string & name)
     }
     else if (state == OPEN)
     {
-      string cmd;
+      SceneToken cmd;
       vector<ParametricValue *> values;
 
-      if (readCommand(str, cmd))
+      if (readCommand(cmd))
       {
         if (cmd == "radius")
         {
-          if (getValues(str, values) < 1)
+          if (getValues(values) < 1)
           {
             *err << "Type with no parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 1);
             n->sphere_->radius_ = values[0];
           }
         }
         else if (cmd == "material")
         {
-          string matName = getString(str);
+          string matName = getString();
 
           if (matName.empty())
           {
             *err << "No material name after material command at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
-          else if (materials[matName] == NULL)
+          else if (materials.find(matName.c_str()) == NULL)
           {
             *err << "Unknown material " << matName << " referenced at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            n->sphere_->material_ = materials[matName];
+            n->sphere_->material_ = materials.find(matName.c_str());
           }
         }
         else
         {
           *err << "Error: command " << cmd << " not recognized at ";
-          errLine(str.tellg());
+          errLine(lexer.offset());
         }
 
-        findCloseParen(str);
+        findCloseParen();
       }
     }
   }
@@ -826,43 +707,46 @@ void SceneLoader::setLightDefaults(SceneGroup * n)
 {
   // set default values for unset variables
   if (n->light_->angularFalloff_ == NULL)
-    n->light_->angularFalloff_ = new ConstValue(0);
+    n->light_->angularFalloff_ = arena.create<ConstValue>(0);
 
   if (n->light_->color_ == NULL)
   {
-    n->light_->color_ = new ParametricColor();
-    n->light_->color_->color_[0] = new ConstValue(0);
-    n->light_->color_->color_[1] = new ConstValue(0);
-    n->light_->color_->color_[2] = new ConstValue(0);
+    n->light_->color_ = arena.create<ParametricColor>();
+    n->light_->color_->color_[0] = arena.create<ConstValue>(0);
+    n->light_->color_->color_[1] = arena.create<ConstValue>(0);
+    n->light_->color_->color_[2] = arena.create<ConstValue>(0);
   }
 
   if (n->light_->deadDistance_ == NULL)
-    n->light_->deadDistance_ = new ConstValue(.1);
+    n->light_->deadDistance_ = arena.create<ConstValue>(.1);
 
   if (n->light_->falloff_ == NULL)
-    n->light_->falloff_ = new ConstValue(0);
+    n->light_->falloff_ = arena.create<ConstValue>(0);
 
   // default value for side is zero
   if (n->light_->side_ == NULL)
-    n->light_->side_ = new ConstValue(0);
+    n->light_->side_ = arena.create<ConstValue>(0);
+
+  // zero samples selects the renderer's default
+  if (n->light_->samples_ == NULL)
+    n->light_->samples_ = arena.create<ConstValue>(0);
 
   if (n->light_->type_ == NULL)
-    n->light_->type_ = new ConstValue(LIGHT_AMBIENT);
+    n->light_->type_ = arena.create<ConstValue>(LIGHT_AMBIENT);
 }
 
-bool SceneLoader::doLight(istream & str, string & name)
+bool SceneLoader::doLight(string & name)
 {
-  if (!getName(str, "light", name))
+  if (!getName("light", name))
     return false;
 
-  SceneGroup * n = new SceneGroup();
-  groups[name] = n;
-  n->name_ = name;
-  n->light_ = new ParametricLight();
+  SceneGroup * n = arena.create<SceneGroup>();
+  n->name_ = groups.insert(arena, name.c_str(), n);
+  n->light_ = arena.create<ParametricLight>();
 
   do
   {
-    int state = findOpenOrClosedParen(str);
+    int state = findOpenOrClosedParen();
 
     if (state == ERROR)
     {
@@ -876,88 +760,94 @@ bool SceneLoader::doLight(istream & str, string & name)
     }
     else if (state == OPEN)
     {
-      string cmd;
+      SceneToken cmd;
       vector<ParametricValue *> values;
 
-      if (readCommand(str, cmd))
+      if (readCommand(cmd))
       {
         if (cmd == "type")
         {
-          if (getValues(str, values) < 1)
+          if (getValues(values) < 1)
           {
             *err << "Type with no parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 1);
             n->light_->type_ = values[0];
           }
         }
         else if (cmd == "falloff")
         {
-          if (getValues(str, values) < 1)
+          if (getValues(values) < 1)
           {
             *err << "Falloff with no parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 1);
             n->light_->falloff_ = values[0];
           }
         }
         else if (cmd == "deaddistance")
         {
-          if (getValues(str, values) < 1)
+          if (getValues(values) < 1)
           {
             *err << "deaddistance with no parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 1);
             n->light_->deadDistance_ = values[0];
           }
         }
         // add parsing functionality for side attribute of area light
         else if (cmd == "side")
         {
-          if (getValues(str, values) < 1)
+          if (getValues(values) < 1)
           {
             *err << "Side with no parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 1);
             n->light_->side_ = values[0];
           }
         }
+        else if (cmd == "samples")
+        {
+          if (getValues(values) < 1)
+          {
+            *err << "Samples with no parameters at ";
+            errLine(lexer.offset());
+          }
+          else
+          {
+            n->light_->samples_ = values[0];
+          }
+        }
         else if (cmd == "angularfalloff")
         {
-          if (getValues(str, values) < 1)
+          if (getValues(values) < 1)
           {
             *err << "angularfalloff with no parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 1);
             n->light_->angularFalloff_ = values[0];
           }
         }
         else if (cmd == "color")
         {
-          if (getValues(str, values) < 3)
+          if (getValues(values) < 3)
           {
             *err << "color with insufficient parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 3);
-            n->light_->color_ = new ParametricColor();
+            n->light_->color_ = arena.create<ParametricColor>();
             n->light_->color_->color_[0] = values[0];
             n->light_->color_->color_[1] = values[1];
             n->light_->color_->color_[2] = values[2];
@@ -966,10 +856,10 @@ bool SceneLoader::doLight(istream & str, string & name)
         else
         {
           *err << "Error: command " << cmd << " not recognized at ";
-          errLine(str.tellg());
+          errLine(lexer.offset());
         }
 
-        findCloseParen(str);
+        findCloseParen();
       }
     }
   }
@@ -979,41 +869,40 @@ bool SceneLoader::doLight(istream & str, string & name)
 void SceneLoader::setCameraDefaults(SceneGroup * n)
 {
   if (n->camera_->perspective_ == NULL)
-    n->camera_->perspective_ = new ConstValue(1); // default perspective to 1
+    n->camera_->perspective_ = arena.create<ConstValue>(1); // default perspective to 1
 
   // set default values for the frustum
   if (n->camera_->frustum_[0] == NULL)
-    n->camera_->frustum_[0] = new ConstValue(-0.33);
+    n->camera_->frustum_[0] = arena.create<ConstValue>(-0.33);
 
   if (n->camera_->frustum_[1] == NULL)
-    n->camera_->frustum_[1] = new ConstValue(+0.33);
+    n->camera_->frustum_[1] = arena.create<ConstValue>(+0.33);
 
   if (n->camera_->frustum_[2] == NULL)
-    n->camera_->frustum_[2] = new ConstValue(-0.33);
+    n->camera_->frustum_[2] = arena.create<ConstValue>(-0.33);
 
   if (n->camera_->frustum_[3] == NULL)
-    n->camera_->frustum_[3] = new ConstValue(+0.33);
+    n->camera_->frustum_[3] = arena.create<ConstValue>(+0.33);
 
   if (n->camera_->frustum_[4] == NULL)
-    n->camera_->frustum_[4] = new ConstValue(-1);
+    n->camera_->frustum_[4] = arena.create<ConstValue>(-1);
 
   if (n->camera_->frustum_[5] == NULL)
-    n->camera_->frustum_[5] = new ConstValue(-100);
+    n->camera_->frustum_[5] = arena.create<ConstValue>(-100);
 }
 
-bool SceneLoader::doCamera(istream & str, string & name)
+bool SceneLoader::doCamera(string & name)
 {
-  if (!getName(str, "camera", name))
+  if (!getName("camera", name))
     return false;
 
-  SceneGroup * n = new SceneGroup();
-  groups[name] = n;
-  n->name_ = name;
-  n->camera_ = new ParametricCamera();
+  SceneGroup * n = arena.create<SceneGroup>();
+  n->name_ = groups.insert(arena, name.c_str(), n);
+  n->camera_ = arena.create<ParametricCamera>();
 
   do
   {
-    int state = findOpenOrClosedParen(str);
+    int state = findOpenOrClosedParen();
 
     if (state == ERROR)
     {
@@ -1027,78 +916,75 @@ bool SceneLoader::doCamera(istream & str, string & name)
     }
     else if (state == OPEN)
     {
-      string cmd;
+      SceneToken cmd;
       vector<ParametricValue *> values;
       string sides = "lrbtnf";
       int side = 0;
 
-      if (readCommand(str, cmd))
+      if (readCommand(cmd))
       {
         if (cmd == "perspective")
         {
-          if (getValues(str, values) < 1)
+          if (getValues(values) < 1)
           {
             *err << "Perspective with no parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 1);
             n->camera_->perspective_ = values[0];
           }
         }
-        else if (cmd.size() == 1 && (side = (int)sides.find(cmd)) != string::npos)
+        else if (cmd.length == 1 && (side = (int)sides.find(cmd.text[0])) != string::npos)
         {
-          if (getValues(str, values) < 1)
+          if (getValues(values) < 1)
           {
             *err << "l with no parameters at ";
-            errLine(str.tellg());
+            errLine(lexer.offset());
           }
           else
           {
-            cleanAfter(values, 1);
             n->camera_->frustum_[side] = values[0];
           }
         }
         else
         {
           *err << "Error: command " << cmd << " not recognized at ";
-          errLine(str.tellg());
+          errLine(lexer.offset());
         }
 
-        findCloseParen(str);
+        findCloseParen();
       }
     }
   }
   while (true);
 }
 
-bool SceneLoader::doG(istream & str, string & name)
+bool SceneLoader::doG(string & name)
 {
-  name = getString(str);
+  name = getString();
 
   if (name.empty())
   {
     *err << "Couldn't read group name at ";
-    errLine(str.tellg());
+    errLine(lexer.offset());
     return false;
   }
 
-  if (groups[name] != NULL)
+  if (groups.find(name.c_str()) != NULL)
   {
     *err << "Illegal re-use of group name \"" << name << "\" at ";
-    curPos(*err, str.tellg());
+    curPos(*err, lexer.offset());
     *err << endl;
     return false;
   }
 
-  SceneGroup * n = new SceneGroup();
-  groups[name] = n;
-  n->name_ = name;
+  SceneGroup * n = arena.create<SceneGroup>();
+  n->name_ = groups.insert(arena, name.c_str(), n);
 
   do
   {
-    int state = findOpenOrClosedParen(str);
+    int state = findOpenOrClosedParen();
 
     if (state == ERROR)
       return false;
@@ -1106,26 +992,26 @@ bool SceneLoader::doG(istream & str, string & name)
       return true;
     else if (state == OPEN)
     {
-      string cmd;
+      SceneToken cmd;
 
-      if (readCommand(str, cmd))
+      if (readCommand(cmd))
       {
         if (cmd != "I")
         {
           *err << "Command other than I from G at ";
-          curPos(*err, str.tellg());
+          curPos(*err, lexer.offset());
           *err << endl;
         }
 
         string iname;
         SceneInstance * newNode;
 
-        if ((newNode = doI(str, iname)) != NULL)
+        if ((newNode = doI(iname)) != NULL)
         {
           n->children_.push_back( newNode );
         }
 
-        findCloseParen(str);
+        findCloseParen();
       }
     }
   }
@@ -1133,55 +1019,57 @@ bool SceneLoader::doG(istream & str, string & name)
 }
 
 
-bool SceneLoader::doRender(istream & str, string & name)
+bool SceneLoader::doRender(string & name)
 {
-  name = getString(str);
+  name = getString();
 
   if (name.empty())
   {
     *err << "Trying to render group without specifying a name at ";
-    curPos(*err, str.tellg());
+    curPos(*err, lexer.offset());
     *err << endl;
     return false;
   }
 
-  if (groups[name] == NULL)
+  SceneGroup * group = groups.find(name.c_str());
+  if (group == NULL)
   {
     *err << "Trying to render group not found \"" << name << "\" at ";
-    curPos(*err, str.tellg());
+    curPos(*err, lexer.offset());
     *err << endl;
     return false;
   }
 
-  root->child_ = groups[name];
+  root->child_ = group;
   return true;
 }
 
 bool SceneLoader::buildScene(string filename)
 {
-  buildEndlineTable(filename);
-  ifstream file(filename.c_str());
-  string line;
-  int lastPos = 0;
-
-  while (findOpenParen(file))
+  if (!lexer.open(filename))
   {
-    file.tellg();
+    *err << "Couldn't read scene file " << filename << endl;
+    return false;
+  }
+
+  SceneToken line;
 
-    if (readCommand(file, line))
+  while (findOpenParen())
+  {
+    if (readCommand(line))
     {
       if (line == "Include")
       {
         string instName;
 
-        if (doInclude(file, instName))
+        if (doInclude(instName))
         {
           cout << "included " << instName << endl;
         }
         else
         {
           cout << "mangled include at ";
-          curPos(cout, file.tellg());
+          curPos(cout, lexer.offset());
           cout << endl;
         }
       }
@@ -1189,64 +1077,64 @@ bool SceneLoader::buildScene(string filename)
       {
         string gname;
 
-        if (doSphere(file, gname))
+        if (doSphere(gname))
         {
           cout << "read sphere " << gname << endl;
         }
         else
         {
           *err << "mangled sphere command at ";
-          errLine(file.tellg());
+          errLine(lexer.offset());
         }
       }
       else if (line == "Material")
       {
         string gname;
 
-        if (doMaterial(file, gname))
+        if (doMaterial(gname))
         {
           cout << "read material " << gname << endl;
         }
         else
         {
           *err << "mangled material command at ";
-          errLine(file.tellg());
+          errLine(lexer.offset());
         }
       }
       else if (line == "Light")
       {
         string gname;
 
-        if (doLight(file, gname))
+        if (doLight(gname))
         {
           cout << "read light " << gname << endl;
         }
         else
         {
           *err << "mangled light command at ";
-          errLine(file.tellg());
+          errLine(lexer.offset());
         }
       }
       else if (line == "Camera")
       {
         string gname;
 
-        if (doCamera(file, gname))
+        if (doCamera(gname))
         {
           cout << "read camera " << gname << endl;
         }
         else
         {
           *err << "mangled camera command at ";
-          errLine(file.tellg());
+          errLine(lexer.offset());
         }
       }
       else if (line == "I")
       {
         *err << "Error: Instance commands must belong to a group, but I found in global scope at ";
-        errLine(file.tellg());
+        errLine(lexer.offset());
         /*string iname; // code to handle I at global scope (doesn't make much sense now that instance names skip the names table)
-        if (doI(file, iname))
+        if (doI(iname))
         {
             cout << "got an instance named " << iname << endl;
         }*/
@@ -1255,7 +1143,7 @@ bool SceneLoader::buildScene(string filename)
       {
         string iname;
 
-        if (doG(file, iname))
+        if (doG(iname))
         {
           cout << "got a group named " << iname << endl;
         }
@@ -1264,7 +1152,7 @@ bool SceneLoader::buildScene(string filename)
       {
         string iname;
 
-        if (doRender(file, iname))
+        if (doRender(iname))
         {
           cout << "did render " << iname << endl;
         }
@@ -1274,13 +1162,8 @@ bool SceneLoader::buildScene(string filename)
         *err << "command not recognized: " << line << endl;
       }
 
-      findCloseParen(file);
+      findCloseParen();
     }
-    else
-    {
-    }
-
-    lastPos = file.tellg();
   }
 
   return true;
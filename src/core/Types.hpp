@@ -11,8 +11,10 @@
 
 #include "Algebra3.hpp"
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <limits>
+#include <stdint.h>
 
 /** Colors. */
 enum
@@ -64,6 +66,7 @@ class Ray
     // Special functions
 
     void transform(Mat4 const & xf);
+    void transform(Affine3 const & xf);
     Vec3 getPos(double t) const;
 
     // Accessor functions
@@ -172,6 +175,93 @@ class RGB
     friend std::ostream & operator <<(std::ostream & s, RGB const & v); // output to stream
 };
 
+/****************************************************************
+ *                                                              *
+ *             Single-precision vector                          *
+ *                                                              *
+ ****************************************************************/
+
+/**
+ * A 3-vector of floats, for geometry that is stored and intersected in single precision. Half the size of a Vec3, so twice as
+ * many fit in a cache line or a SIMD register.
+ */
+class Vec3f
+{
+  public:
+
+    float x, y, z;
+
+    // Constructors
+
+    Vec3f();
+    Vec3f(float x_, float y_, float z_);
+    explicit Vec3f(Vec3 const & v);
+
+    // Special functions
+
+    Vec3 toVec3() const;
+    float operator[](int i) const; // read-only indexing
+
+    // Friends
+
+    friend Vec3f operator +(Vec3f const & a, Vec3f const & b); // v1 + v2
+    friend Vec3f operator -(Vec3f const & a, Vec3f const & b); // v1 - v2
+    friend Vec3f operator *(Vec3f const & a, float d); // v1 * 3.0
+    friend float operator *(Vec3f const & a, Vec3f const & b); // dot product
+    friend Vec3f operator ^(Vec3f const & a, Vec3f const & b); // cross product
+};
+
+/**
+ * A ray in single precision, packed into 32 bytes so that queues of rays stay small and two rays fill a cache line. It carries
+ * only what intersection tests need: the origin, the direction, the largest hit time still of interest, and a sign mask of the
+ * direction (bit i set if component i is negative) that orders slab tests and sorts rays by octant. See Ray for the full ray.
+ */
+class Rayf
+{
+  public:
+
+    Vec3f org;
+    float t_max;
+    Vec3f dir;
+    uint32_t sign_mask;
+
+    // Constructors
+
+    Rayf();
+    explicit Rayf(Ray const & r);
+
+    // Special functions
+
+    /** Get the reciprocal of the direction, for slab tests. Zero components give infinities of the matching sign. */
+    Vec3f inverseDirection() const;
+};
+
+/**
+ * The nearest hit found so far along a Rayf: hit time, index of the primitive hit, and the element hit within that primitive,
+ * for primitives that group several shapes (0 otherwise). 12 bytes.
+ */
+struct Hitf
+{
+  static uint32_t const NONE = 0xffffffffu;  // value of prim when nothing has been hit
+
+  float t;
+  uint32_t prim;
+  uint32_t element;
+
+  /** Start a search for the nearest hit along \a ray. */
+  explicit Hitf(Rayf const & ray) : t(ray.t_max), prim(NONE), element(0) {}
+  Hitf() {}
+};
+
+/**
+ * Offset a ray origin \a p on a surface along the surface normal \a n (pointing to the side the ray leaves from), far enough
+ * that the ray cannot hit the same surface again through floating point error in the single-precision intersection tests, but
+ * no further. The offset is a fixed number of float ulps of each coordinate, and a fixed absolute distance for coordinates near
+ * zero where ulps become tiny: Waechter and Binder, "A Fast and Robust Method for Avoiding Self-Intersection", Ray Tracing
+ * Gems (2019).
+ */
+Vec3 offsetRayOrigin(Vec3 const & p, Vec3 const & n);
+
 /****************************************************************
  *                                                              *
  *             Material                                         *
@@ -253,6 +343,12 @@ inline void Ray::transform(Mat4 const & xf)
   d_ = Vec3(xf * Vec4(d_, 0.0), 3);  // drop the homogeneous coordinate instead of dividing by zero
 }
 
+inline void Ray::transform(Affine3 const & xf)
+{
+  e_ = xf.transformPoint(e_);
+  d_ = xf.transformVector(d_);
+}
+
 inline Vec3 Ray::getPos(double t) const
 {
   Vec3 p = e_ + t * d_;
@@ -590,4 +686,112 @@ inline double Material::getMTN() const
   return p_[MTN];
 }
 
+/****************************************************************
+ *                                                              *
+ *          Vec3f Member functions                              *
+ *                                                              *
+ ****************************************************************/
+
+inline Vec3f::Vec3f()
+{
+}
+
+inline Vec3f::Vec3f(float x_, float y_, float z_)
+: x(x_), y(y_), z(z_)
+{
+}
+
+inline Vec3f::Vec3f(Vec3 const & v)
+: x((float)v[0]), y((float)v[1]), z((float)v[2])
+{
+}
+
+inline Vec3 Vec3f::toVec3() const
+{
+  return Vec3(x, y, z);
+}
+
+inline float Vec3f::operator [](int i) const
+{
+  assert(! (i < 0 || i > 2));
+  return i == 0 ? x : (i == 1 ? y : z);
+}
+
+// FRIENDS
+
+inline Vec3f operator +(Vec3f const & a, Vec3f const & b)
+{
+  return Vec3f(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+inline Vec3f operator -(Vec3f const & a, Vec3f const & b)
+{
+  return Vec3f(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+inline Vec3f operator *(Vec3f const & a, float d)
+{
+  return Vec3f(a.x * d, a.y * d, a.z * d);
+}
+
+inline float operator *(Vec3f const & a, Vec3f const & b)
+{
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Vec3f operator ^(Vec3f const & a, Vec3f const & b)
+{
+  return Vec3f(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+
+/****************************************************************
+ *                                                              *
+ *          Rayf Member functions                               *
+ *                                                              *
+ ****************************************************************/
+
+inline Rayf::Rayf()
+{
+}
+
+inline Rayf::Rayf(Ray const & r)
+: org(r.start()), t_max((float)r.minT()), dir(r.direction())
+{
+  sign_mask = (dir.x < 0 ? 1u : 0u) | (dir.y < 0 ? 2u : 0u) | (dir.z < 0 ? 4u : 0u);
+}
+
+inline Vec3f Rayf::inverseDirection() const
+{
+  return Vec3f(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+}
+
+inline Vec3 offsetRayOrigin(Vec3 const & p, Vec3 const & n)
+{
+  static float const ORIGIN = 1.0f / 32.0f;         // below this, offset by a fixed distance
+  static float const FLOAT_SCALE = 1.0f / 65536.0f; // fixed distance per unit of normal
+  static float const INT_SCALE = 256.0f;            // ulps per unit of normal
+
+  Vec3 result;
+  for (int i = 0; i < 3; ++i)
+  {
+    float pf = (float)p[i];
+    float nf = (float)n[i];
+    if (std::fabs(pf) < ORIGIN)
+    {
+      result[i] = pf + FLOAT_SCALE * nf;
+      continue;
+    }
+
+    // step the float's bit pattern, which moves it by whole ulps whatever its magnitude
+    int32_t ulps = (int32_t)(INT_SCALE * nf);
+    int32_t bits;
+    std::memcpy(&bits, &pf, sizeof(bits));
+    bits += (pf < 0) ? -ulps : ulps;
+    std::memcpy(&pf, &bits, sizeof(pf));
+    result[i] = pf;
+  }
+  return result;
+}
+
 #endif  // __Types_hpp__
@@ -3,7 +3,13 @@
 #include "World.hpp"
 #include "Frame.hpp"
 #include "Lights.hpp"
+#include "OccluderCache.hpp"
+#include "Sampler.hpp"
 #include "core/Scene.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
 
 using namespace std;
 
@@ -17,58 +23,174 @@ View * view = NULL;
 Mat4 viewToWorld = identity3D();
 Frame * frame = NULL;
 int max_trace_depth = 2;
+int image_width = IMAGE_WIDTH;
+int image_height = IMAGE_HEIGHT;
+int rays_per_pixel_edge = RAYS_PER_PIXEL_EDGE;
+unsigned int render_seed = 0;
+int area_light_samples = 0;  // overrides the per-light sample count if positive
+int light_picks = 0;  // lights picked from the light tree per shading point, 0 to shade every light
+bool use_occluder_cache = false;
+unsigned long occluder_cache_lookups = 0;
+unsigned long occluder_cache_hits = 0;
+Sampler * sampler = NULL;
+double light_cull_epsilon = 0;
+bool light_roulette = false;
+double path_cutoff = 0;
+bool path_roulette = false;
+bool use_wavefront = false;
+bool fresnel_split = false;
+
+// Get the largest channel of a colour.
+double
+maxComponent(RGB const & c)
+{
+	return std::max(c[0], std::max(c[1], c[2]));
+}
+
+// Get the weight to keep a contribution of the given strength with: 0 drops it. Contributions at or above the cutoff are kept
+// as they are; weaker ones are dropped or, with roulette, kept with probability strength/cutoff and scaled up to match.
+double
+cutoffWeight(double strength, double cutoff, bool roulette, Sampler & sampler)
+{
+	if(strength <= 0)
+		return 0;
+	if(strength >= cutoff)
+		return 1;
+	if(!roulette)
+		return 0;
+	double survival = strength / cutoff;
+	return sampler.get1D() < survival ? 1 / survival : 0;
+}
+
+// A shadow ray whose test is put off, so that the shadow rays of a whole wavefront level can be traced as one batch: the light
+// sample's contribution to \a pixel if nothing blocks the ray.
+struct DeferredShadow
+{
+  Rayf ray;
+  RGB contribution;
+  Light const * light;
+  int pixel;
+};
+
+// Get the Phong shading due to a single light, testing each of its samples for shadows. If an occluder cache is given, the
+// primitive that last blocked this light is tested first. The unshadowed contribution of each sample is computed before its
+// shadow ray is traced, so samples that cannot add anything (facing away, or fallen off to nothing) cost no ray, and samples
+// weaker than light_cull_epsilon are either dropped or, with light_roulette, kept with probability proportional to their
+// strength and reweighted so the estimate stays unbiased. If \a deferred is given, the shadow rays are not traced but queued
+// on it with their contributions, which are left out of the result.
+RGB
+getLightContribution(Light const & light, Vec3 const & pos, Vec3 const & normal, Vec3 const & viewingDir,
+                     Material const & objectMaterial, RGB const & objectColor, RGB const & materialS, Sampler & sampler,
+                     OccluderCache * occluders, std::vector<DeferredShadow> * deferred = NULL)
+{
+	// Fixed buffer rather than a vector, so shading makes no heap allocations
+	LightSample lightSamples[Light::MAX_SAMPLES];
+	Vec3 shadowOrigin = offsetRayOrigin(pos, normal);
+	RGB totalColorObject(0,0,0);
+
+	int numSamples = light.sample(pos,sampler,lightSamples);
+
+	// For area lights, we cannot average the phong colours from every sampled point
+	// since more light is coming at the point; neither can we add all the light since
+	// the image becomes too bright; we try to achieve a tradeoff by
+	// introducing this factor, see Light::getSampleWeight
+	double sampleWeight = light.getSampleWeight(numSamples);
+
+	for(int j=0; j<numSamples; j++){
+		LightSample const & ls = lightSamples[j];
+
+		RGB lambertianColorObject = objectMaterial.getML()*objectColor*ls.radiance*std::max(normal*ls.direction,0.0);
+		Vec3 reflectDir = -ls.direction + 2*(ls.direction*normal)*normal;
+		reflectDir.normalize();
+		RGB specularColorObject = objectMaterial.getMS()*materialS*ls.radiance*std::pow(std::max(-reflectDir*viewingDir,0.0),objectMaterial.getMSP());
+		RGB contribution = (lambertianColorObject + specularColorObject)*sampleWeight;
+
+		double weight = cutoffWeight(maxComponent(contribution), light_cull_epsilon, light_roulette, sampler);
+		if(weight == 0)
+			continue;
+		contribution *= weight;
+
+		Ray shadow = ls.shadowRay(shadowOrigin);
+		if(deferred != NULL){
+			DeferredShadow d;
+			d.ray = Rayf(shadow);
+			d.contribution = contribution;
+			d.light = &light;
+			d.pixel = 0;
+			deferred->push_back(d);
+			continue;
+		}
 
-// Get the shaded appearance of the primitive at a given position, as seen along a ray. The returned value should be the sum of
+		bool inShadow;
+		if(occluders != NULL){
+			Occluder & occluder = occluders->slot(&light);
+			Occluder cached = occluder;
+			inShadow = (*world).occluded(shadow, &occluder);
+			occluders->count(inShadow && cached.prim != NULL && occluder.prim == cached.prim && occluder.element == cached.element);
+		}
+		else{
+			inShadow = (*world).occluded(shadow);
+		}
+		if(!inShadow)
+			totalColorObject += contribution;
+	}
+
+	return totalColorObject;
+}
+
+// Get the shaded appearance of an element of the primitive at a given position, as seen along a ray. The returned value should be the sum of
 // the shaded colors w.r.t. each light in the scene. DO NOT include the result of recursive raytracing in this function, just
-// use the ambient-diffuse-specular formula. DO include testing for shadows, individually for each light.
+// use the ambient-diffuse-specular formula. DO include testing for shadows, individually for each light, unless \a deferred
+// is given, which queues the shadow rays instead as getLightContribution() does.
 RGB
-getShadedColor(Primitive const & primitive, Vec3 const & pos, Ray const & ray)
+getShadedColor(Primitive const & primitive, uint32_t element, Vec3 const & pos, Ray const & ray, Sampler & sampler,
+               OccluderCache * occluders, std::vector<DeferredShadow> * deferred = NULL)
 {
-  Material objectMaterial = primitive.getMaterial();
-  	RGB objectColor = primitive.getColor();
+  MaterialTable const & materials = world->getMaterials();
+  uint32_t materialIndex = primitive.getMaterialIndex(element);
+  Material const & objectMaterial = materials.getMaterial(materialIndex);
+  	RGB const & objectColor = materials.getColor(materialIndex);
   	RGB materialS = objectMaterial.getMSM()*objectColor + (1 - objectMaterial.getMSM())*RGB(1,1,1);
   	RGB totalColorObject = objectMaterial.getMA()*objectColor*(*world).getAmbientLightColor();
 
-  	Vec3 normal = primitive.calculateNormal(pos);
+  	Vec3 normal = primitive.calculateNormal(pos, element);
   	Vec3 viewingDir = ray.direction(); viewingDir.normalize();
 
-	for(World::LightConstIterator i = world->lightsBegin(); i != world->lightsEnd(); ++i){
-
-		bool isPointSource;
-		int seed = rand()%100000;
-		(*(*i)).setSeed(seed);
-		std::vector<Ray> shadow = (*(*i)).getShadowRay(pos+0.0001*normal,isPointSource);
-		std::vector<Vec3> lightDir = (*(*i)).getIncidenceVector(pos);
-		srand(time(NULL));
-
-		for(unsigned int j=0; j<shadow.size(); j++){
-			Primitive* shadowObject = (*world).intersect(shadow[j]);
-      // if shadow ray not intersects with anything
-			if(shadowObject == NULL){
-        // For area lights, we cannot average the phong colours from every sampled point
-        // since more light is coming at the point; neither can we add all the light since
-        // the image becomes too bright; we try to achieve a tradeoff by
-        // introducing this factor
-
-				RGB lightColor = (*(*i)).getColor(lightDir[j]); lightDir[j].normalize();
-				RGB lambertianColorObject = objectMaterial.getML()*objectColor*lightColor*std::max(normal*lightDir[j],0.0);
-				totalColorObject += lambertianColorObject/std::pow(shadow.size(),0.90);
-
-				Vec3 reflectDir = -lightDir[j] + 2*(lightDir[j]*normal)*normal;
-				reflectDir.normalize();
-				RGB specularColorObject = objectMaterial.getMS()*materialS*lightColor*std::pow(std::max(-reflectDir*viewingDir,0.0),objectMaterial.getMSP());
-				totalColorObject += specularColorObject/std::pow(shadow.size(),0.90);
-			}
+	LightTree const & tree = world->getLightTree();
+	if(light_picks <= 0 || tree.numLights() <= light_picks){
+		for(World::LightConstIterator i = world->lightsBegin(); i != world->lightsEnd(); ++i){
+			totalColorObject += getLightContribution(**i, pos, normal, viewingDir, objectMaterial, objectColor, materialS, sampler, occluders, deferred);
+		}
+		return totalColorObject;
+	}
+
+	// Too many lights to shade them all: lights without a position are always shaded, the rest are picked from the light tree
+	// in proportion to their estimated contribution and weighted by the probability of picking them
+	for(World::LightConstIterator i = world->unboundedLightsBegin(); i != world->unboundedLightsEnd(); ++i){
+		totalColorObject += getLightContribution(**i, pos, normal, viewingDir, objectMaterial, objectColor, materialS, sampler, occluders, deferred);
+	}
+
+	for(int k=0; k<light_picks; k++){
+		double pmf;
+		Light const * light = tree.sample(pos, sampler.get1D(), pmf);
+		size_t firstDeferred = deferred != NULL ? deferred->size() : 0;
+		RGB c = getLightContribution(*light, pos, normal, viewingDir, objectMaterial, objectColor, materialS, sampler, occluders, deferred);
+		totalColorObject += c/(pmf*light_picks);
+		for(size_t d = firstDeferred; deferred != NULL && d < deferred->size(); d++){
+			(*deferred)[d].contribution = (*deferred)[d].contribution/(pmf*light_picks);
 		}
 	}
 
   return totalColorObject;
 }
 
-// Raytrace a single ray backwards into the scene, calculating the total color (summed up over all reflections/refractions) seen
-// along this ray.
-RGB
-traceRay(Ray & ray, int depth)
+// Generate the rays bouncing off element \a element of \a object where \a ray hit it at \a hitPosition: the reflected ray first, if the ray is in air,
+// and then the refracted ray, unless it is totally internally reflected. Each bounce's colour is to be scaled by the matching
+// entry of \a weights. \a reflectance is set to Schlick's approximation of the Fresnel reflectance of the surface, if it
+// refracts. Returns the number of bounces, at most 2.
+int
+generateBounces(Ray const & ray, Primitive const & object, uint32_t element, Vec3 const & hitPosition, Ray * bounces,
+                RGB * weights, double & reflectance)
 {
   // Assumptions:
   // Refractive index of the space between objects is 1; we will call it air
@@ -77,88 +199,477 @@ traceRay(Ray & ray, int depth)
   // This is because we assume reflectivity of air to be 0
   // There is some air present between any two objects
 
-  if (depth > max_trace_depth)
-    return RGB(0, 0, 0);
+	MaterialTable const & materials = world->getMaterials();
+	uint32_t materialIndex = object.getMaterialIndex(element);
+	Material const & objectMaterial = materials.getMaterial(materialIndex);
+	RGB const & objectColor = materials.getColor(materialIndex);
+	int numBounces = 0;
+
+	Vec3 primitiveHitNormal = object.calculateNormal(hitPosition, element);
+  // if ray is present inside an object that i.e. it is refracted, the normal will be negative
+  if(ray.isRefracted()){ primitiveHitNormal = -primitiveHitNormal; }
+	Vec3 viewingDir = ray.direction(); viewingDir.normalize();
+
+	/** if ray present in air */
+	if(!ray.isRefracted()){
+    // generate a reflected ray
+		Vec3 bounceDir = viewingDir - 2*(viewingDir*primitiveHitNormal)*primitiveHitNormal;
+		Vec3 bouncePos = offsetRayOrigin(hitPosition, primitiveHitNormal);
+		bounces[numBounces] = Ray::fromOriginAndDirection(bouncePos,bounceDir);
+		bounces[numBounces].setRefracted(ray.isRefracted()); bounces[numBounces].setEta(ray.getEta());
+		weights[numBounces++] = objectMaterial.getMR()*objectColor;
+	}
 
-  Primitive* object = (*world).intersect(ray);
+	// generate refracted ray
+	double cosTheta1 = -viewingDir*primitiveHitNormal;
+	double eta1 = ray.getEta(), eta2;
+	if(ray.isRefracted()){ eta2 = 1; } // if ray inside object, it must refract into air
+	else{
+		eta2 = objectMaterial.getMTN();
+	}
+	double sinTheta2sq = (eta1/eta2)*(eta1/eta2)*(1 - cosTheta1*cosTheta1);
+	if(sinTheta2sq < 1){
+		double cosTheta2 = std::sqrt(1 - sinTheta2sq);
+		Vec3 refrDir = (eta1/eta2)*viewingDir + ((eta1/eta2)*cosTheta1 - cosTheta2)*primitiveHitNormal;
+		Vec3 refrPos = offsetRayOrigin(hitPosition, -primitiveHitNormal);
+		bounces[numBounces] = Ray::fromOriginAndDirection(refrPos,refrDir);
+		bounces[numBounces].setRefracted(!ray.isRefracted()); bounces[numBounces].setEta(eta2);
+		weights[numBounces++] = objectMaterial.getMT()*objectColor;
+
+		double r0 = (eta1 - eta2)/(eta1 + eta2);
+		r0 *= r0;
+		double c = 1 - (eta1 <= eta2 ? cosTheta1 : cosTheta2);
+		reflectance = r0 + (1 - r0)*c*c*c*c*c;
+	}
+	else{
+		reflectance = 1;
+	}
 
-  if(object != NULL){
-  	Material objectMaterial = (*object).getMaterial();
-  	RGB objectColor = (*object).getColor();
-  	Vec3 primitiveHitPosition = ray.start() + ray.direction()*ray.minT();
-		RGB totalColor = getShadedColor(*object, primitiveHitPosition, ray);
-		RGB reflectedColor = RGB(0,0,0);
-		RGB refractedColor = RGB(0,0,0);
+	return numBounces;
 
-		Vec3 primitiveHitNormal = (*object).calculateNormal(primitiveHitPosition);
-    // if ray is present inside an object that i.e. it is refracted, the normal will be negative
-    if(ray.isRefracted()){ primitiveHitNormal = -primitiveHitNormal; }
-  	Vec3 viewingDir = ray.direction(); viewingDir.normalize();
+  // Bounce rays start slightly off the surface they bounce from, see offsetRayOrigin(), so that they are not occluded by their
+  // own surface.
+}
 
-		/** if ray present in air */
-		if(!ray.isRefracted()){
-      // generate a reflected ray
-			Vec3 bounceDir = viewingDir - 2*(viewingDir*primitiveHitNormal)*primitiveHitNormal;
-  		Vec3 bouncePos = primitiveHitPosition + 0.0001*primitiveHitNormal;
-  		Ray bounceRay = Ray::fromOriginAndDirection(bouncePos,bounceDir);
-			bounceRay.setRefracted(ray.isRefracted()); bounceRay.setEta(ray.getEta());
-			reflectedColor = objectMaterial.getMR()*objectColor*traceRay(bounceRay,depth+1);
-		}
+// With fresnel_split, reduce a reflected and a refracted bounce to one of the two, so that each hit spawns at most one ray and
+// the number of rays grows linearly rather than exponentially with depth. Reflection is picked with probability proportional to
+// its weight times the Fresnel \a reflectance, against the refraction weight times the transmittance, clamped to [0.1, 0.9] so
+// that neither branch is starved; the chosen weight is divided by its probability, so on average the image is the same as
+// tracing both. Returns the number of bounces left.
+int
+splitBounces(Ray * bounces, RGB * weights, int numBounces, double reflectance, Sampler & sampler)
+{
+	if(!fresnel_split || numBounces < 2)
+		return numBounces;
 
-		// generate refracted ray
-		double cosTheta1 = -viewingDir*primitiveHitNormal;
-		double eta1 = ray.getEta(), eta2;
-		if(ray.isRefracted()){ eta2 = 1; } // if ray inside object, it must refract into air
-		else{
-			eta2 = objectMaterial.getMTN();
-		}
-		double sinTheta2sq = (eta1/eta2)*(eta1/eta2)*(1 - cosTheta1*cosTheta1);
-		if(sinTheta2sq < 1){
-			double cosTheta2 = std::sqrt(1 - sinTheta2sq);
-			Vec3 refrDir = (eta1/eta2)*viewingDir + ((eta1/eta2)*cosTheta1 - cosTheta2)*primitiveHitNormal;
-  		Vec3 refrPos = primitiveHitPosition - 0.0001*primitiveHitNormal;
-  		Ray refrRay = Ray::fromOriginAndDirection(refrPos,refrDir);
-			refrRay.setRefracted(!ray.isRefracted()); refrRay.setEta(eta2);
-			refractedColor = objectMaterial.getMT()*objectColor*traceRay(refrRay,depth+1);
+	double reflected = maxComponent(weights[0])*reflectance;
+	double refracted = maxComponent(weights[1])*(1 - reflectance);
+	if(reflected <= 0 || refracted <= 0)
+		return numBounces;  // at most one of them will be traced anyway
+
+	double p = std::min(std::max(reflected/(reflected + refracted), 0.1), 0.9);
+	if(sampler.get1D() < p){
+		weights[0] *= 1/p;
+	}
+	else{
+		bounces[0] = bounces[1];
+		weights[0] = weights[1]*(1/(1 - p));
+	}
+	return 1;
+}
+
+// A ray waiting to be traced: \a throughput is the factor its colour is scaled by on the way back to the eye.
+struct PendingRay
+{
+  Ray ray;
+  int depth;
+  RGB throughput;
+};
+
+// Each traced ray pushes at most two bounces and pops itself, so the stack never holds more than max_trace_depth + 2 rays.
+int const MAX_RAY_STACK = 64;
+int const MAX_TRACE_DEPTH = MAX_RAY_STACK - 2;
+
+// Raytrace a single ray backwards into the scene, calculating the total color (summed up over all reflections/refractions) seen
+// along this ray. Bounces are kept on a fixed-size stack rather than traced by recursion, each carrying its path throughput;
+// bounces whose throughput falls below path_cutoff are dropped, or with path_roulette continued by Russian roulette, and
+// bounces that cannot contribute at all are never traced. The reflected bounce is traced before the refracted one, so samples
+// are drawn in the same order as a depth-first recursion would.
+RGB
+traceRay(Ray const & primaryRay, Sampler & sampler, OccluderCache * occluders)
+{
+  PendingRay stack[MAX_RAY_STACK];
+  int stackSize = 0;
+  RGB totalColor(0,0,0);
+
+  stack[stackSize].ray = primaryRay;
+  stack[stackSize].depth = 0;
+  stack[stackSize].throughput = RGB(1,1,1);
+  stackSize++;
+
+  while(stackSize > 0){
+    PendingRay & pending = stack[--stackSize];
+    Ray ray = pending.ray;
+    int depth = pending.depth;
+    RGB throughput = pending.throughput;
+
+    if(depth > 0){
+      double survival = cutoffWeight(maxComponent(throughput), path_cutoff, path_roulette, sampler);
+      if(survival == 0)
+        continue;
+      throughput *= survival;
+    }
+
+    uint32_t element;
+    Primitive* object = (*world).intersect(ray, element);
+    if(object == NULL)
+      continue;
+
+  	Vec3 primitiveHitPosition = ray.start() + ray.direction()*ray.minT();
+		totalColor += throughput*getShadedColor(*object, element, primitiveHitPosition, ray, sampler, occluders);
+
+		if(depth == max_trace_depth)
+			continue;
+
+		// push in reverse, so the reflected bounce is traced first
+		Ray bounces[2];
+		RGB weights[2];
+		double reflectance;
+		int numBounces = generateBounces(ray, *object, element, primitiveHitPosition, bounces, weights, reflectance);
+		numBounces = splitBounces(bounces, weights, numBounces, reflectance, sampler);
+		for(int b = numBounces - 1; b >= 0; b--){
+			PendingRay & bounce = stack[stackSize++];
+			bounce.ray = bounces[b];
+			bounce.depth = depth+1;
+			bounce.throughput = throughput*weights[b];
 		}
+  }
+
+  return totalColor;
+}
+
+// A ray in a wavefront, with the pixel sample it belongs to and the sampler dimension its shading starts at.
+struct WavefrontRay
+{
+  Ray ray;
+  RGB throughput;
+  int pixel;             // index of the pixel within the tile
+  int sample_index;
+  uint32_t dimension;
+};
+
+// Number of image rows whose rays are traced together as one wavefront.
+int const WAVEFRONT_ROWS = 8;
+
+// Width in pixels of the tiles a band's camera rays are generated in, so that runs of them cover small, nearly square patches
+// of the view.
+int const WAVEFRONT_TILE_WIDTH = 4;
+
+// The second bounce off a hit draws its samples from this far along, so that it does not reuse those of the first bounce.
+uint32_t const BOUNCE_DIMENSION_OFFSET = 1u << 16;
+
+// Spread the low 10 bits of \a v out to every third bit, for a Morton code.
+uint64_t
+spreadBits10(uint32_t v)
+{
+  uint64_t x = v & 0x3ff;
+  x = (x | (x << 16)) & 0x30000ffull;
+  x = (x | (x << 8)) & 0x300f00full;
+  x = (x | (x << 4)) & 0x30c30c3ull;
+  x = (x | (x << 2)) & 0x9249249ull;
+  return x;
+}
+
+// Sort a wavefront so that rays heading into the same octant are together, and within an octant rays are in Morton order of
+// their origins. Neighbouring rays then visit the same primitives in the same order. Ties keep their order, so the result is
+// deterministic. The keys are sorted with the index of each ray, which is then moved once, through \a scratch.
+void
+sortWavefront(std::vector<WavefrontRay> & queue, std::vector<WavefrontRay> & scratch,
+              std::vector< std::pair<uint64_t, int> > & keys)
+{
+  if (queue.empty())
+    return;
+
+  Vec3 lo = queue[0].ray.start(), hi = lo;
+  for (size_t i = 1; i < queue.size(); ++i)
+  {
+    Vec3 const & e = queue[i].ray.start();
+    for (int a = 0; a < 3; ++a)
+    {
+      lo[a] = std::min(lo[a], e[a]);
+      hi[a] = std::max(hi[a], e[a]);
+    }
+  }
+
+  keys.resize(queue.size());
+  for (size_t i = 0; i < queue.size(); ++i)
+  {
+    Vec3 const & e = queue[i].ray.start();
+    Vec3 const & d = queue[i].ray.direction();
+    uint64_t octant = (d[0] < 0 ? 4 : 0) | (d[1] < 0 ? 2 : 0) | (d[2] < 0 ? 1 : 0);
+    uint64_t morton = 0;
+    for (int a = 0; a < 3; ++a)
+    {
+      double extent = hi[a] - lo[a];
+      uint32_t q = extent > 0 ? (uint32_t)std::min((e[a] - lo[a]) / extent * 1024.0, 1023.0) : 0;
+      morton |= spreadBits10(q) << (2 - a);
+    }
+    keys[i] = std::make_pair((octant << 30) | morton, (int)i);
+  }
 
-  	return totalColor + reflectedColor + refractedColor;
+  std::sort(keys.begin(), keys.end());
+  scratch.resize(queue.size());
+  for (size_t i = 0; i < queue.size(); ++i)
+    scratch[i] = queue[keys[i].second];
+  queue.swap(scratch);
+}
+
+// The shadow rays a wavefront level defers, with space for tracing them as one batch.
+struct ShadowBatch
+{
+  std::vector<DeferredShadow> queue;
+  std::vector<int> group;      // by index into the queue: the ray's light, numbered in order of appearance, and octant
+  std::vector<int> start;      // first place in the order of each group
+  std::vector<int> order;      // indices into the queue, in the order the rays are traced
+  std::vector<Rayf> rays;
+  std::vector<Hitf> hits;
+  std::vector<char> blocked;   // by index into the queue
+  std::unordered_map<Light const *, int> lights;
+};
+
+// Trace the shadow rays queued on \a batch as one batch and add the contributions of those that nothing blocks to \a colors,
+// then empty the queue. Rays towards the same light and into the same octant are traced together, in queue order, so that
+// neighbouring rays are coherent, but contributions are added in queue order, so the image does not depend on that grouping.
+void
+traceShadowBatch(ShadowBatch & batch, std::vector<RGB> & colors)
+{
+  int const n = (int)batch.queue.size();
+  if (n == 0)
+    return;
+
+  // counting sort by group; the samples of a light come in runs, so most rays need no lookup of their light
+  batch.lights.clear();
+  batch.group.resize(n);
+  Light const * last = NULL;
+  int light = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    DeferredShadow const & d = batch.queue[i];
+    if (d.light != last)
+    {
+      last = d.light;
+      light = batch.lights.insert(std::make_pair(last, (int)batch.lights.size())).first->second;
+    }
+    batch.group[i] = 8 * light + (int)d.ray.sign_mask;
   }
 
-  return RGB(0,0,0);
+  batch.start.assign(8 * batch.lights.size() + 1, 0);
+  for (int i = 0; i < n; ++i)
+    ++batch.start[batch.group[i] + 1];
+  for (size_t g = 1; g < batch.start.size(); ++g)
+    batch.start[g] += batch.start[g - 1];
 
-  // Use the "world" global variable to access the primitives in the input file.
-  //  IMPORTANT:
-  //  Please start all bounce rays at a small non-zero t value such as 0.001 - this has the effect of slightly offsetting
-  //  bounce rays from the surface they're bouncing from, and prevents bounce rays from being occluded by their own surface.
+  batch.order.resize(n);
+  for (int i = 0; i < n; ++i)
+    batch.order[batch.start[batch.group[i]]++] = i;
+
+  batch.rays.resize(n);
+  batch.hits.resize(n);
+  for (int i = 0; i < n; ++i)
+    batch.rays[i] = batch.queue[batch.order[i]].ray;
+  world->occluded(&batch.rays[0], &batch.hits[0], n);
+
+  batch.blocked.resize(n);
+  for (int i = 0; i < n; ++i)
+    batch.blocked[batch.order[i]] = batch.hits[i].prim != Hitf::NONE;
+
+  for (int i = 0; i < n; ++i)
+  {
+    if (!batch.blocked[i])
+      colors[batch.queue[i].pixel] += batch.queue[i].contribution;
+  }
+
+  batch.queue.clear();
 }
 
-// Main rendering loop.
+// Main rendering loop. Rows are shared out between threads; each thread owns a clone of the sampler, and since the sampler is
+// keyed by pixel and ray index the image does not depend on the number of threads.
 void
 renderWithRaytracing()
 {
-  Sample sample;   // Point on the view being sampled.
-  Ray ray;         // Ray being traced from the eye through the point.
-  RGB c;           // Color being accumulated per pixel.
+  int const rpp = view->raysPerPixel();
 
+#pragma omp parallel
+  {
+    Sample sample;   // Point on the view being sampled.
+    Ray ray;         // Ray being traced from the eye through the point.
+    RGB c;           // Color being accumulated per pixel.
+    Sampler * threadSampler = sampler->clone();
+    OccluderCache * threadOccluders = use_occluder_cache ? new OccluderCache() : NULL;
+
+#pragma omp for schedule(dynamic)
+    for (int yi = 0; yi < view->height(); ++yi)
+    {
+      for (int xi = 0; xi < view->width(); ++xi)
+      {
+        c = RGB(0, 0, 0);
+        for (int ri = 0; ri < rpp; ++ri)
+        {
+          threadSampler->startPixelSample(xi, yi, ri);
+          view->getSample(xi, yi, ri, sample, *threadSampler);
+          ray = view->createViewingRay(sample);  // convert the 2d sample position to a 3d ray
+          ray.transform(viewToWorld);            // transform this to world space
+          c += traceRay(ray, *threadSampler, threadOccluders);
+        }
+
+        frame->setColor(xi, yi, c / (double)rpp);
+      }
+    }
+
+    if (threadOccluders != NULL)
+    {
+#pragma omp critical
+      {
+        occluder_cache_lookups += threadOccluders->lookups();
+        occluder_cache_hits += threadOccluders->hits();
+      }
+      delete threadOccluders;
+    }
+
+    delete threadSampler;
+  }
+}
+
+// Wavefront rendering loop. Instead of following each camera ray's bounces depth-first, all the rays of a band of rows are traced
+// breadth-first: each bounce level forms a queue, which is sorted by direction and origin and intersected with the world as one
+// batch, and whose hits produce the next level's queue. Shading a level queues its shadow rays, which are then traced as one
+// batch too, so the occluder cache is not used. Every ray carries its pixel sample and sampler dimension, so shading draws the
+// same kind of samples as in the depth-first loop and the image still does not depend on the number of threads.
+void
+renderWavefront()
+{
   int const rpp = view->raysPerPixel();
+  int const width = view->width();
+  int const numBands = (view->height() + WAVEFRONT_ROWS - 1) / WAVEFRONT_ROWS;
 
-  for (int yi = 0; yi < view->height(); ++yi)
+#pragma omp parallel
   {
-    for (int xi = 0; xi < view->width(); ++xi)
+    Sample sample;
+    Sampler * threadSampler = sampler->clone();
+    std::vector<WavefrontRay> queue, next, scratch;
+    std::vector< std::pair<uint64_t, int> > keys;
+    std::vector<Rayf> rays;
+    std::vector<Hitf> hits;
+    std::vector<RGB> colors;
+    ShadowBatch shadows;
+
+#pragma omp for schedule(dynamic)
+    for (int band = 0; band < numBands; ++band)
     {
-      c = RGB(0, 0, 0);
-      for (int ri = 0; ri < rpp; ++ri)
+      int const y0 = band * WAVEFRONT_ROWS;
+      int const y1 = std::min(y0 + WAVEFRONT_ROWS, view->height());
+      colors.assign((y1 - y0) * width, RGB(0, 0, 0));
+
+      queue.clear();
+      for (int x0 = 0; x0 < width; x0 += WAVEFRONT_TILE_WIDTH)
+      {
+        for (int yi = y0; yi < y1; ++yi)
+        {
+          for (int xi = x0; xi < std::min(x0 + WAVEFRONT_TILE_WIDTH, width); ++xi)
+          {
+            int const pixel = (yi - y0) * width + xi;
+            for (int ri = 0; ri < rpp; ++ri)
+            {
+              threadSampler->startPixelSample(xi, yi, ri);
+              view->getSample(xi, yi, ri, sample, *threadSampler);
+
+              WavefrontRay primary;
+              primary.ray = view->createViewingRay(sample);
+              primary.ray.transform(viewToWorld);
+              primary.throughput = RGB(1, 1, 1);
+              primary.pixel = pixel;
+              primary.sample_index = ri;
+              primary.dimension = threadSampler->dimension();
+              queue.push_back(primary);
+            }
+          }
+        }
+      }
+
+      // camera rays all leave the eye, and are already coherent in tile order; bounces are sorted
+      for (int depth = 0; !queue.empty(); ++depth)
       {
-        view->getSample(xi, yi, ri, sample);
-        ray = view->createViewingRay(sample);  // convert the 2d sample position to a 3d ray
-        ray.transform(viewToWorld);            // transform this to world space
-        c += traceRay(ray, 0);
+        if (depth > 0)
+          sortWavefront(queue, scratch, keys);
+
+        int const n = (int)queue.size();
+        rays.resize(n);
+        hits.resize(n);
+        for (int i = 0; i < n; ++i)
+          rays[i] = Rayf(queue[i].ray);
+        world->intersect(&rays[0], &hits[0], n);
+
+        next.clear();
+        for (int i = 0; i < n; ++i)
+        {
+          if (hits[i].prim == Hitf::NONE)
+            continue;
+
+          WavefrontRay & w = queue[i];
+          Ray & ray = w.ray;
+          ray.setMinT(hits[i].t);
+          Primitive const * object = world->getPrimitive(hits[i].prim);
+          threadSampler->startPixelSample(w.pixel % width, y0 + w.pixel / width, w.sample_index);
+          threadSampler->setDimension(w.dimension);
+
+          Vec3 hitPosition = ray.start() + ray.direction() * ray.minT();
+          size_t firstShadow = shadows.queue.size();
+          colors[w.pixel] += w.throughput * getShadedColor(*object, hits[i].element, hitPosition, ray, *threadSampler, NULL,
+                                                           &shadows.queue);
+          for (size_t s = firstShadow; s < shadows.queue.size(); ++s)
+          {
+            shadows.queue[s].contribution = w.throughput * shadows.queue[s].contribution;
+            shadows.queue[s].pixel = w.pixel;
+          }
+
+          if (depth == max_trace_depth)
+            continue;
+
+          // one dimension for the choice of bounce and one for each bounce's roulette decision, then each bounce gets its own
+          // run of dimensions
+          Ray bounces[2];
+          RGB weights[2];
+          double reflectance;
+          int numBounces = generateBounces(ray, *object, hits[i].element, hitPosition, bounces, weights, reflectance);
+          uint32_t base = threadSampler->dimension();
+          numBounces = splitBounces(bounces, weights, numBounces, reflectance, *threadSampler);
+          for (int b = 0; b < numBounces; ++b)
+          {
+            threadSampler->setDimension(base + 1 + b);
+            RGB throughput = w.throughput * weights[b];
+            double survival = cutoffWeight(maxComponent(throughput), path_cutoff, path_roulette, *threadSampler);
+            if (survival == 0)
+              continue;
+
+            WavefrontRay bounce;
+            bounce.ray = bounces[b];
+            bounce.throughput = throughput * survival;
+            bounce.pixel = w.pixel;
+            bounce.sample_index = w.sample_index;
+            bounce.dimension = base + 3 + b * BOUNCE_DIMENSION_OFFSET;
+            next.push_back(bounce);
+          }
+        }
+
+        traceShadowBatch(shadows, colors);
+        queue.swap(next);
       }
 
-      frame->setColor(sample, c / (double)rpp);
-			// std::cout << xi << " " << yi << std::endl;
-  	}
+      for (int pixel = 0; pixel < (int)colors.size(); ++pixel)
+        frame->setColor(pixel % width, y0 + pixel / width, colors[pixel] / (double)rpp);
+    }
+
+    delete threadSampler;
   }
 }
 
@@ -201,7 +712,7 @@ importSceneToWorld(SceneInstance * inst, Mat4 localToWorld, int time)
     Vec3 UL(f.sides[FRUS_LEFT], f.sides[FRUS_TOP], -f.sides[FRUS_NEAR]);
     Vec3 LR(f.sides[FRUS_RIGHT], f.sides[FRUS_BOTTOM], -f.sides[FRUS_NEAR]);
     Vec3 UR(f.sides[FRUS_RIGHT], f.sides[FRUS_TOP], -f.sides[FRUS_NEAR]);
-    view = new View(eye, LL, UL, LR, UR, IMAGE_WIDTH, IMAGE_HEIGHT, RAYS_PER_PIXEL_EDGE);
+    view = new View(eye, LL, UL, LR, UR, image_width, image_height, rays_per_pixel_edge);
   }
 
   LightInfo l;
@@ -234,6 +745,7 @@ importSceneToWorld(SceneInstance * inst, Mat4 localToWorld, int time)
       li->setPosition(localToWorld * pos);
 			// std::cout << l.side << std::endl;
 			li->setSide(l.side);
+			li->setSamples(area_light_samples > 0 ? area_light_samples : l.samples);
       world->addLight(li);
 		}
     else if (l.type == LIGHT_SPOT)
@@ -248,8 +760,18 @@ importSceneToWorld(SceneInstance * inst, Mat4 localToWorld, int time)
   if (g->computeSphere(r, m, time))
   {
     Material mat(m.k[0], m.k[1], m.k[2], m.k[3], m.k[4], m.k[MAT_MS], m.k[5], m.k[6]);
-    Sphere * sph = new Sphere(r, m.color, mat, localToWorld);
-    world->addPrimitive(sph);
+    uint32_t material = world->addMaterial(m.color, mat);
+
+    // spheres that stay spheres in world space are packed into sphere sets; the rest need the general transform
+    Affine3 xf(localToWorld);
+    double scale;
+    if (xf.isSimilarity(scale))
+      world->addSphere(xf.transformPoint(Vec3(0, 0, 0)), r * scale, material);
+    else
+    {
+      Sphere * sph = new Sphere(r, material, localToWorld);
+      world->addPrimitive(sph);
+    }
   }
 
   TriangleMesh * t;
@@ -257,6 +779,7 @@ importSceneToWorld(SceneInstance * inst, Mat4 localToWorld, int time)
   if (g->computeMesh(t, m, time))
   {
     Material mat(m.k[0], m.k[1], m.k[2], m.k[3], m.k[4], m.k[MAT_MS], m.k[5], m.k[6]);
+    uint32_t material = world->addMaterial(m.color, mat);
 
     for (vector<MeshTriangle *>::iterator it = t->triangles.begin(); it != t->triangles.end(); ++it)
     {
@@ -264,7 +787,7 @@ importSceneToWorld(SceneInstance * inst, Mat4 localToWorld, int time)
         t->vertices[ (**it).ind[0] ]->pos,
         t->vertices[ (**it).ind[1] ]->pos,
         t->vertices[ (**it).ind[2] ]->pos,
-        m.color, mat, localToWorld);
+        material, localToWorld);
       world->addPrimitive(tri);
 			world->trianglesUpdate(tri);
     }
@@ -274,17 +797,103 @@ importSceneToWorld(SceneInstance * inst, Mat4 localToWorld, int time)
   std::cout << "Imported scene file" << std::endl;
 }
 
+void
+printUsage(char const * prog)
+{
+  std::cout << "Usage: " << prog << " scene.scd output.png [max_trace_depth] [options]" << std::endl
+            << "Options:" << std::endl
+            << "  -size <w> <h>       output resolution (default " << IMAGE_WIDTH << " " << IMAGE_HEIGHT << ")" << std::endl
+            << "  -rpp <n>            rays per pixel edge (default " << RAYS_PER_PIXEL_EDGE << ")" << std::endl
+            << "  -seed <n>           seed for the sampler; images are identical for any thread count (default 0)" << std::endl
+            << "  -light-samples <n>  shadow rays per area light evaluation, overriding the scene (default "
+            << AreaLightSquare::DEFAULT_SAMPLES << ")" << std::endl
+            << "  -light-picks <n>    shade n lights per hit, chosen by importance, when there are more (default all)"
+            << std::endl
+            << "  -shadow-cache       test the last occluder of each light first when tracing shadow rays" << std::endl
+            << "  -light-cull <eps>   skip shadow rays for light samples contributing less than eps (default 0)" << std::endl
+            << "  -light-roulette     trace weak light samples with probability proportional to their strength instead"
+            << std::endl
+            << "  -path-cutoff <t>    stop reflection/refraction paths whose throughput falls below t (default 0)" << std::endl
+            << "  -path-roulette      continue weak paths by Russian roulette instead of stopping them" << std::endl
+            << "  -fresnel-split      follow either the reflection or the refraction at each hit, chosen by Fresnel weight"
+            << std::endl
+            << "  -wavefront          trace each bounce of a band of rows as one sorted batch instead of ray by ray" << std::endl
+            << "  -sampler <name>     random, stratified, halton, sobol or bluenoise (default sobol)" << std::endl
+            << "  -accel <name>       spatial index over the primitives: none, bvh4, bvh8 or cbvh (default bvh8)" << std::endl
+            << "  -split-budget <f>   let spatial splits reference up to f times more primitives in the index; 0 disables them"
+            << " (default 0.3)" << std::endl;
+}
+
 int
 main(int argc, char ** argv)
 {
   if (argc < 3)
   {
-    std::cout << "Usage: " << argv[0] << " scene.scd output.png [max_trace_depth]" << std::endl;
+    printUsage(argv[0]);
+    return -1;
+  }
+
+  std::string sampler_name = "sobol";
+  std::string accelerator_name = "bvh8";
+  double split_budget = 0.3;
+  int argi = 3;
+  if (argc >= 4 && argv[3][0] != '-')
+    max_trace_depth = atoi(argv[argi++]);
+
+  for ( ; argi < argc; ++argi)
+  {
+    if (strcmp(argv[argi], "-size") == 0 && argi + 2 < argc)
+    {
+      image_width = atoi(argv[++argi]);
+      image_height = atoi(argv[++argi]);
+    }
+    else if (strcmp(argv[argi], "-rpp") == 0 && argi + 1 < argc)
+      rays_per_pixel_edge = atoi(argv[++argi]);
+    else if (strcmp(argv[argi], "-seed") == 0 && argi + 1 < argc)
+      render_seed = (unsigned int)strtoul(argv[++argi], NULL, 10);
+    else if (strcmp(argv[argi], "-light-samples") == 0 && argi + 1 < argc)
+      area_light_samples = atoi(argv[++argi]);
+    else if (strcmp(argv[argi], "-light-picks") == 0 && argi + 1 < argc)
+      light_picks = atoi(argv[++argi]);
+    else if (strcmp(argv[argi], "-shadow-cache") == 0)
+      use_occluder_cache = true;
+    else if (strcmp(argv[argi], "-light-cull") == 0 && argi + 1 < argc)
+      light_cull_epsilon = atof(argv[++argi]);
+    else if (strcmp(argv[argi], "-light-roulette") == 0)
+      light_roulette = true;
+    else if (strcmp(argv[argi], "-path-cutoff") == 0 && argi + 1 < argc)
+      path_cutoff = atof(argv[++argi]);
+    else if (strcmp(argv[argi], "-path-roulette") == 0)
+      path_roulette = true;
+    else if (strcmp(argv[argi], "-wavefront") == 0)
+      use_wavefront = true;
+    else if (strcmp(argv[argi], "-fresnel-split") == 0)
+      fresnel_split = true;
+    else if (strcmp(argv[argi], "-sampler") == 0 && argi + 1 < argc)
+      sampler_name = argv[++argi];
+    else if (strcmp(argv[argi], "-accel") == 0 && argi + 1 < argc)
+      accelerator_name = argv[++argi];
+    else if (strcmp(argv[argi], "-split-budget") == 0 && argi + 1 < argc)
+      split_budget = atof(argv[++argi]);
+    else
+    {
+      std::cout << "Unknown option: " << argv[argi] << std::endl;
+      printUsage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (image_width <= 0 || image_height <= 0 || rays_per_pixel_edge <= 0)
+  {
+    std::cout << "Image size and rays per pixel edge must be positive" << std::endl;
     return -1;
   }
 
-  if (argc >= 4)
-    max_trace_depth = atoi(argv[3]);
+  if (max_trace_depth < 0 || max_trace_depth > MAX_TRACE_DEPTH)
+  {
+    std::cout << "Max trace depth must be between 0 and " << MAX_TRACE_DEPTH << std::endl;
+    return -1;
+  }
 
   cout << "Max trace depth = " << max_trace_depth << endl;
 
@@ -294,13 +903,52 @@ main(int argc, char ** argv)
   // Setup the world object, containing the data from the scene
   world = new World();
   importSceneToWorld(scene->getRoot(), identity3D(), 0);
+  world->buildSphereSets();
+  world->buildLightTree();
+
+  chrono::steady_clock::time_point build_start = chrono::steady_clock::now();
+  if (!world->buildAccelerator(accelerator_name, split_budget))
+  {
+    std::cout << "Unknown accelerator: " << accelerator_name << std::endl;
+    printUsage(argv[0]);
+    return -1;
+  }
+  std::cout << "Accelerator build time: " << chrono::duration<double>(chrono::steady_clock::now() - build_start).count()
+            << " s" << std::endl;
+
   world->printStats();
 
+  if (view == NULL)
+  {
+    std::cout << "ERROR: The scene has no camera" << std::endl;
+    return -1;
+  }
+
+  sampler = Sampler::create(sampler_name, render_seed, view->raysPerPixel());
+  if (sampler == NULL)
+  {
+    std::cout << "Unknown sampler: " << sampler_name << std::endl;
+    printUsage(argv[0]);
+    return -1;
+  }
+
   // Set up the output framebuffer
-  frame = new Frame(IMAGE_WIDTH, IMAGE_HEIGHT);
+  frame = new Frame(image_width, image_height);
 
   // Render the world
-  renderWithRaytracing();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  if (use_wavefront)
+    renderWavefront();
+  else
+    renderWithRaytracing();
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  double mrays = world->numRaysTraced() / 1.0e6;
+  std::cout << "Render time: " << seconds << " s" << std::endl;
+  std::cout << "Rays traced: " << world->numRaysTraced() << " (" << mrays / seconds << " Mrays/s)" << std::endl;
+  if (use_occluder_cache)
+    std::cout << "Occluder cache: " << occluder_cache_hits << " of " << occluder_cache_lookups << " shadow rays blocked by the "
+              << "cached occluder" << std::endl;
 
   // Save the output to an image file
   frame->save(argv[2]);